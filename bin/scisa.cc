@@ -2,20 +2,22 @@
 #include <scisasm.h>
 #include <scisavm.h>
 
-#include <cassert>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <vector>
 
-class TextIO: public scisavm::MemoryIO {
-public:
-	virtual void store(size_t, uint8_t val)
-	{
-		std::cerr << char(val);
-	}
-};
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 template<typename T>
 static void dumpCPU(scisavm::CPU<T> &cpu)
@@ -36,15 +38,37 @@ static void dumpCPU(scisavm::CPU<T> &cpu)
 }
 
 template<typename T>
-static int debugCPU(scisavm::CPU<T> &cpu)
+static int debugCPU(scisavm::CPU<T> &cpu, scisavm::ConsoleOut &console)
 {
+	// Without this, 'c' never comes back from a program which ends
+	// in a halt loop
+	cpu.detectIdle = true;
 	dumpCPU(cpu);
 	std::string line;
 	while (std::getline(std::cin, line)) {
-		cpu.step(1);
-		if (cpu.error) {
+		// 'b <addr>' sets a breakpoint, 'c' continues until something stops
+		// the CPU, anything else steps one instruction
+		if (line.starts_with("b ")) {
+			cpu.breakpoints.push_back(strtol(line.c_str() + 2, nullptr, 0));
+			continue;
+		}
+
+		scisavm::StepResult res;
+		if (line == "c") {
+			do {
+				res = cpu.step(1'000'000);
+			} while (res.reason == scisavm::StopReason::BUDGET);
+		} else {
+			res = cpu.step(1);
+		}
+
+		console.flush();
+		if (res.reason == scisavm::StopReason::ERROR) {
 			std::cout << "Error: " << cpu.error << '\n';
 			return 1;
+		} else if (res.reason == scisavm::StopReason::HALT) {
+			std::cout << "Halted\n";
+			return 0;
 		}
 
 		dumpCPU(cpu);
@@ -54,106 +78,147 @@ static int debugCPU(scisavm::CPU<T> &cpu)
 }
 
 template<typename T>
-static int runCPU(scisavm::CPU<T> &cpu)
+static void dumpFusions(scisavm::CPU<T> &cpu)
 {
-	while (!cpu.error) {
-		cpu.step(1024);
+	std::cerr << "Fusions:\n";
+	for (size_t i = 1; i < cpu.fusions.size(); ++i) {
+		std::cerr
+			<< "* " << scisavm::fusionName(scisavm::Fusion(i))
+			<< ": " << cpu.fusions[i] << '\n';
 	}
-
-	std::cout << "Error: " << cpu.error << '\n';
-	return 1;
 }
 
-struct Computer {
-	scisavm::CPU8 cpu;
-	std::vector<uint8_t> text;
-	std::vector<uint8_t> data;
-	TextIO textIO;
-};
-
-static int setupComputer(Computer &comp, char *path)
+template<typename T>
+static int runCPU(
+	scisavm::CPU<T> &cpu, scisavm::ConsoleOut &console, scisavm::ConsoleIn *input)
 {
-	std::fstream f(path);
-	if (f.bad()) {
-		std::cerr << "Failed to open " << path << '\n';
-		return 1;
+	cpu.detectIdle = true;
+	scisavm::StepResult res;
+	bool inputEnded = false;
+	while (true) {
+		res = cpu.step(1'000'000);
+		if (res.reason == scisavm::StopReason::BUDGET) {
+			console.poll();
+			continue;
+		}
+
+		// Park until there's input. Once the input has ended, the program
+		// gets to see that, but after that it's as stuck as if it had halted.
+		// Without any input, nothing can ever get it going again.
+		if (res.reason == scisavm::StopReason::IO_WAIT && input && !inputEnded) {
+			console.flush();
+			inputEnded = !input->wait();
+			continue;
+		}
+
+		break;
 	}
 
-	uint8_t word[4];
-	f.read((char *)word, 4);
-	if (f.gcount() != 4) {
-		std::cerr << "Short file\n";
-		return 1;
+	console.flush();
+	if (res.reason == scisavm::StopReason::ERROR) {
+		std::cout << "Error: " << cpu.error << '\n';
 	}
 
-	if (std::string_view((char *)word, 4) != "\033SCE") {
-		std::cerr << "Missing SCE magic\n";
-		return 1;
+	if (cpu.engine == scisavm::Engine::FUSED) {
+		dumpFusions(cpu);
 	}
 
-	while (true) {
-		f.read((char *)word, 4);
-		if (f.gcount() == 0) {
-			break;
-		} else if (f.gcount() != 4) {
-			std::cerr << "Short section name read\n";
-			return 1;
-		}
+	return res.reason == scisavm::StopReason::ERROR ? 1 : 0;
+}
 
-		std::string_view name((char *)word, 4);
-		std::vector<uint8_t> *section;
-		if (name == "TEXT") {
-			section = &comp.text;
-		} else if (name == "DATA") {
-			section = &comp.data;
-		} else {
-			std::cerr << "Unknown section name: '" << name << "'\n";
-			return 1;
-		}
+struct Computer {
+	scisavm::CPU8 cpu;
+	scisavm::Image image;
 
-		f.read((char *)word, 4);
-		if (f.gcount() != 4) {
-			std::cerr << "Short section size read\n";
-			return 1;
-		}
+	// Fills the rest of the address space after the data section
+	std::vector<uint8_t> extraData;
 
-		uint32_t size =
-			(uint32_t(word[0]) << 0) |
-			(uint32_t(word[1]) << 8) |
-			(uint32_t(word[2]) << 16) |
-			(uint32_t(word[3]) << 24);
+	scisavm::ConsoleOut console{{ .writerThread = true }};
 
-		section->resize(size);
-		f.read((char *)section->data(), size);
-		if (f.gcount() != size) {
-			std::cerr << "Short section data read";
-			return 1;
-		}
+	// Only set up for 'run --stdin', since 'dbg' reads commands from stdin
+	std::unique_ptr<scisavm::ConsoleIn> input;
+};
+
+static int setupComputer(Computer &comp, char *path, const char *aotPath = nullptr)
+{
+	std::string err;
+	if (scisavm::loadImage(path, comp.image, &err) < 0) {
+		std::cerr << err << '\n';
+		return 1;
 	}
 
-	std::cerr << "Loaded SCE:\n";
-	std::cerr << "* TEXT: " << comp.text.size() << " bytes\n";
-	std::cerr << "* DATA: " << comp.data.size() << " bytes\n";
+	std::cerr << "Loaded SCE v" << comp.image.version << ":\n";
+	std::cerr << "* TEXT: " << comp.image.text.size() << " bytes\n";
+	std::cerr << "* DATA: " << comp.image.data.size() << " bytes\n";
 	std::cerr << '\n';
 
-	comp.cpu.pmem = comp.text;
+	comp.cpu.pmem = comp.image.text;
+
+	if (aotPath && scisavm::loadAot(aotPath, comp.cpu.pmem, 8, comp.cpu.aot, &err) < 0) {
+		std::cerr << "Failed to load " << aotPath << ": " << err << '\n';
+		return 1;
+	}
 
-	comp.data.resize(256);
+	// The data section is used in place, the rest of memory is zeroed
+	auto data = comp.image.data.first(std::min<size_t>(comp.image.data.size(), 256));
 	comp.cpu.dmem.push_back({
 		.start = 0,
-		.data = comp.data,
+		.data = data,
 	});
 
+	if (data.size() < 256) {
+		comp.extraData.resize(256 - data.size());
+		comp.cpu.dmem.push_back({
+			.start = uint8_t(data.size()),
+			.data = comp.extraData,
+		});
+	}
+
 	comp.cpu.io.push_back({
 		.start = 255,
 		.size = 1,
-		.io = &comp.textIO,
+		.io = &comp.console,
 	});
 
 	return 0;
 }
 
-static int assemble(std::istream &is, std::ostream &os)
+static int writeFile(const char *path, std::string_view content)
+{
+	std::ofstream os(path, std::ios::binary | std::ios::trunc);
+	os.write(content.data(), content.size());
+	if (!os) {
+		std::cerr << "Failed to write " << path << '\n';
+		return 1;
+	}
+
+	return 0;
+}
+
+static int writeImage(const scisasm::Assembly &a, std::ostream &os, bool compress)
+{
+	uint32_t flags = compress ? uint32_t(scisavm::IMAGE_COMPRESSED) : 0;
+	scisavm::ImageSection sections[] = {
+		{ .name = "TEXT", .content = a.text.content, .flags = flags },
+		{ .name = "DATA", .content = a.data.content, .flags = flags },
+	};
+
+	std::vector<uint8_t> image = scisavm::encodeImage(sections);
+	os.write((const char *)image.data(), image.size());
+
+	std::cerr << "Written SCE:\n";
+	std::cerr << "* TEXT: " << a.text.content.size() << " bytes\n";
+	std::cerr << "* DATA: " << a.data.content.size() << " bytes\n";
+
+	if (os.bad()) {
+		std::cerr << "Output error\n";
+		return 1;
+	}
+
+	return 0;
+}
+
+static int assemble(std::istream &is, std::ostream &os, bool compress)
 {
 	if (is.bad()) {
 		std::cerr << "Input error\n";
@@ -177,45 +242,282 @@ static int assemble(std::istream &is, std::ostream &os)
 		return 1;
 	}
 
-	// Magic SCE header
-	os.write("\033SCE", 4);
-
-	// Write a section
-	auto writeSection = [&os](std::string_view name, std::span<uint8_t> content) {
-		assert(name.size() == 4);
-		os.write(name.data(), 4);
+	return writeImage(a, os, compress);
+}
 
-		uint32_t size = content.size();
-		uint8_t sizeBytes[] = {
-			uint8_t((size & 0x000000ffu) >> 0),
-			uint8_t((size & 0x0000ff00u) >> 8),
-			uint8_t((size & 0x00ff0000u) >> 16),
-			uint8_t((size & 0xff000000u) >> 24),
-		};
-		os.write((const char *)sizeBytes, 4);
-		os.write((const char *)content.data(), content.size());
+// Calls fn(i) for every i < n, spread over all cores
+template<typename Fn>
+static void parallelFor(size_t n, Fn fn)
+{
+	std::atomic<size_t> next = 0;
+	auto worker = [&] {
+		for (size_t i = next++; i < n; i = next++) {
+			fn(i);
+		}
 	};
 
-	writeSection("TEXT", a.text.content);
-	writeSection("DATA", a.data.content);
+	size_t count = std::min<size_t>(n, std::max(1u, std::thread::hardware_concurrency()));
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < count; ++i) {
+		threads.emplace_back(worker);
+	}
 
-	std::cerr << "Written SCE:\n";
-	std::cerr << "* TEXT: " << a.text.content.size() << " bytes\n";
-	std::cerr << "* DATA: " << a.data.content.size() << " bytes\n";
+	worker();
+	for (auto &thread: threads) {
+		thread.join();
+	}
+}
 
-	if (os.bad()) {
-		std::cerr << "Output error\n";
+static int readFile(const char *path, std::string &content)
+{
+	std::ifstream is(path, std::ios::binary);
+	if (!is) {
+		return -1;
+	}
+
+	std::stringstream ss;
+	ss << is.rdbuf();
+	content = std::move(ss).str();
+	return is.bad() ? -1 : 0;
+}
+
+// Assembles a source file, or loads an object file.
+// Sources are looked up in, and added to, 'cacheDir' if it's set.
+static int loadInput(
+	const char *path, const char *cacheDir, scisasm::Assembly &a, std::string *err)
+{
+	std::string content;
+	if (readFile(path, content) < 0) {
+		*err = "Failed to read file";
+		return -1;
+	}
+
+	std::span<const uint8_t> bytes((const uint8_t *)content.data(), content.size());
+	if (scisasm::isObject(bytes)) {
+		return scisasm::decodeObject(bytes, a, err);
+	}
+
+	if (cacheDir) {
+		int ret = scisasm::loadCached(cacheDir, content, a, err);
+		if (ret == 0) {
+			a.sources.push_back(path);
+			return 0;
+		} else if (ret < 0) {
+			std::cerr << "Warning: Failed to load cached assembly: " + *err + '\n';
+		}
+	}
+
+	a.sources.push_back(path);
+	if (scisasm::assemble(content, a, err) < 0) {
+		return -1;
+	}
+
+	if (cacheDir && scisasm::saveCached(cacheDir, content, a, err) < 0) {
+		std::cerr << "Warning: Failed to save cached assembly: " + *err + '\n';
+	}
+
+	return 0;
+}
+
+// Loads every input in parallel
+static int loadInputs(
+	std::span<char *const> paths, const char *cacheDir,
+	std::vector<scisasm::Assembly> &out)
+{
+	out.resize(paths.size());
+	std::vector<std::string> errs(paths.size());
+	std::vector<int> results(paths.size());
+	parallelFor(paths.size(), [&](size_t i) {
+		results[i] = loadInput(paths[i], cacheDir, out[i], &errs[i]);
+	});
+
+	for (size_t i = 0; i < paths.size(); ++i) {
+		if (results[i] < 0) {
+			std::cerr << paths[i] << ": " << errs[i] << '\n';
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// Assembles each source into an object file
+static int compileObjects(
+	std::span<char *const> paths, const char *outPath, const char *cacheDir)
+{
+	if (outPath && paths.size() != 1) {
+		std::cerr << "-o can only be used with -c for a single input\n";
 		return 1;
 	}
 
+	std::vector<scisasm::Assembly> objects;
+	if (loadInputs(paths, cacheDir, objects) != 0) {
+		return 1;
+	}
+
+	for (size_t i = 0; i < paths.size(); ++i) {
+		std::string out;
+		if (outPath) {
+			out = outPath;
+		} else {
+			// foo.s becomes foo.o
+			out = paths[i];
+			size_t slash = out.rfind('/');
+			size_t dot = out.rfind('.');
+			if (dot != out.npos && (slash == out.npos || dot > slash)) {
+				out.erase(dot);
+			}
+			out += ".o";
+		}
+
+		std::vector<uint8_t> obj = scisasm::encodeObject(objects[i]);
+		if (writeFile(out.c_str(), std::string_view((const char *)obj.data(), obj.size())) != 0) {
+			return 1;
+		}
+	}
+
 	return 0;
 }
 
+// Links sources and object files into an image
+static int linkProgram(
+	std::span<char *const> paths, const char *outPath,
+	const char *cacheDir, bool compress)
+{
+	std::vector<scisasm::Assembly> objects;
+	if (loadInputs(paths, cacheDir, objects) != 0) {
+		return 1;
+	}
+
+	scisasm::Assembly a;
+	std::string err;
+	if (scisasm::merge(objects, a, &err) < 0 || scisasm::link(a, &err) < 0) {
+		std::cerr << "Linker error: " << err << '\n';
+		return 1;
+	}
+
+	std::ofstream os(outPath, std::ios::binary | std::ios::trunc);
+	if (!os) {
+		std::cerr << "Failed to open " << outPath << '\n';
+		return 1;
+	}
+
+	return writeImage(a, os, compress);
+}
+
+// Translate a program to C++ and, unless the output is a .cc file,
+// compile it into a module for --aot
+static int translate(char *path, char *out, const char *cxx)
+{
+	scisavm::Image image;
+	std::string err;
+	if (scisavm::loadImage(path, image, &err) < 0) {
+		std::cerr << err << '\n';
+		return 1;
+	}
+
+	std::string src;
+	if (scisavm::translateAot(image.text, 8, src, &err) < 0) {
+		std::cerr << "Translation error: " << err << '\n';
+		return 1;
+	}
+
+	std::string_view outName = out;
+	if (outName.ends_with(".cc") || outName.ends_with(".cpp")) {
+		return writeFile(out, src);
+	}
+
+	const char *tmpdir = getenv("TMPDIR");
+	std::string tmp = std::string(tmpdir ? tmpdir : "/tmp") + "/scisa-aot-XXXXXX.cc";
+	int fd = mkstemps(tmp.data(), 3);
+	if (fd < 0) {
+		std::cerr << "Failed to create " << tmp << ": " << strerror(errno) << '\n';
+		return 1;
+	}
+	close(fd);
+
+	if (writeFile(tmp.c_str(), src) != 0) {
+		unlink(tmp.c_str());
+		return 1;
+	}
+
+	const char *argv[] = {
+		cxx, "-std=c++17", "-O2", "-shared", "-fPIC",
+		"-o", out, tmp.c_str(), nullptr,
+	};
+	pid_t pid;
+	int ret = posix_spawnp(&pid, cxx, nullptr, nullptr, (char **)argv, environ);
+	int status = 0;
+	if (ret == 0) {
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+	}
+	unlink(tmp.c_str());
+
+	if (ret != 0) {
+		std::cerr << "Failed to run " << cxx << ": " << strerror(ret) << '\n';
+		return 1;
+	} else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::cerr << "Compiling the translated program failed\n";
+		return 1;
+	}
+
+	std::cerr << "Translated " << image.text.size() << " bytes of TEXT to " << out << '\n';
+	return 0;
+}
+
+// Where compiled code is kept between runs
+static std::string cacheDir()
+{
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	if (xdg && *xdg) {
+		return std::string(xdg) + "/scisa";
+	}
+
+	const char *home = getenv("HOME");
+	if (home && *home) {
+		return std::string(home) + "/.cache/scisa";
+	}
+
+	return "";
+}
+
+static bool parseEngine(std::string_view name, scisavm::Engine &engine)
+{
+	if (name == "interp") {
+		engine = scisavm::Engine::INTERP;
+	} else if (name == "predecoded") {
+		engine = scisavm::Engine::PREDECODED;
+	} else if (name == "threaded") {
+		engine = scisavm::Engine::THREADED;
+	} else if (name == "jit") {
+		engine = scisavm::Engine::JIT;
+	} else if (name == "fused") {
+		engine = scisavm::Engine::FUSED;
+	} else if (name == "aot") {
+		engine = scisavm::Engine::AOT;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
 static void usage(const char *argv0)
 {
-	printf("Usage: %s run <file>\n", argv0);
-	printf("Usage: %s dbg <file>\n", argv0);
-	printf("Usage: %s asm [infile] [outfile]\n", argv0);
+	printf("Usage: %s run [options] <file>\n", argv0);
+	printf("Usage: %s dbg [options] <file>\n", argv0);
+	printf("Usage: %s asm [--compress] [infile] [outfile]\n", argv0);
+	printf("Usage: %s asm [--compress] [--cache-dir <dir>] -o <outfile> <infile>...\n", argv0);
+	printf("Usage: %s asm -c [--cache-dir <dir>] [-o <outfile>] <infile>...\n", argv0);
+	printf("Usage: %s link [--compress] [--cache-dir <dir>] -o <outfile> <file>...\n", argv0);
+	printf("Usage: %s aot [--cxx <compiler>] <file> <outfile>\n", argv0);
+	printf("\n");
+	printf("Options:\n");
+	printf("  --engine <interp|predecoded|threaded|jit|fused|aot>: Execution engine (default: jit)\n");
+	printf("  --aot <module>: Run a module from 'aot', implies --engine aot\n");
+	printf("  --no-cache: Don't keep compiled code in $XDG_CACHE_HOME/scisa between runs\n");
+	printf("  --cache-dir <dir>: Reuse assembled sources from <dir>, and add new ones to it\n");
+	printf("  --stdin: Let 'run' read stdin through registers at 253 and 254\n");
 }
 
 int main(int argc, char **argv)
@@ -227,35 +529,128 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	if (argv[1] == "dbg"sv && argc == 3) {
+	std::string_view cmd = argv[1];
+	std::vector<char *> args;
+	scisavm::Engine engine = scisavm::Engine::JIT;
+	bool compress = false;
+	const char *aotPath = nullptr;
+	const char *cxx = getenv("CXX");
+	bool useCache = true;
+	const char *outPath = nullptr;
+	bool compileOnly = false;
+	const char *asmCacheDir = nullptr;
+	bool mapStdin = false;
+	for (int i = 2; i < argc; ++i) {
+		if (argv[i] == "--engine"sv && i + 1 < argc) {
+			i += 1;
+			if (!parseEngine(argv[i], engine)) {
+				std::cerr << "Unknown engine: " << argv[i] << '\n';
+				return 1;
+			}
+		} else if (argv[i] == "--compress"sv) {
+			compress = true;
+		} else if (argv[i] == "--aot"sv && i + 1 < argc) {
+			i += 1;
+			aotPath = argv[i];
+			engine = scisavm::Engine::AOT;
+		} else if (argv[i] == "--no-cache"sv) {
+			useCache = false;
+		} else if (argv[i] == "--cxx"sv && i + 1 < argc) {
+			i += 1;
+			cxx = argv[i];
+		} else if (argv[i] == "-o"sv && i + 1 < argc) {
+			i += 1;
+			outPath = argv[i];
+		} else if (argv[i] == "--cache-dir"sv && i + 1 < argc) {
+			i += 1;
+			asmCacheDir = argv[i];
+		} else if (argv[i] == "-c"sv) {
+			compileOnly = true;
+		} else if (argv[i] == "--stdin"sv) {
+			mapStdin = true;
+		} else {
+			args.push_back(argv[i]);
+		}
+	}
+
+	if (cmd == "dbg" && mapStdin) {
+		std::cerr << "--stdin can't be used with dbg, which reads commands from stdin\n";
+		return 1;
+	}
+
+	if (cmd == "dbg" && args.size() == 1) {
 		Computer comp;
-		setupComputer(comp, argv[2]);
-		return debugCPU(comp.cpu);
+		if (setupComputer(comp, args[0], aotPath) != 0) {
+			return 1;
+		}
+		comp.cpu.engine = engine;
+		return debugCPU(comp.cpu, comp.console);
 	}
 
-	if (argv[1] == "run"sv && argc == 3) {
+	if (cmd == "run" && args.size() == 1) {
 		Computer comp;
-		setupComputer(comp, argv[2]);
-		return runCPU(comp.cpu);
+		if (setupComputer(comp, args[0], aotPath) != 0) {
+			return 1;
+		}
+		comp.cpu.engine = engine;
+
+		// The program reads stdin through a status register at 253
+		// and a data register at 254. That's opt-in, since those
+		// addresses are plain memory otherwise.
+		if (mapStdin) {
+			comp.input = std::make_unique<scisavm::ConsoleIn>();
+			comp.cpu.io.push_back({
+				.start = 253,
+				.size = 2,
+				.io = comp.input.get(),
+			});
+		}
+
+		// Don't compile the same program again on every run
+		std::string dir = useCache && engine == scisavm::Engine::JIT ? cacheDir() : "";
+		std::string err;
+		if (!dir.empty() && comp.cpu.loadCompiled(dir.c_str(), &err) < 0) {
+			std::cerr << "Warning: Failed to load compiled code: " << err << '\n';
+		}
+
+		int ret = runCPU(comp.cpu, comp.console, comp.input.get());
+		if (!dir.empty() && comp.cpu.saveCompiled(dir.c_str(), &err) < 0) {
+			std::cerr << "Warning: Failed to save compiled code: " << err << '\n';
+		}
+		return ret;
+	}
+
+	if (cmd == "asm" && compileOnly && args.size() > 0) {
+		return compileObjects(args, outPath, asmCacheDir);
 	}
 
-	if (argv[1] == "asm"sv && argc <= 4) {
-		if (argc == 2) {
-			return assemble(std::cin, std::cout);
+	if ((cmd == "asm" || cmd == "link") && outPath && args.size() > 0) {
+		return linkProgram(args, outPath, asmCacheDir, compress);
+	}
+
+	if (cmd == "asm" && !outPath && !compileOnly && args.size() <= 2) {
+		if (args.size() == 0) {
+			return assemble(std::cin, std::cout, compress);
 		}
 
-		std::fstream is(argv[2]);
-		if (argc == 3) {
-			return assemble(is, std::cout);
+		std::fstream is(args[0]);
+		if (args.size() == 1) {
+			return assemble(is, std::cout, compress);
 		}
 
-		std::fstream os(argv[3], std::fstream::out | std::fstream::trunc);
-		return assemble(is, os);
+		std::fstream os(args[1], std::fstream::out | std::fstream::trunc);
+		return assemble(is, os, compress);
+	}
+
+	if (cmd == "aot" && args.size() == 2) {
+		return translate(args[0], args[1], cxx ? cxx : "c++");
 	}
 
-	if (argv[1] == "dis"sv && argc == 3) {
+	if (cmd == "dis" && args.size() == 1) {
 		Computer comp;
-		setupComputer(comp, argv[2]);
+		if (setupComputer(comp, args[0]) != 0) {
+			return 1;
+		}
 		int idx = 0;
 		std::string str;
 		char buf[8];
@@ -2,7 +2,10 @@
 #define SCISASM_H
 
 #include <istream>
+#include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <variant>
 #include <vector>
@@ -11,24 +14,75 @@
 
 namespace scisasm {
 
+// Symbols are interned, and referred to by their index in the SymbolTable
+using SymbolId = uint32_t;
+
+constexpr SymbolId NO_SYMBOL = ~SymbolId(0);
+
 struct Relocation {
 	struct Relative {
-		std::string label;
+		SymbolId symbol;
 		int offset = 0;
 	};
 	struct Absolute {
-		std::string label;
+		SymbolId symbol;
 	};
 
 	size_t index;
 	int linenum;
 	std::variant<std::monostate, Relative, Absolute> substitute;
+
+	// Whether 'index' is into the data section rather than the text
+	bool data = false;
+
+	// Index into Assembly::sources of the file it came from
+	uint32_t source = 0;
 };
 
 struct Section {
 	std::vector<uint8_t> text;
 };
 
+// Symbols are case insensitive, and can be looked up by string_view
+struct SymbolHash {
+	using is_transparent = void;
+	size_t operator()(std::string_view str) const;
+};
+
+struct SymbolEqual {
+	using is_transparent = void;
+	bool operator()(std::string_view a, std::string_view b) const;
+};
+
+// Gives every distinct symbol name a dense ID.
+// Names are stored upper case in an arena, so that they never move.
+class SymbolTable {
+public:
+	SymbolTable() = default;
+	SymbolTable(const SymbolTable &other);
+	SymbolTable(SymbolTable &&other);
+	SymbolTable &operator=(const SymbolTable &other);
+	SymbolTable &operator=(SymbolTable &&other);
+
+	SymbolId intern(std::string_view name);
+
+	// NO_SYMBOL if the name hasn't been interned
+	SymbolId find(std::string_view name) const;
+
+	std::string_view name(SymbolId id) const { return names_[id]; }
+	size_t size() const { return names_.size(); }
+
+private:
+	static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+	std::vector<std::unique_ptr<char[]>> chunks_;
+	char *next_ = nullptr;
+	size_t free_ = 0;
+
+	std::vector<std::string_view> names_;
+	std::unordered_map<std::string_view, SymbolId, SymbolHash, SymbolEqual> ids_;
+};
+
 struct Assembly {
 	struct Section {
 		size_t offset = 0;
@@ -36,8 +90,10 @@ struct Assembly {
 	};
 
 	struct Label {
-		size_t offset;
-		Section Assembly::* section;
+		size_t offset = 0;
+
+		// nullptr if the label hasn't been defined
+		Section Assembly::* section = nullptr;
 	};
 
 	Section text;
@@ -45,9 +101,17 @@ struct Assembly {
 	Section Assembly::* currentSection = &Assembly::text;
 	std::vector<uint8_t> &current() { return (this->*currentSection).content; }
 
-	std::unordered_map<std::string, Label> labels;
-	std::unordered_map<std::string, int> defines;
+	// Interns 'name', making room for it in 'labels' and 'defines'
+	SymbolId symbol(std::string_view name);
+
+	// 'labels' and 'defines' are indexed by SymbolId
+	SymbolTable symbols;
+	std::vector<Label> labels;
+	std::vector<std::optional<int>> defines;
 	std::vector<Relocation> relocations;
+
+	// Names of the source files, used in error messages
+	std::vector<std::string> sources;
 };
 
 struct Result {
@@ -55,10 +119,119 @@ struct Result {
 	int line;
 };
 
+int assemble(std::string_view src, Assembly &a, std::string *err);
 int assemble(std::istream &is, Assembly &a, std::string *err);
+// Resolves every relocation. Instructions which refer to a symbol get
+// their shortest encoding, and conditional branches which are out of
+// range become an inverted branch over a JMP; text labels move along.
+// Code which branches over such an instruction by a literal offset,
+// rather than to a label, may break.
 int link(Assembly &a, std::string *err);
 int disasm(std::span<const uint8_t> instr, std::string &out);
 
+// Assembles a source which is edited a few lines at a time,
+// for editors and live reloading. Every line is parsed once;
+// an edit only parses the new lines, and patches their bytes and
+// relocations into the assembly before it's linked again.
+class Session {
+public:
+	// Replaces 'count' lines, starting at the 0 based line 'first',
+	// with the lines of 'src', then assembles and links the result.
+	// Returns 0 on success, or -1 with 'err' set to the first error,
+	// as assemble() and link() would report it.
+	int edit(size_t first, size_t count, std::string_view src, std::string *err);
+
+	size_t lines() const { return lines_.size(); }
+
+	// The linked assembly, valid after edit() returned 0
+	const Assembly &assembly() const { return linked_; }
+
+private:
+	using SectionPtr = Assembly::Section Assembly::*;
+
+	static constexpr size_t NO_LINE = ~size_t(0);
+
+	// What a line emits, independent of the lines around it
+	struct Line {
+		std::vector<uint8_t> bytes;
+
+		// Every symbol the line refers to, with 'index' relative to the
+		// start of the line. Defines are only substituted during layout.
+		std::vector<Relocation> refs;
+
+		SymbolId label = NO_SYMBOL;
+		SymbolId define = NO_SYMBOL;
+		int value = 0;
+
+		// Set for .text and .data
+		SectionPtr switchTo = nullptr;
+
+		// Set if the line doesn't assemble, in which case
+		// it's laid out as if it was empty
+		const char *error = nullptr;
+	};
+
+	// Where a line ended up in 'out_'
+	struct Placement {
+		SectionPtr section = nullptr;
+		size_t offset = 0;
+		size_t size = 0;
+		size_t reloc = 0;
+		size_t relocCount = 0;
+		SymbolId label = NO_SYMBOL;
+	};
+
+	std::unique_ptr<Line> parseLine(std::string_view text, int linenum);
+	void emitLine(
+		const Line &line, Placement &place, size_t index,
+		std::vector<uint8_t> &bytes, std::vector<Relocation> &relocs);
+	bool patch(size_t first, size_t count, std::vector<std::unique_ptr<Line>> &added);
+	int rebuild(std::string *err);
+
+	// Lines are kept behind pointers, so that inserting lines
+	// doesn't move everything after them.
+	// 'layout_' is kept next to them, with one Placement per line.
+	std::vector<std::unique_ptr<Line>> lines_;
+	std::vector<Placement> layout_;
+
+	// Parses lines, and owns the symbol table
+	Assembly scratch_;
+
+	Assembly out_;
+
+	// link() can resize instructions, so 'out_' is linked into a copy
+	Assembly linked_;
+
+	// The line of each symbol's define, indexed by SymbolId
+	std::vector<size_t> defineLines_;
+
+	// The number of lines with an error
+	size_t errors_ = 0;
+
+	// Whether 'out_' has to be laid out from scratch,
+	// because the last layout found a duplicate label or define
+	bool dirty_ = false;
+};
+
+// Relocatable objects hold an Assembly which hasn't been linked yet,
+// so that files can be assembled separately
+bool isObject(std::span<const uint8_t> data);
+std::vector<uint8_t> encodeObject(const Assembly &a);
+int decodeObject(std::span<const uint8_t> data, Assembly &a, std::string *err);
+
+// Combines assemblies into one which can be linked.
+// Each one's text and data go after those of the ones before it.
+int merge(std::span<const Assembly> in, Assembly &out, std::string *err);
+
+// A content-addressed cache of assembled sources, kept in 'dir'.
+// Entries are keyed by a hash of the source, and hold a copy of it
+// so that a hash collision can't give the wrong result.
+// Both return 0 on success, or -1 with 'err' set;
+// loadCached() returns 1 if 'src' isn't in the cache, and leaves
+// a.sources empty. saveCached() creates 'dir' if necessary.
+int loadCached(const char *dir, std::string_view src, Assembly &a, std::string *err);
+int saveCached(const char *dir, std::string_view src, const Assembly &a, std::string *err);
+
 }
 
 #endif
@@ -0,0 +1,158 @@
+#include "scisasm.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <random>
+
+namespace scisasm {
+
+// Bumped whenever assemble() would produce something different
+// for the same source, so that stale entries are never used
+static constexpr uint32_t CACHE_VERSION = 1;
+
+// Cache file layout, little endian: "SCISAASM", u64 version,
+// u64 source size, the source, then an object file.
+static constexpr char CACHE_MAGIC[8] = { 'S', 'C', 'I', 'S', 'A', 'A', 'S', 'M' };
+static constexpr size_t HEADER_SIZE = 24;
+
+static int fail(std::string *err, std::string msg)
+{
+	if (err) {
+		*err = std::move(msg);
+	}
+	return -1;
+}
+
+static uint64_t readU64(const uint8_t *ptr)
+{
+	uint64_t val = 0;
+	for (int i = 7; i >= 0; --i) {
+		val = (val << 8) | ptr[i];
+	}
+	return val;
+}
+
+static void writeU64(uint8_t *ptr, uint64_t val)
+{
+	for (int i = 0; i < 8; ++i) {
+		ptr[i] = uint8_t(val >> (i * 8));
+	}
+}
+
+static bool readAll(std::FILE *f, std::vector<uint8_t> &out)
+{
+	uint8_t buf[64 * 1024];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+		out.insert(out.end(), buf, buf + n);
+	}
+
+	return !ferror(f);
+}
+
+static bool writeAll(std::FILE *f, const void *data, size_t size)
+{
+	return size == 0 || fwrite(data, 1, size, f) == size;
+}
+
+// Entries are keyed by the source's FNV-1a hash and the cache version
+static std::string cachePath(const char *dir, std::string_view src)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (char ch: src) {
+		hash = (hash ^ uint8_t(ch)) * 0x100000001b3ull;
+	}
+
+	char name[64];
+	snprintf(
+		name, sizeof(name), "/asm-%016llx-v%u.o",
+		(unsigned long long)hash, unsigned(CACHE_VERSION));
+	return dir + std::string(name);
+}
+
+int loadCached(const char *dir, std::string_view src, Assembly &a, std::string *err)
+{
+	std::string path = cachePath(dir, src);
+	std::FILE *f = fopen(path.c_str(), "rb");
+	if (!f) {
+		return errno == ENOENT ? 1 : fail(err, path + ": " + strerror(errno));
+	}
+
+	std::vector<uint8_t> file;
+	bool ok = readAll(f, file);
+	fclose(f);
+	if (!ok) {
+		return fail(err, path + ": Read error");
+	}
+
+	// Anything which doesn't look exactly right is ignored,
+	// and will be overwritten by the next save
+	if (
+		file.size() < HEADER_SIZE ||
+		memcmp(file.data(), CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+		readU64(file.data() + 8) != CACHE_VERSION ||
+		readU64(file.data() + 16) != src.size() ||
+		file.size() - HEADER_SIZE < src.size() ||
+		memcmp(file.data() + HEADER_SIZE, src.data(), src.size()) != 0
+	) {
+		return 1;
+	}
+
+	auto obj = std::span(file).subspan(HEADER_SIZE + src.size());
+	if (decodeObject(obj, a, nullptr) < 0) {
+		a = Assembly();
+		return 1;
+	}
+
+	a.sources.clear();
+	return 0;
+}
+
+int saveCached(const char *dir, std::string_view src, const Assembly &a, std::string *err)
+{
+	// Create the directory and any missing parents
+	std::error_code ec;
+	std::filesystem::create_directories(dir, ec);
+	if (ec) {
+		return fail(err, std::string(dir) + ": " + ec.message());
+	}
+
+	uint8_t header[HEADER_SIZE];
+	memcpy(header, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	writeU64(header + 8, CACHE_VERSION);
+	writeU64(header + 16, src.size());
+	std::vector<uint8_t> obj = encodeObject(a);
+
+	// Write to a temporary file first, so that other processes
+	// never see a half written file. The random suffix keeps
+	// processes saving the same entry out of each other's way.
+	std::string path = cachePath(dir, src);
+	std::string tmp = path + ".tmp" + std::to_string(std::random_device{}());
+	std::FILE *f = fopen(tmp.c_str(), "wb");
+	if (!f) {
+		return fail(err, tmp + ": " + strerror(errno));
+	}
+
+	bool ok =
+		writeAll(f, header, sizeof(header)) &&
+		writeAll(f, src.data(), src.size()) &&
+		writeAll(f, obj.data(), obj.size());
+	ok = fclose(f) == 0 && ok;
+	if (!ok) {
+		std::filesystem::remove(tmp, ec);
+		return fail(err, tmp + ": Write error");
+	}
+
+	std::filesystem::rename(tmp, path, ec);
+	if (ec) {
+		std::string msg = path + ": " + ec.message();
+		std::filesystem::remove(tmp, ec);
+		return fail(err, std::move(msg));
+	}
+
+	return 0;
+}
+
+}
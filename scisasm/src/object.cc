@@ -0,0 +1,363 @@
+#include "scisasm.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace scisasm {
+
+// Object file layout, all integers little endian:
+//
+//   header:      "\033SCO", u32 version, u32 reserved
+//   sources:     u32 count, then for each: u32 length, name
+//   text, data:  u32 size, content
+//   symbols:     u32 count, then for each:
+//                u32 length, name, u32 section, u32 offset
+//   relocations: u32 count, then for each:
+//                u32 section, u32 index, u32 line, u32 source,
+//                u32 kind, u32 symbol, i32 offset
+//
+// Symbols are stored in SymbolId order, so relocations refer to them
+// by index. A symbol's section is 0 if it's only referred to.
+static constexpr uint32_t OBJECT_VERSION = 2;
+
+enum ObjectSection: uint32_t {
+	SECTION_NONE = 0,
+	SECTION_TEXT = 1,
+	SECTION_DATA = 2,
+};
+
+enum RelocationKind: uint32_t {
+	RELOC_RELATIVE = 1,
+	RELOC_ABSOLUTE = 2,
+};
+
+static int fail(std::string *err, std::string msg)
+{
+	if (err) {
+		*err = std::move(msg);
+	}
+	return -1;
+}
+
+static void writeU32(std::vector<uint8_t> &out, uint32_t val)
+{
+	out.push_back(uint8_t((val & 0x000000ffu) >> 0));
+	out.push_back(uint8_t((val & 0x0000ff00u) >> 8));
+	out.push_back(uint8_t((val & 0x00ff0000u) >> 16));
+	out.push_back(uint8_t((val & 0xff000000u) >> 24));
+}
+
+static void writeBytes(std::vector<uint8_t> &out, std::span<const uint8_t> bytes)
+{
+	writeU32(out, bytes.size());
+	out.insert(out.end(), bytes.begin(), bytes.end());
+}
+
+static void writeString(std::vector<uint8_t> &out, std::string_view str)
+{
+	writeBytes(out, std::span((const uint8_t *)str.data(), str.size()));
+}
+
+class ObjectReader {
+public:
+	ObjectReader(std::span<const uint8_t> data): data_(data) {}
+
+	bool u32(uint32_t &val)
+	{
+		if (data_.size() - pos_ < 4) {
+			return false;
+		}
+
+		const uint8_t *ptr = data_.data() + pos_;
+		val =
+			(uint32_t(ptr[0]) << 0) |
+			(uint32_t(ptr[1]) << 8) |
+			(uint32_t(ptr[2]) << 16) |
+			(uint32_t(ptr[3]) << 24);
+		pos_ += 4;
+		return true;
+	}
+
+	bool bytes(std::span<const uint8_t> &out)
+	{
+		uint32_t size;
+		if (!u32(size) || data_.size() - pos_ < size) {
+			return false;
+		}
+
+		out = data_.subspan(pos_, size);
+		pos_ += size;
+		return true;
+	}
+
+	bool string(std::string_view &out)
+	{
+		std::span<const uint8_t> span;
+		if (!bytes(span)) {
+			return false;
+		}
+
+		out = std::string_view((const char *)span.data(), span.size());
+		return true;
+	}
+
+private:
+	size_t pos_ = 0;
+	std::span<const uint8_t> data_;
+};
+
+bool isObject(std::span<const uint8_t> data)
+{
+	return data.size() >= 4 && memcmp(data.data(), "\033SCO", 4) == 0;
+}
+
+std::vector<uint8_t> encodeObject(const Assembly &a)
+{
+	std::vector<uint8_t> out(4);
+	memcpy(out.data(), "\033SCO", 4);
+	writeU32(out, OBJECT_VERSION);
+	writeU32(out, 0);
+
+	writeU32(out, a.sources.size());
+	for (const std::string &source: a.sources) {
+		writeString(out, source);
+	}
+
+	writeBytes(out, a.text.content);
+	writeBytes(out, a.data.content);
+
+	writeU32(out, a.symbols.size());
+	for (SymbolId id = 0; id < a.symbols.size(); ++id) {
+		const Assembly::Label &label = a.labels[id];
+		uint32_t section = SECTION_NONE;
+		if (label.section == &Assembly::text) {
+			section = SECTION_TEXT;
+		} else if (label.section == &Assembly::data) {
+			section = SECTION_DATA;
+		}
+
+		writeString(out, a.symbols.name(id));
+		writeU32(out, section);
+		writeU32(out, label.offset);
+	}
+
+	writeU32(out, a.relocations.size());
+	for (const Relocation &reloc: a.relocations) {
+		uint32_t kind = 0;
+		SymbolId symbol = NO_SYMBOL;
+		int offset = 0;
+		if (auto *r = std::get_if<Relocation::Relative>(&reloc.substitute); r) {
+			kind = RELOC_RELATIVE;
+			symbol = r->symbol;
+			offset = r->offset;
+		} else if (auto *r = std::get_if<Relocation::Absolute>(&reloc.substitute); r) {
+			kind = RELOC_ABSOLUTE;
+			symbol = r->symbol;
+		}
+
+		writeU32(out, reloc.data ? SECTION_DATA : SECTION_TEXT);
+		writeU32(out, reloc.index);
+		writeU32(out, reloc.linenum);
+		writeU32(out, reloc.source);
+		writeU32(out, kind);
+		writeU32(out, symbol);
+		writeU32(out, uint32_t(offset));
+	}
+
+	return out;
+}
+
+int decodeObject(std::span<const uint8_t> data, Assembly &a, std::string *err)
+{
+	if (!isObject(data)) {
+		return fail(err, "Not an object file");
+	}
+
+	ObjectReader r(data.subspan(4));
+	uint32_t version, reserved;
+	if (!r.u32(version) || !r.u32(reserved)) {
+		return fail(err, "Truncated object file");
+	}
+
+	if (version != OBJECT_VERSION) {
+		return fail(err, "Unsupported object version: " + std::to_string(version));
+	}
+
+	a = Assembly();
+
+	uint32_t count;
+	if (!r.u32(count)) {
+		return fail(err, "Truncated object file");
+	}
+
+	for (uint32_t i = 0; i < count; ++i) {
+		std::string_view source;
+		if (!r.string(source)) {
+			return fail(err, "Truncated object file");
+		}
+
+		a.sources.emplace_back(source);
+	}
+
+	std::span<const uint8_t> text, dataSection;
+	if (!r.bytes(text) || !r.bytes(dataSection)) {
+		return fail(err, "Truncated object file");
+	}
+
+	a.text.content.assign(text.begin(), text.end());
+	a.data.content.assign(dataSection.begin(), dataSection.end());
+
+	if (!r.u32(count)) {
+		return fail(err, "Truncated object file");
+	}
+
+	for (uint32_t i = 0; i < count; ++i) {
+		std::string_view name;
+		uint32_t section, offset;
+		if (!r.string(name) || !r.u32(section) || !r.u32(offset)) {
+			return fail(err, "Truncated object file");
+		}
+
+		SymbolId id = a.symbol(name);
+		if (id != i) {
+			return fail(err, "Duplicate symbol '" + std::string(name) + "' in object file");
+		}
+
+		if (section == SECTION_TEXT) {
+			a.labels[id] = { .offset = offset, .section = &Assembly::text };
+		} else if (section == SECTION_DATA) {
+			a.labels[id] = { .offset = offset, .section = &Assembly::data };
+		} else if (section != SECTION_NONE) {
+			return fail(err, "Invalid section for symbol '" + std::string(name) + "'");
+		}
+	}
+
+	if (!r.u32(count)) {
+		return fail(err, "Truncated object file");
+	}
+
+	std::vector<size_t> textIndexes;
+	for (uint32_t i = 0; i < count; ++i) {
+		uint32_t section, index, linenum, source, kind, symbol, offset;
+		if (
+			!r.u32(section) || !r.u32(index) || !r.u32(linenum) || !r.u32(source) ||
+			!r.u32(kind) || !r.u32(symbol) || !r.u32(offset)
+		) {
+			return fail(err, "Truncated object file");
+		}
+
+		// link() patches the section at 'index'
+		bool isData = section == SECTION_DATA;
+		const auto &content = isData ? a.data.content : a.text.content;
+		if (
+			(section != SECTION_TEXT && !isData) ||
+			index >= content.size() || symbol >= a.symbols.size()
+		) {
+			return fail(err, "Invalid relocation in object file");
+		}
+
+		if (!isData) {
+			textIndexes.push_back(index);
+		}
+
+		Relocation reloc = {
+			.index = index,
+			.linenum = int(linenum),
+			.substitute = std::monostate{},
+			.data = isData,
+			.source = source,
+		};
+
+		if (kind == RELOC_RELATIVE) {
+			reloc.substitute = Relocation::Relative {
+				.symbol = symbol,
+				.offset = int(offset),
+			};
+		} else if (kind == RELOC_ABSOLUTE) {
+			reloc.substitute = Relocation::Absolute {
+				.symbol = symbol,
+			};
+		} else {
+			return fail(err, "Invalid relocation in object file");
+		}
+
+		a.relocations.push_back(reloc);
+	}
+
+	// Every instruction is an opcode and at most one parameter byte,
+	// so link() relies on text relocations being at least 2 bytes apart
+	std::sort(textIndexes.begin(), textIndexes.end());
+	for (size_t i = 1; i < textIndexes.size(); ++i) {
+		if (textIndexes[i] < textIndexes[i - 1] + 2) {
+			return fail(err, "Overlapping relocations in object file");
+		}
+	}
+
+	return 0;
+}
+
+int merge(std::span<const Assembly> in, Assembly &out, std::string *err)
+{
+	out = Assembly();
+
+	std::vector<SymbolId> ids;
+	for (const Assembly &a: in) {
+		size_t textBase = out.text.content.size();
+		size_t dataBase = out.data.content.size();
+		uint32_t sourceBase = out.sources.size();
+
+		out.text.content.insert(out.text.content.end(), a.text.content.begin(), a.text.content.end());
+		out.data.content.insert(out.data.content.end(), a.data.content.begin(), a.data.content.end());
+
+		// Keep source indexes pointing at the right file
+		// even for assemblies without sources
+		if (a.sources.empty()) {
+			out.sources.emplace_back();
+		} else {
+			out.sources.insert(out.sources.end(), a.sources.begin(), a.sources.end());
+		}
+
+		ids.resize(a.symbols.size());
+		for (SymbolId id = 0; id < a.symbols.size(); ++id) {
+			ids[id] = out.symbol(a.symbols.name(id));
+
+			const Assembly::Label &label = a.labels[id];
+			if (!label.section) {
+				continue;
+			}
+
+			Assembly::Label &merged = out.labels[ids[id]];
+			if (merged.section) {
+				std::string msg;
+				if (!a.sources.empty()) {
+					msg += a.sources[0];
+					msg += ": ";
+				}
+				msg += "Duplicate label '";
+				msg += a.symbols.name(id);
+				msg += '\'';
+				return fail(err, std::move(msg));
+			}
+
+			merged.section = label.section;
+			merged.offset = label.offset;
+			merged.offset += label.section == &Assembly::text ? textBase : dataBase;
+		}
+
+		for (Relocation reloc: a.relocations) {
+			reloc.index += reloc.data ? dataBase : textBase;
+			reloc.source += sourceBase;
+			if (auto *r = std::get_if<Relocation::Relative>(&reloc.substitute); r) {
+				r->symbol = ids[r->symbol];
+			} else if (auto *r = std::get_if<Relocation::Absolute>(&reloc.substitute); r) {
+				r->symbol = ids[r->symbol];
+			}
+
+			out.relocations.push_back(reloc);
+		}
+	}
+
+	return 0;
+}
+
+}
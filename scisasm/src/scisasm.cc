@@ -1,10 +1,18 @@
 #include "scisasm.h"
 
+#include <algorithm>
+#include <array>
+#include <sstream>
+#include <utility>
+#include <string_view>
+
 namespace scisasm {
 
+// Reads through a view into the source, so that tokens
+// can be sliced out of it without copying
 class Reader {
 public:
-	Reader(const std::string &str): str_(str) {}
+	Reader(std::string_view str): str_(str) {}
 
 	int peek()
 	{
@@ -17,16 +25,21 @@ public:
 
 	bool eof() { return index_ >= str_.size(); }
 
-	std::string_view rest() { return std::string_view(str_).substr(index_); }
+	size_t index() { return index_; }
+
+	std::string_view rest() { return str_.substr(index_); }
+
+	// Everything consumed since 'start'
+	std::string_view since(size_t start) { return str_.substr(start, index_ - start); }
 
 	void consume() { index_ += 1; }
 
 private:
 	size_t index_ = 0;
-	const std::string &str_;
+	std::string_view str_;
 };
 
-static char upper(char ch)
+static constexpr char upper(char ch)
 {
 	// a..z - 32 maps to A..Z in ASCII
 	if (ch >= 'a' && ch <= 'z') {
@@ -36,12 +49,135 @@ static char upper(char ch)
 	}
 }
 
-static void upper(std::string &str)
+// Case insensitive comparison against an upper case string
+static bool eqUpper(std::string_view str, std::string_view upperStr)
+{
+	if (str.size() != upperStr.size()) {
+		return false;
+	}
+
+	for (size_t i = 0; i < str.size(); ++i) {
+		if (upper(str[i]) != upperStr[i]) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+size_t SymbolHash::operator()(std::string_view str) const
+{
+	// FNV-1a
+	size_t hash = 14695981039346656037ull;
+	for (char ch: str) {
+		hash ^= uint8_t(upper(ch));
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
+}
+
+bool SymbolEqual::operator()(std::string_view a, std::string_view b) const
+{
+	if (a.size() != b.size()) {
+		return false;
+	}
+
+	for (size_t i = 0; i < a.size(); ++i) {
+		if (upper(a[i]) != upper(b[i])) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+SymbolTable::SymbolTable(const SymbolTable &other)
+{
+	*this = other;
+}
+
+SymbolTable::SymbolTable(SymbolTable &&other)
+{
+	*this = std::move(other);
+}
+
+SymbolTable &SymbolTable::operator=(const SymbolTable &other)
+{
+	if (this == &other) {
+		return *this;
+	}
+
+	// The names have to be copied into our own arena
+	*this = SymbolTable();
+	names_.reserve(other.names_.size());
+	for (std::string_view name: other.names_) {
+		intern(name);
+	}
+
+	return *this;
+}
+
+SymbolTable &SymbolTable::operator=(SymbolTable &&other)
+{
+	chunks_ = std::move(other.chunks_);
+	next_ = std::exchange(other.next_, nullptr);
+	free_ = std::exchange(other.free_, 0);
+	names_ = std::move(other.names_);
+	ids_ = std::move(other.ids_);
+	other.chunks_.clear();
+	other.names_.clear();
+	other.ids_.clear();
+	return *this;
+}
+
+SymbolId SymbolTable::intern(std::string_view name)
+{
+	auto it = ids_.find(name);
+	if (it != ids_.end()) {
+		return it->second;
+	}
+
+	if (free_ < name.size()) {
+		// Unusually long names get a chunk of their own
+		size_t size = std::max(CHUNK_SIZE, name.size());
+		chunks_.push_back(std::make_unique<char[]>(size));
+		next_ = chunks_.back().get();
+		free_ = size;
+	}
+
+	char *str = next_;
+	for (size_t i = 0; i < name.size(); ++i) {
+		str[i] = upper(name[i]);
+	}
+	next_ += name.size();
+	free_ -= name.size();
+
+	SymbolId id = SymbolId(names_.size());
+	names_.emplace_back(str, name.size());
+	ids_.emplace(names_.back(), id);
+	return id;
+}
+
+SymbolId SymbolTable::find(std::string_view name) const
+{
+	auto it = ids_.find(name);
+	if (it == ids_.end()) {
+		return NO_SYMBOL;
+	}
+
+	return it->second;
+}
+
+SymbolId Assembly::symbol(std::string_view name)
 {
-	for (auto it = str.begin(); it != str.end(); ++it) {
-		char ch = *it;
-		*it = upper(ch);
+	SymbolId id = symbols.intern(name);
+	if (id >= labels.size()) {
+		labels.resize(id + 1);
+		defines.resize(id + 1);
 	}
+
+	return id;
 }
 
 static bool chIsWhitespace(char ch)
@@ -132,7 +268,7 @@ static int parseNumeric(std::string_view str)
 	}
 
 	if (str[0] == '\'') {
-		char ch = upper(str[1]);
+		char ch = str[1];
 		if (ch == '\\') {
 			ch = str[2];
 			if (ch == 'n') {
@@ -175,8 +311,195 @@ static void skipSpace(Reader &r)
 	}
 }
 
+// How the parameter of an instruction is encoded
+enum class Encoding {
+	SPECIAL, // No parameter, 'code' is the whole instruction
+	SPECIAL_PARAM, // 'code' is the first byte, followed by a literal byte
+	ABSOLUTE, // 'code' is the opcode, labels are absolute
+	RELATIVE, // 'code' is the opcode, labels are relative
+	POP, // 'code' is the opcode, the parameter is a register or VOID
+};
+
+struct Mnemonic {
+	std::string_view name;
+	uint8_t code;
+	Encoding enc;
+
+	// Aliases are accepted by the assembler,
+	// but the disassembler prints the canonical name
+	bool alias = false;
+};
+
+// Every instruction
+static constexpr Mnemonic mnemonics[] = {
+	{ "ADC", 0b00011, Encoding::ABSOLUTE },
+	{ "ADD", 0b00001, Encoding::ABSOLUTE },
+	{ "AND", 0b00101, Encoding::ABSOLUTE },
+	{ "B", 0b10101, Encoding::RELATIVE },
+	{ "BCC", 0b10110, Encoding::RELATIVE },
+	{ "BCS", 0b10111, Encoding::RELATIVE },
+	{ "BEQ", 0b11000, Encoding::RELATIVE },
+	{ "BGE", 0b10110, Encoding::RELATIVE, true },
+	{ "BLT", 0b10111, Encoding::RELATIVE, true },
+	{ "BMI", 0b11010, Encoding::RELATIVE },
+	{ "BNE", 0b11001, Encoding::RELATIVE },
+	{ "BPL", 0b11011, Encoding::RELATIVE },
+	{ "BVC", 0b11101, Encoding::RELATIVE },
+	{ "BVS", 0b11100, Encoding::RELATIVE },
+	{ "BZC", 0b11001, Encoding::RELATIVE, true },
+	{ "BZS", 0b11000, Encoding::RELATIVE, true },
+	{ "CMP", 0b00111, Encoding::ABSOLUTE },
+	{ "INC", 0b00000'011, Encoding::SPECIAL },
+	{ "JLR", 0b10100, Encoding::ABSOLUTE },
+	{ "JMP", 0b10011, Encoding::ABSOLUTE },
+	{ "LDA", 0b01111, Encoding::ABSOLUTE },
+	{ "LDW", 0b01110, Encoding::ABSOLUTE },
+	{ "LDX", 0b01101, Encoding::ABSOLUTE },
+	// LSL is ADD %A, and ROL is ADC %A
+	{ "LSL", 0b00001'011, Encoding::SPECIAL, true },
+	{ "LSP", 0b00000'100, Encoding::SPECIAL_PARAM },
+	{ "LSR", 0b00000'001, Encoding::SPECIAL },
+	{ "LSW", 0b00000'110, Encoding::SPECIAL_PARAM },
+	{ "MHA", 0b01011, Encoding::ABSOLUTE },
+	{ "MVA", 0b01010, Encoding::ABSOLUTE },
+	{ "MVX", 0b01000, Encoding::ABSOLUTE },
+	{ "MVY", 0b01001, Encoding::ABSOLUTE },
+	{ "NOP", 0b00000'000, Encoding::SPECIAL },
+	{ "OR", 0b00110, Encoding::ABSOLUTE },
+	{ "POP", 0b11111, Encoding::POP },
+	{ "PUSH", 0b11110, Encoding::ABSOLUTE },
+	{ "ROL", 0b00011'011, Encoding::SPECIAL, true },
+	{ "ROR", 0b00000'010, Encoding::SPECIAL },
+	{ "SPS", 0b01100, Encoding::ABSOLUTE },
+	{ "SSP", 0b00000'101, Encoding::SPECIAL_PARAM },
+	{ "SSW", 0b00000'111, Encoding::SPECIAL_PARAM },
+	{ "STA", 0b10010, Encoding::ABSOLUTE },
+	{ "STW", 0b10001, Encoding::ABSOLUTE },
+	{ "STX", 0b10000, Encoding::ABSOLUTE },
+	{ "SUB", 0b00010, Encoding::ABSOLUTE },
+	{ "XOR", 0b00100, Encoding::ABSOLUTE },
+};
+
+static_assert(std::all_of(
+	std::begin(mnemonics), std::end(mnemonics),
+	[](const Mnemonic &m) { return m.name.size() <= 4; }));
+
+// Packs up to four characters of a mnemonic into an integer
+// which sorts the same way as the upper case string
+static constexpr uint32_t mnemonicKey(std::string_view name)
+{
+	uint32_t key = 0;
+	for (size_t i = 0; i < 4; ++i) {
+		key <<= 8;
+		if (i < name.size()) {
+			key |= uint8_t(upper(name[i]));
+		}
+	}
+
+	return key;
+}
+
+static constexpr auto mnemonicKeys = [] {
+	std::array<uint32_t, std::size(mnemonics)> keys;
+	for (size_t i = 0; i < keys.size(); ++i) {
+		keys[i] = mnemonicKey(mnemonics[i].name);
+	}
+
+	return keys;
+}();
+
+// Mnemonics are looked up through a perfect hash of their key.
+// The multiplier is searched for at compile time,
+// so that no two mnemonics end up in the same slot.
+static constexpr int HASH_BITS = 8;
+
+static constexpr uint32_t mnemonicHash(uint32_t key, uint32_t mult)
+{
+	return (key * mult) >> (32 - HASH_BITS);
+}
+
+static constexpr uint32_t hashMult = [] {
+	for (uint32_t mult = 1;; mult += 2) {
+		bool used[1 << HASH_BITS] = {};
+		bool ok = true;
+		for (uint32_t key: mnemonicKeys) {
+			uint32_t hash = mnemonicHash(key, mult);
+			if (used[hash]) {
+				ok = false;
+				break;
+			}
+
+			used[hash] = true;
+		}
+
+		if (ok) {
+			return mult;
+		}
+	}
+}();
+
+// Maps a hash to an index in 'mnemonics', or -1
+static constexpr auto hashTable = [] {
+	std::array<int8_t, 1 << HASH_BITS> table;
+	table.fill(-1);
+	for (size_t i = 0; i < mnemonicKeys.size(); ++i) {
+		table[mnemonicHash(mnemonicKeys[i], hashMult)] = int8_t(i);
+	}
+
+	return table;
+}();
+
+static const Mnemonic *findMnemonic(std::string_view op)
+{
+	if (op.size() == 0 || op.size() > 4) {
+		return nullptr;
+	}
+
+	uint32_t key = mnemonicKey(op);
+	int index = hashTable[mnemonicHash(key, hashMult)];
+	if (index < 0 || mnemonicKeys[index] != key) {
+		return nullptr;
+	}
+
+	return &mnemonics[index];
+}
+
+// Maps every first byte of an instruction to its index in 'mnemonics',
+// or -1 for bytes which aren't valid instructions
+static constexpr auto disasmTable = [] {
+	std::array<int8_t, 256> table;
+	table.fill(-1);
+
+	for (size_t i = 0; i < std::size(mnemonics); ++i) {
+		const Mnemonic &m = mnemonics[i];
+		if (m.alias) {
+			continue;
+		}
+
+		switch (m.enc) {
+		case Encoding::SPECIAL:
+		case Encoding::SPECIAL_PARAM:
+			table[m.code] = int8_t(i);
+			break;
+		case Encoding::ABSOLUTE:
+		case Encoding::RELATIVE:
+			for (int param = 0; param < 8; ++param) {
+				table[(m.code << 3) | param] = int8_t(i);
+			}
+			break;
+		case Encoding::POP:
+			for (int param = 0; param < 4; ++param) {
+				table[(m.code << 3) | param] = int8_t(i);
+			}
+			break;
+		}
+	}
+
+	return table;
+}();
+
 static int emitSpecial(
-	uint8_t lo, const std::string &param,
+	uint8_t lo, std::string_view param,
 	Assembly &a, const char **err)
 {
 	if (param != "") {
@@ -189,7 +512,7 @@ static int emitSpecial(
 }
 
 static int emitSpecialWithParam(
-	uint8_t lo, const std::string &param,
+	uint8_t lo, std::string_view param,
 	Assembly &a, const char **err)
 {
 	if (param == "") {
@@ -210,13 +533,42 @@ static int emitSpecialWithParam(
 	return -1;
 }
 
-enum Relativity {
-	RELATIVE,
-	ABSOLUTE,
-};
+// Emits the byte following an instruction which refers to 'label',
+// which is either a define or something to be relocated
+static void emitLabel(
+	std::string_view label, Encoding enc,
+	Assembly &a, int linenum)
+{
+	SymbolId id = a.symbol(label);
+	if (a.defines[id]) {
+		a.current().push_back(uint8_t(*a.defines[id]));
+		return;
+	}
+
+	Relocation reloc = {
+		.index = a.current().size(),
+		.linenum = linenum,
+		.substitute = std::monostate{},
+		.data = a.currentSection == &Assembly::data,
+	};
+
+	if (enc == Encoding::RELATIVE) {
+		reloc.substitute = Relocation::Relative {
+			.symbol = id,
+			.offset = -1,
+		};
+	} else {
+		reloc.substitute = Relocation::Absolute {
+			.symbol = id,
+		};
+	}
+
+	a.relocations.push_back(reloc);
+	a.current().push_back(0);
+}
 
 static int emitNormal(
-	uint8_t hi, const std::string &param, Relativity rel,
+	uint8_t hi, std::string_view param, Encoding enc,
 	Assembly &a, int linenum, const char **err)
 {
 	hi <<= 3;
@@ -226,17 +578,17 @@ static int emitNormal(
 		return -1;
 	}
 
-	if (param == "%X") {
+	if (eqUpper(param, "%X")) {
 		a.current().push_back(hi | 0b001);
 		return 0;
 	}
 
-	if (param == "%Y") {
+	if (eqUpper(param, "%Y")) {
 		a.current().push_back(hi | 0b010);
 		return 0;
 	}
 
-	if (param == "%A") {
+	if (eqUpper(param, "%A")) {
 		a.current().push_back(hi | 0b011);
 		return 0;
 	}
@@ -257,35 +609,7 @@ static int emitNormal(
 	// Handle a constant label
 	if (strIsIdent(param)) {
 		a.current().push_back(hi | 0b100);
-
-		auto it = a.defines.find(param);
-		if (it != a.defines.end()) {
-			a.current().push_back(uint8_t(it->second));
-			return 0;
-		}
-
-		Relocation reloc = {
-			.index = a.current().size(),
-			.linenum = linenum,
-			.substitute = std::monostate{},
-		};
-
-		switch (rel) {
-		case RELATIVE:
-			reloc.substitute = Relocation::Relative {
-				.label = param,
-				.offset = -1,
-			};
-			break;
-		case ABSOLUTE:
-			reloc.substitute = Relocation::Absolute {
-				.label = param,
-			};
-			break;
-		};
-
-		a.relocations.push_back(std::move(reloc));
-		a.current().push_back(0);
+		emitLabel(param, enc, a, linenum);
 		return 0;
 	}
 
@@ -293,15 +617,17 @@ static int emitNormal(
 	if (param[0] == '%') {
 		Reader r(param);
 		r.consume();
-		switch (r.peek()) {
+
+		uint8_t reg;
+		switch (upper(r.peek())) {
 		case 'X':
-			a.current().push_back(hi | 0b101);
+			reg = 0b001;
 			break;
 		case 'Y':
-			a.current().push_back(hi | 0b110);
+			reg = 0b010;
 			break;
 		case 'A':
-			a.current().push_back(hi | 0b111);
+			reg = 0b011;
 			break;
 		default:
 			*err = "Bad register";
@@ -321,32 +647,19 @@ static int emitNormal(
 		auto rest = r.rest();
 
 		if (strIsIdent(rest)) {
-			std::string restStr = std::string(rest);
-			auto it = a.defines.find(restStr);
-			if (it != a.defines.end()) {
-				a.current().push_back(uint8_t(it->second));
-				return 0;
-			}
-
-			Relocation reloc = {
-				.index = a.current().size(),
-				.linenum = linenum,
-				.substitute = Relocation::Absolute {
-					.label = param,
-				},
-			};
-			a.relocations.push_back(std::move(reloc));
-			a.current().push_back(0);
+			a.current().push_back(hi | 0b100 | reg);
+			emitLabel(rest, Encoding::ABSOLUTE, a, linenum);
 			return 0;
 		}
 
 		if (strIsNumeric(rest)) {
 			int num = parseNumeric(rest);
 			if (num == 0) {
-				a.current().push_back(hi | 0b000);
+				a.current().push_back(hi | reg);
 				return 0;
 			}
 
+			a.current().push_back(hi | 0b100 | reg);
 			a.current().push_back(uint8_t(num));
 			return 0;
 		}
@@ -356,207 +669,97 @@ static int emitNormal(
 	return -1;
 }
 
-static int emitInstr(
-	const std::string &op,
-	const std::string &param,
-	Assembly &a, int linenum, const char **err)
+static int emitPop(
+	uint8_t hi, std::string_view param,
+	Assembly &a, const char **err)
 {
-	if (op == "NOP") {
-		return emitSpecial(0b000, param, a, err);
-	}
-
-	if (op == "LSR") {
-		return emitSpecial(0b001, param, a, err);
-	}
-
-	if (op == "LSL") {
-		return emitSpecial(0b00001'011, param, a, err);
-	}
-
-	if (op == "ROR") {
-		return emitSpecial(0b010, param, a, err);
-	}
-
-	if (op == "INC") {
-		return emitSpecial(0b011, param, a, err);
-	}
-
-	if (op == "LSP") {
-		return emitSpecialWithParam(0b100, param, a, err);
-	}
-
-	if (op == "SSP") {
-		return emitSpecialWithParam(0b101, param, a, err);
-	}
-
-	if (op == "LSW") {
-		return emitSpecialWithParam(0b110, param, a, err);
-	}
-
-	if (op == "SSW") {
-		return emitSpecialWithParam(0b111, param, a, err);
-	}
-
-	if (op == "ROL") {
-		return emitSpecial(0b00011'011, param, a, err);
-	}
-
-	if (op == "ADD") {
-		return emitNormal(0b00001, param, ABSOLUTE, a, linenum, err);
-	}
-
-	if (op == "SUB") {
-		return emitNormal(0b00010, param, ABSOLUTE, a, linenum, err);
-	}
-
-	if (op == "ADC") {
-		return emitNormal(0b00011, param, ABSOLUTE, a, linenum, err);
-	}
-
-	if (op == "XOR") {
-		return emitNormal(0b00100, param, ABSOLUTE, a, linenum, err);
-	}
-
-	if (op == "AND") {
-		return emitNormal(0b00101, param, ABSOLUTE, a, linenum, err);
-	}
-
-	if (op == "OR") {
-		return emitNormal(0b00110, param, ABSOLUTE, a, linenum, err);
-	}
-
-	if (op == "CMP") {
-		return emitNormal(0b00111, param, ABSOLUTE, a, linenum, err);
-	}
-
-	if (op == "MVX") {
-		return emitNormal(0b01000, param, ABSOLUTE, a, linenum, err);
-	}
-
-	if (op == "MVY") {
-		return emitNormal(0b01001, param, ABSOLUTE, a, linenum, err);
-	}
-
-	if (op == "MVA") {
-		return emitNormal(0b01010, param, ABSOLUTE, a, linenum, err);
-	}
-
-	if (op == "MHA") {
-		return emitNormal(0b01011, param, ABSOLUTE, a, linenum, err);
-	}
-
-	if (op == "SPS") {
-		return emitNormal(0b01100, param, ABSOLUTE, a, linenum, err);
-	}
-
-	if (op == "LDX") {
-		return emitNormal(0b01101, param, ABSOLUTE, a, linenum, err);
-	}
-
-	if (op == "LDW") {
-		return emitNormal(0b01110, param, ABSOLUTE, a, linenum, err);
-	}
-
-	if (op == "LDA") {
-		return emitNormal(0b01111, param, ABSOLUTE, a, linenum, err);
-	}
-
-	if (op == "STX") {
-		return emitNormal(0b10000, param, ABSOLUTE, a, linenum, err);
-	}
-
-	if (op == "STW") {
-		return emitNormal(0b10001, param, ABSOLUTE, a, linenum, err);
-	}
-
-	if (op == "STA") {
-		return emitNormal(0b10010, param, ABSOLUTE, a, linenum, err);
-	}
-
-	if (op == "JMP") {
-		return emitNormal(0b10011, param, ABSOLUTE, a, linenum, err);
-	}
-
-	if (op == "JLR") {
-		return emitNormal(0b10100, param, ABSOLUTE, a, linenum, err);
-	}
-
-	if (op == "B") {
-		return emitNormal(0b10101, param, RELATIVE, a, linenum, err);
-	}
+	hi <<= 3;
 
-	if (op == "BCC" || op == "BGE") {
-		return emitNormal(0b10110, param, RELATIVE, a, linenum, err);
+	if (eqUpper(param, "VOID")) {
+		a.current().push_back(hi | 0b000);
+		return 0;
 	}
 
-	if (op == "BCS" || op == "BLT") {
-		return emitNormal(0b10111, param, RELATIVE, a, linenum, err);
+	if (eqUpper(param, "%X")) {
+		a.current().push_back(hi | 0b001);
+		return 0;
 	}
 
-	if (op == "BEQ" || op == "BZS") {
-		return emitNormal(0b11000, param, RELATIVE, a, linenum, err);
+	if (eqUpper(param, "%Y")) {
+		a.current().push_back(hi | 0b010);
+		return 0;
 	}
 
-	if (op == "BNE" || op == "BZC") {
-		return emitNormal(0b11001, param, RELATIVE, a, linenum, err);
+	if (eqUpper(param, "%A")) {
+		a.current().push_back(hi | 0b011);
+		return 0;
 	}
 
-	if (op == "BMI") {
-		return emitNormal(0b11010, param, RELATIVE, a, linenum, err);
-	}
+	*err = "Unknown POP parameter";
+	return -1;
+}
 
-	if (op == "BPL") {
-		return emitNormal(0b11011, param, RELATIVE, a, linenum, err);
+static int emitInstr(
+	std::string_view op,
+	std::string_view param,
+	Assembly &a, int linenum, const char **err)
+{
+	const Mnemonic *m = findMnemonic(op);
+	if (!m) {
+		*err = "Unknown instruction";
+		return -1;
 	}
 
-	if (op == "BVS") {
-		return emitNormal(0b11100, param, RELATIVE, a, linenum, err);
+	switch (m->enc) {
+	case Encoding::SPECIAL:
+		return emitSpecial(m->code, param, a, err);
+	case Encoding::SPECIAL_PARAM:
+		return emitSpecialWithParam(m->code, param, a, err);
+	case Encoding::ABSOLUTE:
+	case Encoding::RELATIVE:
+		return emitNormal(m->code, param, m->enc, a, linenum, err);
+	case Encoding::POP:
+		return emitPop(m->code, param, a, err);
 	}
 
-	if (op == "BVC") {
-		return emitNormal(0b11101, param, RELATIVE, a, linenum, err);
-	}
+	*err = "Unknown instruction";
+	return -1;
+}
 
-	if (op == "PUSH") {
-		return emitNormal(0b11110, param, ABSOLUTE, a, linenum, err);
+// Parses the parameter of .define
+static int parseDefine(
+	std::string_view param, std::string_view &key, int &val,
+	const char **err)
+{
+	Reader r(param);
+	if (!chIsInitialIdent(r.peek())) {
+		*err = "Invalid identifier";
+		return -1;
 	}
 
-	if (op == "POP") {
-		if (param == "VOID") {
-			a.current().push_back(0b11111'000);
-			return 0;
-		}
-
-		if (param == "%X") {
-			a.current().push_back(0b11111'001);
-			return 0;
-		}
-
-		if (param == "%Y") {
-			a.current().push_back(0b11111'010);
-			return 0;
-		}
-
-		if (param == "%A") {
-			a.current().push_back(0b11111'011);
-			return 0;
-		}
+	do {
+		r.consume();
+	} while (chIsIdent(r.peek()));
+	key = r.since(0);
 
-		*err = "Unknown POP parameter";
+	skipSpace(r);
+	std::string_view rest = r.rest();
+	if (!strIsNumeric(rest)) {
+		*err = "Invalid value";
 		return -1;
 	}
 
-	*err = "Unknown instruction";
-	return -1;
+	val = parseNumeric(rest);
+	return 0;
 }
 
 static int handleDirective(
-	const std::string &op,
-	const std::string &param,
+	std::string_view op,
+	std::string_view param,
 	Assembly &a,
 	const char **err)
 {
-	if (op == ".TEXT") {
+	if (eqUpper(op, ".TEXT")) {
 		if (param != "") {
 			*err = "No parameter expected";
 			return -1;
@@ -566,7 +769,7 @@ static int handleDirective(
 		return 0;
 	}
 
-	if (op == ".DATA") {
+	if (eqUpper(op, ".DATA")) {
 		if (param != "") {
 			*err = "No parameter expected";
 			return -1;
@@ -576,7 +779,8 @@ static int handleDirective(
 		return 0;
 	}
 
-	if (op == ".ASCII" || op == ".STRING") {
+	bool isString = eqUpper(op, ".STRING");
+	if (isString || eqUpper(op, ".ASCII")) {
 		Reader r(param);
 		if (r.peek() != '"') {
 			*err = "Expected '\"'";
@@ -603,7 +807,7 @@ static int handleDirective(
 					return -1;
 				}
 
-				ch = upper(r.peek());
+				ch = r.peek();
 				r.consume();
 				if (ch == '\\' || ch == '"') {
 					data.push_back(ch);
@@ -630,14 +834,14 @@ static int handleDirective(
 			return -1;
 		}
 
-		if (op == ".STRING") {
+		if (isString) {
 			data.push_back(0);
 		}
 
 		return 0;
 	}
 
-	if (op == ".BYTE") {
+	if (eqUpper(op, ".BYTE")) {
 		if (!strIsNumeric(param)) {
 			*err = "Invalid parameter";
 			return -1;
@@ -647,7 +851,7 @@ static int handleDirective(
 		return 0;
 	}
 
-	if (op == ".WORD") {
+	if (eqUpper(op, ".WORD")) {
 		if (!strIsNumeric(param)) {
 			*err = "Invalid parameter";
 			return -1;
@@ -659,38 +863,20 @@ static int handleDirective(
 		return 0;
 	}
 
-	if (op == ".DEFINE") {
-		Reader r(param);
-		if (!chIsInitialIdent(r.peek())) {
-			*err = "Invalid identifier";
-			return -1;
-		}
-
-		std::string key;
-		do {
-			key += r.peek();
-			r.consume();
-		} while (chIsIdent(r.peek()));
-		upper(key);
-
-		skipSpace(r);
-		std::string val;
-		while (!r.eof()) {
-			val += r.peek();
-			r.consume();
-		}
-
-		if (!strIsNumeric(val)) {
-			*err = "Invalid value";
+	if (eqUpper(op, ".DEFINE")) {
+		std::string_view key;
+		int val;
+		if (parseDefine(param, key, val, err) < 0) {
 			return -1;
 		}
 
-		if (a.defines.contains(key)) {
+		SymbolId id = a.symbol(key);
+		if (a.defines[id]) {
 			*err = "Duplicate define";
 			return -1;
 		}
 
-		a.defines[key] = parseNumeric(val);
+		a.defines[id] = val;
 		return 0;
 	}
 
@@ -698,24 +884,37 @@ static int handleDirective(
 	return -1;
 }
 
-static int assembleLine(Assembly &a, Reader r, int linenum, const char **err)
-{
-	std::string op;
-	std::string param;
+// A line split into its parts, before anything is emitted
+struct LineParts {
+	enum Kind {
+		EMPTY,
+		LABEL,
+		DIRECTIVE,
+		INSTRUCTION,
+	};
 
+	Kind kind = EMPTY;
+
+	// The label, directive or mnemonic
+	std::string_view op;
+	std::string_view param;
+};
+
+[[gnu::always_inline]] static inline int splitLine(Reader r, LineParts &parts, const char **err)
+{
 	skipSpace(r);
 	if (r.eof()) {
+		parts.kind = LineParts::EMPTY;
 		return 0;
 	}
 
-	op.clear();
+	size_t start = r.index();
 	if (chIsInitialIdent(r.peek()) || r.peek() == '.') {
 		do {
-			op += r.peek();
 			r.consume();
 		} while (chIsIdent(r.peek()));
 	}
-	upper(op);
+	std::string_view op = r.since(start);
 
 	skipSpace(r);
 
@@ -732,164 +931,735 @@ static int assembleLine(Assembly &a, Reader r, int linenum, const char **err)
 			return -1;
 		}
 
-		if (a.labels.contains(op)) {
+		parts.kind = LineParts::LABEL;
+		parts.op = op;
+		return 0;
+	}
+
+	std::string_view param = r.rest();
+	while (param.size() > 0 && chIsWhitespace(param.back())) {
+		param.remove_suffix(1);
+	}
+
+	if (op.size() > 0 && op[0] == '.') {
+		parts.kind = LineParts::DIRECTIVE;
+	} else {
+		parts.kind = LineParts::INSTRUCTION;
+	}
+
+	parts.op = op;
+	parts.param = param;
+	return 0;
+}
+
+static int assembleLine(Assembly &a, Reader r, int linenum, const char **err)
+{
+	LineParts parts;
+	if (splitLine(r, parts, err) < 0) {
+		return -1;
+	}
+
+	switch (parts.kind) {
+	case LineParts::EMPTY:
+		return 0;
+
+	case LineParts::LABEL: {
+		SymbolId id = a.symbol(parts.op);
+		if (a.labels[id].section) {
 			*err = "Duplicate label";
 			return -1;
 		}
 
-		a.labels[op] = {
+		a.labels[id] = {
 			.offset = a.current().size(),
 			.section = a.currentSection,
 		};
 		return 0;
 	}
 
-	param.clear();
-	size_t lastNonWhitespace = 0;
-	while (!r.eof()) {
-		char ch = r.peek();
-		if (!chIsWhitespace(ch)) {
-			lastNonWhitespace = param.size();
+	case LineParts::DIRECTIVE:
+		return handleDirective(parts.op, parts.param, a, err);
+
+	case LineParts::INSTRUCTION:
+		return emitInstr(parts.op, parts.param, a, linenum, err);
+	}
+
+	return 0;
+}
+
+int assemble(std::string_view src, Assembly &a, std::string *err)
+{
+	int linenum = 0;
+
+	while (src.size() > 0) {
+		linenum += 1;
+
+		size_t end = src.find('\n');
+		std::string_view line = src.substr(0, end);
+		if (end == src.npos) {
+			src = {};
+		} else {
+			src.remove_prefix(end + 1);
 		}
 
-		param += ch;
-		r.consume();
+		size_t comment = line.find(';');
+		if (comment != line.npos) {
+			line = line.substr(0, comment);
+		}
+
+		const char *errStr;
+		if (assembleLine(a, Reader(line), linenum, &errStr) < 0) {
+			if (err) {
+				*err = "Line ";
+				*err += std::to_string(linenum);
+				*err += ": ";
+				*err += errStr;
+			}
+			return -1;
+		}
 	}
 
-	if (lastNonWhitespace < param.size()) {
-		param.erase(lastNonWhitespace + 1);
+	return 0;
+}
+
+int assemble(std::istream &is, Assembly &a, std::string *err)
+{
+	// Lines are views into the source, so read it all up front
+	std::stringstream ss;
+	ss << is.rdbuf();
+	return assemble(std::string_view(ss.view()), a, err);
+}
+
+// Replaces 'count' elements at 'pos' with the contents of 'with'
+template<typename T>
+static void splice(std::vector<T> &vec, size_t pos, size_t count, std::vector<T> &with)
+{
+	size_t common = std::min(count, with.size());
+	std::move(with.begin(), with.begin() + common, vec.begin() + pos);
+	if (count > common) {
+		vec.erase(vec.begin() + pos + common, vec.begin() + pos + count);
+	} else {
+		vec.insert(
+			vec.begin() + pos + common,
+			std::make_move_iterator(with.begin() + common),
+			std::make_move_iterator(with.end()));
 	}
+}
 
-	skipSpace(r);
-	if (!r.eof()) {
-		*err = "Unexpected trailing garbage after instruction";
-		return -1;
+std::unique_ptr<Session::Line> Session::parseLine(std::string_view text, int linenum)
+{
+	size_t comment = text.find(';');
+	if (comment != text.npos) {
+		text = text.substr(0, comment);
 	}
 
-	if (op[0] == '.') {
-		if (handleDirective(op, param, a, err) < 0) {
-			return -1;
+	auto line = std::make_unique<Line>();
+	LineParts parts;
+	if (splitLine(Reader(text), parts, &line->error) < 0) {
+		return line;
+	}
+
+	// Lines are emitted into a scratch assembly which never has any
+	// labels or defines, so that every symbol becomes a relocation
+	Assembly &a = scratch_;
+	a.currentSection = &Assembly::text;
+	a.text.content.clear();
+	a.relocations.clear();
+
+	switch (parts.kind) {
+	case LineParts::EMPTY:
+		return line;
+
+	case LineParts::LABEL:
+		line->label = a.symbol(parts.op);
+		return line;
+
+	case LineParts::DIRECTIVE:
+		if (eqUpper(parts.op, ".DEFINE")) {
+			std::string_view key;
+			if (parseDefine(parts.param, key, line->value, &line->error) == 0) {
+				line->define = a.symbol(key);
+			}
+			return line;
 		}
 
-		return 0;
+		if (handleDirective(parts.op, parts.param, a, &line->error) < 0) {
+			return line;
+		}
+
+		if (eqUpper(parts.op, ".TEXT")) {
+			line->switchTo = &Assembly::text;
+		} else if (eqUpper(parts.op, ".DATA")) {
+			line->switchTo = &Assembly::data;
+		}
+		break;
+
+	case LineParts::INSTRUCTION:
+		if (emitInstr(parts.op, parts.param, a, linenum, &line->error) < 0) {
+			return line;
+		}
+		break;
 	}
 
-	upper(param);
-	if (emitInstr(op, param, a, linenum, err) < 0) {
-		return -1;
+	line->bytes = a.text.content;
+	line->refs = a.relocations;
+	return line;
+}
+
+// Appends the line's bytes and relocations, substituting the defines
+// which come before it. place.offset has to be set already.
+void Session::emitLine(
+	const Line &line, Placement &place, size_t index,
+	std::vector<uint8_t> &bytes, std::vector<Relocation> &relocs)
+{
+	size_t start = bytes.size();
+	bytes.insert(bytes.end(), line.bytes.begin(), line.bytes.end());
+
+	place.size = line.bytes.size();
+	place.reloc = relocs.size();
+	place.relocCount = 0;
+	for (const Relocation &ref: line.refs) {
+		SymbolId id = NO_SYMBOL;
+		if (auto *r = std::get_if<Relocation::Relative>(&ref.substitute); r) {
+			id = r->symbol;
+		} else if (auto *r = std::get_if<Relocation::Absolute>(&ref.substitute); r) {
+			id = r->symbol;
+		}
+
+		if (defineLines_[id] < index) {
+			bytes[start + ref.index] = uint8_t(*out_.defines[id]);
+			continue;
+		}
+
+		Relocation &reloc = relocs.emplace_back(ref);
+		reloc.index = place.offset + ref.index;
+		reloc.linenum = int(index + 1);
+		reloc.data = place.section == &Assembly::data;
+		place.relocCount += 1;
+	}
+}
+
+// Patches the edited lines into 'out_' without laying out the rest,
+// which works as long as the edit doesn't involve sections or defines.
+// Returns false if 'out_' has to be rebuilt instead.
+bool Session::patch(size_t first, size_t count, std::vector<std::unique_ptr<Line>> &added)
+{
+	if (dirty_) {
+		return false;
 	}
 
-	return 0;
+	auto simple = [](const std::unique_ptr<Line> &line) {
+		return !line->switchTo && line->define == NO_SYMBOL;
+	};
+
+	auto old = std::span(lines_).subspan(first, count);
+	if (!std::all_of(old.begin(), old.end(), simple)) {
+		return false;
+	} else if (!std::all_of(added.begin(), added.end(), simple)) {
+		return false;
+	}
+
+	// The edited lines continue where the line before them left off
+	SectionPtr section = &Assembly::text;
+	size_t start = 0;
+	size_t relocStart = 0;
+	if (first > 0) {
+		const Placement &prev = layout_[first - 1];
+		section = prev.section;
+		start = prev.offset + prev.size;
+		relocStart = prev.reloc + prev.relocCount;
+	}
+
+	size_t oldSize = 0;
+	size_t oldRelocs = 0;
+	for (size_t i = first; i < first + count; ++i) {
+		const Placement &place = layout_[i];
+		oldSize += place.size;
+		oldRelocs += place.relocCount;
+		errors_ -= lines_[i]->error ? 1 : 0;
+		if (place.label != NO_SYMBOL) {
+			out_.labels[place.label] = {};
+		}
+	}
+
+	std::vector<Placement> places(added.size());
+	size_t offset = start;
+	for (size_t i = 0; i < added.size(); ++i) {
+		const Line &line = *added[i];
+		places[i].section = section;
+		places[i].offset = offset;
+		places[i].label = line.label;
+		offset += line.bytes.size();
+		errors_ += line.error ? 1 : 0;
+		if (line.label == NO_SYMBOL) {
+			continue;
+		}
+
+		// Let rebuild() report the duplicate
+		if (out_.labels[line.label].section) {
+			return false;
+		}
+
+		out_.labels[line.label] = {
+			.offset = places[i].offset,
+			.section = section,
+		};
+	}
+
+	size_t addedCount = added.size();
+	ptrdiff_t lineDelta = ptrdiff_t(addedCount) - ptrdiff_t(count);
+	for (size_t &line: defineLines_) {
+		if (line != NO_LINE && line >= first + count) {
+			line += lineDelta;
+		}
+	}
+
+	std::vector<uint8_t> bytes;
+	std::vector<Relocation> relocs;
+	for (size_t i = 0; i < addedCount; ++i) {
+		emitLine(*added[i], places[i], first + i, bytes, relocs);
+		places[i].reloc += relocStart;
+	}
+
+	ptrdiff_t delta = ptrdiff_t(bytes.size()) - ptrdiff_t(oldSize);
+	ptrdiff_t relocDelta = ptrdiff_t(relocs.size()) - ptrdiff_t(oldRelocs);
+	splice((out_.*section).content, start, oldSize, bytes);
+	splice(out_.relocations, relocStart, oldRelocs, relocs);
+	splice(lines_, first, count, added);
+	splice(layout_, first, count, places);
+
+	if (delta == 0 && relocDelta == 0 && lineDelta == 0) {
+		return true;
+	}
+
+	// Everything after the edit moves along with it
+	for (size_t i = first + addedCount; i < layout_.size(); ++i) {
+		Placement &place = layout_[i];
+		place.reloc += relocDelta;
+		ptrdiff_t shift = place.section == section ? delta : 0;
+		place.offset += shift;
+		if (place.label != NO_SYMBOL) {
+			out_.labels[place.label].offset += shift;
+		}
+
+		for (size_t r = place.reloc; r < place.reloc + place.relocCount; ++r) {
+			out_.relocations[r].index += shift;
+			out_.relocations[r].linenum = int(i + 1);
+		}
+	}
+
+	return true;
 }
 
-int assemble(std::istream &is, Assembly &a, std::string *err)
+// Lays out every line, without parsing any of them again
+int Session::rebuild(std::string *err)
 {
-	int linenum = 0;
+	out_.text.content.clear();
+	out_.data.content.clear();
+	out_.relocations.clear();
+	std::fill(out_.labels.begin(), out_.labels.end(), Assembly::Label{});
+	std::fill(out_.defines.begin(), out_.defines.end(), std::nullopt);
+	std::fill(defineLines_.begin(), defineLines_.end(), NO_LINE);
+	layout_.assign(lines_.size(), Placement{});
+	errors_ = 0;
+	dirty_ = true;
+
+	SectionPtr section = &Assembly::text;
+	for (size_t i = 0; i < lines_.size(); ++i) {
+		const Line &line = *lines_[i];
+		Placement &place = layout_[i];
+		if (line.switchTo) {
+			section = line.switchTo;
+		}
 
-	std::string line;
-	while (std::getline(is, line)) {
-		linenum += 1;
-		for (size_t i = 0; i < line.size(); ++i) {
-			if (line[i] == ';') {
-				line.erase(i);
-				break;
+		auto &content = (out_.*section).content;
+		place.section = section;
+		place.offset = content.size();
+		place.label = line.label;
+
+		const char *errStr = nullptr;
+		if (line.error) {
+			errors_ += 1;
+		} else if (line.label != NO_SYMBOL) {
+			if (out_.labels[line.label].section) {
+				errStr = "Duplicate label";
+			} else {
+				out_.labels[line.label] = {
+					.offset = place.offset,
+					.section = section,
+				};
+			}
+		} else if (line.define != NO_SYMBOL) {
+			if (out_.defines[line.define]) {
+				errStr = "Duplicate define";
+			} else {
+				out_.defines[line.define] = line.value;
+				defineLines_[line.define] = i;
 			}
 		}
 
-		Reader r(line);
-		const char *errStr;
-		if (assembleLine(a, r, linenum, &errStr) < 0) {
+		// An earlier line which doesn't assemble is reported by edit()
+		if (errStr && errors_ == 0) {
 			if (err) {
 				*err = "Line ";
-				*err += std::to_string(linenum);
+				*err += std::to_string(i + 1);
 				*err += ": ";
 				*err += errStr;
 			}
 			return -1;
+		} else if (errStr) {
+			return 0;
 		}
+
+		emitLine(line, place, i, content, out_.relocations);
 	}
 
+	dirty_ = false;
 	return 0;
 }
 
+int Session::edit(size_t first, size_t count, std::string_view src, std::string *err)
+{
+	first = std::min(first, lines_.size());
+	count = std::min(count, lines_.size() - first);
+
+	std::vector<std::unique_ptr<Line>> added;
+	while (src.size() > 0) {
+		size_t end = src.find('\n');
+		added.push_back(parseLine(src.substr(0, end), int(first + added.size() + 1)));
+		if (end == src.npos) {
+			src = {};
+		} else {
+			src.remove_prefix(end + 1);
+		}
+	}
+
+	// Symbols are interned in the same order, so they get the same IDs
+	for (SymbolId id = out_.symbols.size(); id < scratch_.symbols.size(); ++id) {
+		out_.symbol(scratch_.symbols.name(id));
+	}
+	defineLines_.resize(out_.symbols.size(), NO_LINE);
+
+	if (!patch(first, count, added)) {
+		splice(lines_, first, count, added);
+		if (rebuild(err) < 0) {
+			return -1;
+		}
+	}
+
+	// Report the first line which doesn't assemble, like assemble() would
+	if (errors_ > 0) {
+		for (size_t i = 0; i < lines_.size(); ++i) {
+			if (!lines_[i]->error) {
+				continue;
+			}
+
+			if (err) {
+				*err = "Line ";
+				*err += std::to_string(i + 1);
+				*err += ": ";
+				*err += lines_[i]->error;
+			}
+			return -1;
+		}
+	}
+
+	// Symbols are interned in the same order, so they get the same IDs
+	for (SymbolId id = linked_.symbols.size(); id < out_.symbols.size(); ++id) {
+		linked_.symbol(out_.symbols.name(id));
+	}
+
+	linked_.text.content = out_.text.content;
+	linked_.data.content = out_.data.content;
+	linked_.labels = out_.labels;
+	linked_.relocations = out_.relocations;
+	return link(linked_, err);
+}
+
+// Where a relocation came from, for error messages
+static std::string location(const Assembly &a, const Relocation &reloc)
+{
+	std::string str;
+	if (reloc.source < a.sources.size() && !a.sources[reloc.source].empty()) {
+		str += a.sources[reloc.source];
+		str += ": ";
+	}
+
+	str += "Line ";
+	str += std::to_string(reloc.linenum);
+	return str;
+}
+
+// Opcodes used by relaxed branches. The conditional branches are
+// B + 1 up to BVC, and each one's inverse only differs in the low bit.
+static constexpr uint8_t OP_JMP = 0b10011;
+static constexpr uint8_t OP_B = 0b10101;
+static constexpr uint8_t OP_BVC = 0b11101;
+
+// An instruction whose parameter is a relocation,
+// which link() picks the shortest encoding for
+struct RelaxSite {
+	size_t reloc;
+
+	// Where the instruction starts in the unrelaxed text,
+	// where it's always 2 bytes
+	size_t start;
+
+	// 1 for the parameter modes without a byte, 2 for the normal
+	// encoding, and 4 for an inverted branch over a JMP
+	size_t size = 1;
+};
+
+static bool isRelaxable(const Assembly &a, const Relocation &reloc)
+{
+	const auto &text = a.text.content;
+	if (reloc.data || reloc.index < 1 || reloc.index >= text.size()) {
+		return false;
+	}
+
+	// The instruction has to be one byte and a parameter byte
+	uint8_t first = text[reloc.index - 1];
+	uint8_t op = first >> 3;
+	if (!(first & 0b100)) {
+		return false;
+	}
+
+	if (auto *r = std::get_if<Relocation::Relative>(&reloc.substitute); r) {
+		return r->offset == -1 && first == ((op << 3) | 0b100) && op >= OP_B && op <= OP_BVC;
+	} else if (std::holds_alternative<Relocation::Absolute>(reloc.substitute)) {
+		return op != 0 && op != 0b11111;
+	}
+
+	return false;
+}
+
 int link(Assembly &a, std::string *err)
 {
+	auto &text = a.text.content;
+
+	std::vector<RelaxSite> sites;
+	for (size_t i = 0; i < a.relocations.size(); ++i) {
+		if (isRelaxable(a, a.relocations[i])) {
+			sites.push_back({ .reloc = i, .start = a.relocations[i].index - 1 });
+		}
+	}
+
+	std::sort(sites.begin(), sites.end(), [](const RelaxSite &x, const RelaxSite &y) {
+		return x.start < y.start;
+	});
+
+	// The assembler never emits two relocations into one instruction
+	for (size_t k = 1; k < sites.size(); ++k) {
+		if (sites[k].start < sites[k - 1].start + 2) {
+			if (err) {
+				*err = location(a, a.relocations[sites[k].reloc]);
+				*err += ": Overlapping relocations";
+			}
+			return -1;
+		}
+	}
+
+	// growth[k] is how much the sites before sites[k] have grown
+	std::vector<ptrdiff_t> growth(sites.size() + 1);
+	auto moved = [&](size_t offset) {
+		auto it = std::lower_bound(
+			sites.begin(), sites.end(), offset,
+			[](const RelaxSite &site, size_t offset) { return site.start < offset; });
+		return size_t(ptrdiff_t(offset) + growth[it - sites.begin()]);
+	};
+
+	// Where a symbol ends up, or -1 if it's undefined
+	auto address = [&](SymbolId id) -> ptrdiff_t {
+		const Assembly::Label &label = a.labels[id];
+		if (!label.section) {
+			return -1;
+		} else if (label.section == &Assembly::text) {
+			return moved(label.offset) + a.text.offset;
+		}
+
+		return label.offset + (a.*label.section).offset;
+	};
+
+	auto symbolOf = [](const Relocation &reloc) {
+		if (auto *r = std::get_if<Relocation::Relative>(&reloc.substitute); r) {
+			return r->symbol;
+		}
+		return std::get<Relocation::Absolute>(reloc.substitute).symbol;
+	};
+
+	// Every site starts out in its shortest form, and grows until
+	// everything is in range. Growing a site only ever moves things
+	// further apart, so this settles on the smallest sizes that work.
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (size_t k = 0; k < sites.size(); ++k) {
+			growth[k + 1] = growth[k] + ptrdiff_t(sites[k].size) - 2;
+		}
+
+		for (size_t k = 0; k < sites.size(); ++k) {
+			RelaxSite &site = sites[k];
+			const Relocation &reloc = a.relocations[site.reloc];
+			ptrdiff_t target = address(symbolOf(reloc));
+
+			size_t size = 2;
+			if (target < 0) {
+				// Reported below
+			} else if (std::holds_alternative<Relocation::Absolute>(reloc.substitute)) {
+				size = target == 0 ? 1 : 2;
+			} else {
+				ptrdiff_t rel = target - ptrdiff_t(site.start + growth[k]);
+				uint8_t op = text[site.start] >> 3;
+				if (rel == 0) {
+					size = 1;
+				} else if ((rel > 127 || rel < -128) && op != OP_B) {
+					size = 4;
+				}
+			}
+
+			if (size > site.size) {
+				site.size = size;
+				changed = true;
+			}
+		}
+	}
+
+	// Check every relocation, in order
 	for (auto &reloc: a.relocations) {
 		auto &sub = reloc.substitute;
 		if (auto *r = std::get_if<Relocation::Relative>(&sub); r) {
-			auto it = a.labels.find(r->label);
-			if (it == a.labels.end()) {
+			ptrdiff_t target = address(r->symbol);
+			if (target < 0) {
 				if (err) {
-					*err = "Line ";
-					*err += std::to_string(reloc.linenum);
+					*err = location(a, reloc);
 					*err += ": Invalid relative relocation '";
-					*err += r->label;
+					*err += a.symbols.name(r->symbol);
 					*err += '\'';
 				}
 				return -1;
 			}
 
-			auto &section = a.*it->second.section;
-			int rel =
-				int(it->second.offset) +
-				int(section.offset) -
-				(int(reloc.index) + r->offset);
-
-			if (rel > 127 || rel < -128) {
+			// Branches which are relaxed into a JMP need an absolute target
+			bool relaxable = isRelaxable(a, reloc);
+			size_t index = reloc.data ? reloc.index : moved(reloc.index);
+			ptrdiff_t rel = relaxable ?
+				target - ptrdiff_t(moved(reloc.index - 1)) :
+				target - (ptrdiff_t(index) + r->offset);
+			bool inRange = rel <= 127 && rel >= -128;
+			if (!inRange && (!relaxable || target > 255)) {
 				if (err) {
-					*err = "Line ";
-					*err += std::to_string(reloc.linenum);
+					*err = location(a, reloc);
 					*err += ": Relative relocation '";
-					*err += r->label;
+					*err += a.symbols.name(r->symbol);
 					*err += "' out of range";
 				}
 				return -1;
 			}
 
-			a.text.content[reloc.index] = uint8_t(rel);
 			continue;
 		}
 
 		if (auto *r = std::get_if<Relocation::Absolute>(&sub); r) {
-			auto it = a.labels.find(r->label);
-			if (it == a.labels.end()) {
+			ptrdiff_t target = address(r->symbol);
+			if (target < 0) {
 				if (err) {
-					*err = "Line ";
-					*err += std::to_string(reloc.linenum);
+					*err = location(a, reloc);
 					*err += ": Unknown absolute relocation '";
-					*err += r->label;
+					*err += a.symbols.name(r->symbol);
 					*err += '\'';
 				}
 				return -1;
 			}
 
-			auto &section = a.*it->second.section;
-			size_t abs = it->second.offset + section.offset;
-
-			if (abs > 255) {
+			if (target > 255) {
 				if (err) {
-					*err = "Line ";
-					*err += std::to_string(reloc.linenum);
+					*err = location(a, reloc);
 					*err += ": Absolute relocation '";
-					*err += r->label;
+					*err += a.symbols.name(r->symbol);
 					*err += "' out of range";
 				}
 				return -1;
 			}
 
-			a.text.content[reloc.index] = uint8_t(abs);
 			continue;
 		}
 
 		// We should never get here
 		if (err) {
-			*err = "Line ";
-			*err += std::to_string(reloc.linenum);
+			*err = location(a, reloc);
 			*err += ": Invalid relocation type";
 		}
 		return -1;
 	}
 
+	// Emit the text again, with every site in its chosen form
+	std::vector<uint8_t> out;
+	out.reserve(text.size() + growth.back());
+	size_t pos = 0;
+	for (size_t k = 0; k < sites.size(); ++k) {
+		const RelaxSite &site = sites[k];
+		const Relocation &reloc = a.relocations[site.reloc];
+		out.insert(out.end(), text.begin() + pos, text.begin() + site.start);
+		pos = site.start + 2;
+
+		uint8_t first = text[site.start];
+		uint8_t op = first >> 3;
+		ptrdiff_t target = address(symbolOf(reloc));
+		if (site.size == 1) {
+			// The parameter is 0, or just a register
+			out.push_back(first & ~0b100);
+		} else if (std::holds_alternative<Relocation::Absolute>(reloc.substitute)) {
+			out.push_back(first);
+			out.push_back(uint8_t(target));
+		} else if (site.size == 4) {
+			// Branch over a JMP if the condition is false
+			out.push_back(((op ^ 1) << 3) | 0b100);
+			out.push_back(4);
+			out.push_back((OP_JMP << 3) | 0b100);
+			out.push_back(uint8_t(target));
+		} else {
+			ptrdiff_t rel = target - ptrdiff_t(out.size());
+			if (rel > 127 || rel < -128) {
+				out.push_back((OP_JMP << 3) | 0b100);
+				out.push_back(uint8_t(target));
+			} else {
+				out.push_back(first);
+				out.push_back(uint8_t(rel));
+			}
+		}
+	}
+	out.insert(out.end(), text.begin() + pos, text.end());
+
+	// Relocations which aren't sites are patched where they ended up
+	std::vector<bool> isSite(a.relocations.size());
+	for (const RelaxSite &site: sites) {
+		isSite[site.reloc] = true;
+	}
+
+	for (size_t i = 0; i < a.relocations.size(); ++i) {
+		const Relocation &reloc = a.relocations[i];
+		auto &content = reloc.data ? a.data.content : out;
+		size_t index = reloc.data ? reloc.index : moved(reloc.index);
+		if (isSite[i] || index >= content.size()) {
+			continue;
+		}
+
+		ptrdiff_t target = address(symbolOf(reloc));
+		if (auto *r = std::get_if<Relocation::Relative>(&reloc.substitute); r) {
+			content[index] = uint8_t(target - (ptrdiff_t(index) + r->offset));
+		} else {
+			content[index] = uint8_t(target);
+		}
+	}
+
+	for (Assembly::Label &label: a.labels) {
+		if (label.section == &Assembly::text) {
+			label.offset = moved(label.offset);
+		}
+	}
+
+	text = std::move(out);
+	a.relocations.clear();
 	return 0;
 }
 
@@ -900,147 +1670,36 @@ int disasm(std::span<const uint8_t> instr, std::string &out)
 		return 1;
 	}
 
-	uint8_t op = instr[0] >> 3;
+	int index = disasmTable[instr[0]];
+	if (index < 0) {
+		// Only POP has unused parameter values
+		out = "BAD POP";
+		return 1;
+	}
+
+	const Mnemonic &m = mnemonics[index];
 	uint8_t param = instr[0] & 0x07;
+	out = m.name;
 
-	switch (op) {
-	case 0b00000:
-		switch (param) {
-		case 0b000:
-			out = "NOP";
-			return 1;
-		case 0b001:
-			out = "LSR";
-			return 1;
-		case 0b010:
-			out = "ROR";
-			return 1;
-		case 0b011:
-			out = "INC";
-			return 1;
-		case 0b100:
-			out = "LSP";
-			break;
-		case 0b101:
-			out = "SSP";
-			break;
-		case 0b110:
-			out = "LSW";
-			break;
-		case 0b111:
-			out = "SSW";
-			break;
-		}
+	if (m.enc == Encoding::SPECIAL) {
+		return 1;
+	}
 
-		break;
-	case 0b00001:
-		out = "ADD";
-		break;
-	case 0b00010:
-		out = "SUB";
-		break;
-	case 0b00011:
-		out = "ADC";
-		break;
-	case 0b00100:
-		out = "XOR";
-		break;
-	case 0b00101:
-		out = "AND";
-		break;
-	case 0b00110:
-		out = "OR ";
-		break;
-	case 0b00111:
-		out = "CMP";
-		break;
-	case 0b01000:
-		out = "MVX";
-		break;
-	case 0b01001:
-		out = "MVY";
-		break;
-	case 0b01010:
-		out = "MVA";
-		break;
-	case 0b01011:
-		out = "MHA";
-		break;
-	case 0b01100:
-		out = "SPS";
-		break;
-	case 0b01101:
-		out = "LDX";
-		break;
-	case 0b01110:
-		out = "LDW";
-		break;
-	case 0b01111:
-		out = "LDA";
-		break;
-	case 0b10000:
-		out = "STX";
-		break;
-	case 0b10001:
-		out = "STW";
-		break;
-	case 0b10010:
-		out = "STA";
-		break;
-	case 0b10011:
-		out = "JMP";
-		break;
-	case 0b10100:
-		out = "JLR";
-		break;
-	case 0b10101:
-		out = "B";
-		break;
-	case 0b10110:
-		out = "BCC";
-		break;
-	case 0b10111:
-		out = "BCS";
-		break;
-	case 0b11000:
-		out = "BEQ";
-		break;
-	case 0b11001:
-		out = "BNE";
-		break;
-	case 0b11010:
-		out = "BMI";
-		break;
-	case 0b11011:
-		out = "BPL";
-		break;
-	case 0b11100:
-		out = "BVS";
-		break;
-	case 0b11101:
-		out = "BVC";
-		break;
-	case 0b11110:
-		out = "PUSH";
-		break;
-	case 0b11111:
-		switch (param) {
-		case 0b000:
-			out = "POP VOID";
-			return 1;
-		case 0b001:
-			out = "POP %X";
-			return 1;
-		case 0b010:
-			out = "POP %Y";
-			return 1;
-		case 0b011:
-			out = "POP %A";
+	if (m.enc == Encoding::POP) {
+		static constexpr const char *regs[] = { " VOID", " %X", " %Y", " %A" };
+		out += regs[param];
+		return 1;
+	}
+
+	if (m.enc == Encoding::SPECIAL_PARAM) {
+		if (instr.size() < 2) {
+			out += " OOB";
 			return 1;
 		}
 
-		out = "BAD POP";
-		return 1;
+		out += " ";
+		out += std::to_string(instr[1]);
+		return 2;
 	}
 
 	uint8_t next = 0;
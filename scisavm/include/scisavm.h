@@ -1,19 +1,94 @@
 #ifndef SCISAVM_H
 #define SCISAVM_H
 
+#include <array>
+#include <bitset>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
 #include <span>
+#include <string>
 #include <vector>
 #include <cstdlib>
 
 namespace scisavm {
 
+// Why step() returned
+enum class StopReason: uint8_t {
+	// Still running, never returned by step()
+	NONE,
+
+	// The whole instruction budget was executed
+	BUDGET,
+
+	// The PC reached one of the CPU's breakpoints
+	BREAKPOINT,
+
+	// The program finished, or can't make progress anymore
+	HALT,
+
+	// The program is waiting for an IO device
+	IO_WAIT,
+
+	// Something went wrong, see CPU::error
+	ERROR,
+};
+
+struct StepResult {
+	// The number of instructions which completed.
+	// An instruction which raised an error doesn't count, and neither
+	// does one which stopped with IO_WAIT, since it hasn't happened yet.
+	int retired = 0;
+	StopReason reason = StopReason::NONE;
+};
+
 class MemoryIO {
 public:
 	virtual ~MemoryIO() = default;
 	virtual uint8_t load(size_t) { return 0; }
 	virtual void store(size_t, uint8_t) {}
+
+	// Access 'data.size()' bytes starting at 'offset'.
+	// These go one byte at a time by default,
+	// devices backed by host buffers can do it in one go.
+	virtual void loadBlock(size_t offset, std::span<uint8_t> data)
+	{
+		for (size_t i = 0; i < data.size(); ++i) {
+			data[i] = load(offset + i);
+		}
+	}
+
+	virtual void storeBlock(size_t offset, std::span<const uint8_t> data)
+	{
+		for (size_t i = 0; i < data.size(); ++i) {
+			store(offset + i, data[i]);
+		}
+	}
+
+	// Little endian 16-bit words, used by 16-bit CPUs' word instructions
+	virtual uint16_t loadWord(size_t offset)
+	{
+		uint8_t bytes[2];
+		loadBlock(offset, bytes);
+		return bytes[0] | (uint16_t(bytes[1]) << 8);
+	}
+
+	virtual void storeWord(size_t offset, uint16_t val)
+	{
+		uint8_t bytes[2] = { uint8_t(val & 0x00ff), uint8_t((val & 0xff00) >> 8) };
+		storeBlock(offset, bytes);
+	}
+
+	// A device can set this from load() or store() to make step()
+	// return after the current instruction.
+	// IO_WAIT is different: it means that the device can't do the access
+	// yet, for example when the program reads input which isn't there.
+	// The instruction is then abandoned without changing any registers,
+	// and executed again, access and all, by the next step().
+	// It's reset once the CPU has seen it.
+	StopReason stop = StopReason::NONE;
 };
 
 template<typename T>
@@ -33,15 +108,59 @@ struct MappedMem {
 using MappedMem8 = MappedMem<uint8_t>;
 using MappedMem16 = MappedMem<uint16_t>;
 
-template<typename T>
-struct Flags;
+enum class PageKind: uint8_t {
+	// Nothing is mapped anywhere in the page
+	NONE,
+
+	// The whole page is backed by one MappedMem
+	MEM,
+
+	// The whole page is backed by one MappedIO
+	IO,
 
+	// Some mix, which is resolved by scanning the mappings
+	MIXED,
+};
+
+struct Page {
+	PageKind kind = PageKind::NONE;
+
+	// For MEM pages: the memory backing the first byte of the page
+	uint8_t *mem = nullptr;
+
+	// For IO pages: the device, and the device offset of the first byte
+	MemoryIO *io = nullptr;
+	size_t ioOffset = 0;
+};
+
+// The address space is split into 256 pages,
+// which are 1 byte each for 8-bit CPUs and 256 bytes each for 16-bit CPUs.
+// This is built from the 'io' and 'dmem' mappings,
+// so that most loads and stores are a table lookup.
 template<typename T>
-class FlagsOp {
-public:
-	virtual ~FlagsOp() = default;
-	virtual bool carry(Flags<T> &f) = 0;
-	virtual bool overflow(Flags<T> &f) = 0;
+struct MemoryMap {
+	static constexpr int pageBits = sizeof(T) * 8 - 8;
+	static constexpr size_t pageSize = size_t(1) << pageBits;
+	static constexpr T pageMask = T(pageSize - 1);
+
+	std::array<Page, 256> pages;
+
+	// The number of mappings the pages were built from.
+	// Appending to 'io' or 'dmem' is picked up by the next step(),
+	// other changes to the mappings need an explicit CPU::remap().
+	size_t numIO = 0;
+	size_t numMem = 0;
+};
+
+// Flags are evaluated lazily from the inputs and output
+// of the last flag-setting instruction.
+// The op says how to turn those into carry and overflow.
+enum class FlagsOp: uint8_t {
+	// Carry is 'c' itself, overflow is always clear
+	Z,
+
+	// The flags come from the addition a + b + c
+	ADD,
 };
 
 template<typename T>
@@ -50,18 +169,107 @@ struct Flags {
 	T a = 0;
 	T b = 0;
 	T c = 0;
-	FlagsOp<T> *op;
+	FlagsOp op = FlagsOp::Z;
+
+	static constexpr int bits = sizeof(T) * 8;
+
+	bool carry() const
+	{
+		static_assert(sizeof(uint32_t) > sizeof(T));
+		uint32_t sum = uint32_t(a) + uint32_t(b) + uint32_t(c);
+		return op == FlagsOp::ADD ? (sum >> bits) & 1 : c & 1;
+	}
+
+	bool zero() const { return out == 0; }
+
+	bool overflow() const
+	{
+		// Signed overflow happened if a and b have the same sign,
+		// and out has a different sign from both
+		bool v = (((a ^ out) & (b ^ out)) >> (bits - 1)) & 1;
+		return v & (op == FlagsOp::ADD);
+	}
+
+	bool negative() const { return (out >> (bits - 1)) & 1; }
+};
+
+enum class Engine {
+	// Fetch and decode every instruction from pmem as it's executed
+	INTERP,
+
+	// Decode all of pmem up front, then execute from the decoded ops
+	PREDECODED,
+
+	// Like PREDECODED, but with direct threaded (computed goto) dispatch.
+	// Falls back to PREDECODED on compilers without labels as values,
+	// or when built with SCISAVM_NO_COMPUTED_GOTO.
+	THREADED,
+
+	// Compile basic blocks to native code, interpreting whatever can't be.
+	// Only available on x86-64 Linux, falls back to THREADED elsewhere,
+	// or when built with SCISAVM_NO_JIT.
+	JIT,
+
+	// Like PREDECODED, but common pairs of instructions
+	// are executed as one fused instruction
+	FUSED,
+
+	// Run native code translated ahead of time by translateAot()
+	// and loaded into CPU::aot by loadAot(), interpreting whatever
+	// the translation doesn't cover. Falls back to THREADED
+	// when there's no module for the CPU's pmem.
+	AOT,
+};
+
+// The instruction pairs which Engine::FUSED recognizes
+enum class Fusion: uint8_t {
+	NONE,
+	CMP_BEQ,
+	CMP_BNE,
+	CMP_BCC,
+	CMP_BCS,
+	LDA_ADD,
+	MVA_STA,
+	PUSH_JLR,
+	POP_JMP,
+	COUNT,
+};
+
+const char *fusionName(Fusion fusion);
+
+struct DecodedOp {
+	uint8_t handler;
+	uint8_t paramMode;
+	uint8_t second;
+	uint8_t length;
+
+	// Whether this and the next op can be executed as one
+	Fusion fusion;
+};
+
+struct DecodeCache {
+	// The pmem which the ops were decoded from,
+	// used to detect when pmem has been replaced
+	const uint8_t *src = nullptr;
+	size_t size = 0;
 
-	bool carry() { return op->carry(*this); }
-	bool zero() { return out == 0; }
-	bool overflow() { return op->overflow(*this); }
-	bool negative() { return out & (1 << (sizeof(T) * 8 - 1)); }
+	// One decoded op for every byte offset in pmem,
+	// since jumps can go to any address
+	std::vector<DecodedOp> ops;
 };
 
+// Compiled code for Engine::JIT. Copies of a CPU share the compiled code,
+// so they must not be stepped concurrently with the JIT engine.
+struct JitCache;
+
+// A program compiled ahead of time for Engine::AOT
+struct AotModule;
+
+// Memory shared between a Snapshot and the CPUs forked from it
+struct CowMem;
+
 template<typename T>
 struct CPU {
-	CPU();
-
 	T pc = 0;
 	T sp = 128;
 	T acc = 0;
@@ -74,38 +282,496 @@ struct CPU {
 
 	std::vector<MappedIO<T>> io;
 	std::vector<MappedMem<T>> dmem;
-	std::span<uint8_t> pmem;
+	std::span<const uint8_t> pmem;
+	MemoryMap<T> map;
 
-	void step(int n);
+	Engine engine = Engine::INTERP;
+	DecodeCache decoded;
+	std::shared_ptr<JitCache> jit;
+	std::shared_ptr<AotModule> aot;
+
+	// The memory behind 'dmem' when the CPU was forked from a Snapshot
+	std::shared_ptr<CowMem> cow;
+
+	// How many times each fusion was executed by Engine::FUSED
+	std::array<uint64_t, size_t(Fusion::COUNT)> fusions{};
+
+	// step() stops before executing an instruction at any of these,
+	// except for the first instruction it executes
+	std::vector<T> breakpoints;
+
+	// Make step() look for idle loops in the last 64 instructions of
+	// every 64K of its budget, or all of it if it's smaller than that.
+	// A loop which comes back to the same registers and flags without
+	// storing anything stops the CPU with HALT, or with IO_WAIT if it
+	// loads from IO, since only a device can get it out of the loop.
+	// Breakpoints still stop the CPU while it's looking.
+	bool detectIdle = false;
+
+	// Set during step() to make it stop after the current instruction
+	StopReason stop = StopReason::NONE;
+
+	StepResult step(int n);
+	void remap();
+
+	// Copy between the host and the address space, going through
+	// IO devices where they're mapped. Returns false, and stops,
+	// at the first address which isn't mapped.
+	bool readBlock(T addr, std::span<uint8_t> data);
+	bool writeBlock(T addr, std::span<const uint8_t> data);
+
+	// Keep the code Engine::JIT compiles for pmem in 'dir' between runs.
+	// Files are keyed by a hash of pmem and the JIT version,
+	// and loaded with mmap. saveCompiled() only writes anything
+	// if new code was compiled, and creates 'dir' if necessary.
+	// Both return 0 on success, or -1 with 'err' set;
+	// loadCompiled() returns 1 if nothing usable was saved.
+	int loadCompiled(const char *dir, std::string *err);
+	int saveCompiled(const char *dir, std::string *err);
 };
 
 using CPU8 = CPU<uint8_t>;
-void step8(CPU8 &, int n);
-void init8(CPU8 &);
+StepResult step8(CPU8 &, int n);
+void remap8(CPU8 &);
+bool readBlock8(CPU8 &, uint8_t addr, std::span<uint8_t> data);
+bool writeBlock8(CPU8 &, uint8_t addr, std::span<const uint8_t> data);
+int loadCompiled8(CPU8 &, const char *dir, std::string *err);
+int saveCompiled8(CPU8 &, const char *dir, std::string *err);
 
 using CPU16 = CPU<uint16_t>;
-void step16(CPU16 &, int n);
-void init16(CPU16 &);
+StepResult step16(CPU16 &, int n);
+void remap16(CPU16 &);
+bool readBlock16(CPU16 &, uint16_t addr, std::span<uint8_t> data);
+bool writeBlock16(CPU16 &, uint16_t addr, std::span<const uint8_t> data);
+int loadCompiled16(CPU16 &, const char *dir, std::string *err);
+int saveCompiled16(CPU16 &, const char *dir, std::string *err);
+
+// A frozen copy of a CPU's registers and data memory,
+// which any number of CPUs can be forked from.
+// The 'pmem' and 'io' mappings are shared, not copied,
+// so they have to outlive the snapshot and its children.
+//
+// Children get copy-on-write data memory: on Linux, the frozen memory
+// lives in a memfd which every child maps privately, so pages which
+// a child never writes stay shared. Elsewhere, children get a copy.
+template<typename T>
+struct Snapshot {
+	T pc = 0;
+	T sp = 0;
+	T acc = 0;
+	T x = 0;
+	T y = 0;
+	Flags<T> flags;
+	const char *error = nullptr;
+
+	std::vector<MappedIO<T>> io;
+	std::span<const uint8_t> pmem;
+	Engine engine = Engine::INTERP;
+	std::shared_ptr<AotModule> aot;
+
+	// The frozen memory, which must not be written to
+	std::vector<MappedMem<T>> dmem;
+	std::shared_ptr<CowMem> mem;
+
+	// Copy the state of 'cpu'. Each dmem mapping gets its own copy,
+	// so mappings which overlap in 'cpu' don't overlap in the children.
+	void take(const CPU<T> &cpu);
+
+	// Reset 'child' to the snapshotted state.
+	// The child doesn't share decoded or compiled code with anyone,
+	// except for the read-only AOT module,
+	// so children can run on different threads.
+	void fork(CPU<T> &child) const;
+
+	// The pages of a child's address space which it has written,
+	// found by comparing its dmem with the snapshot
+	std::bitset<256> dirty(const CPU<T> &child) const;
+};
+using Snapshot8 = Snapshot<uint8_t>;
+using Snapshot16 = Snapshot<uint16_t>;
+
+void take8(Snapshot8 &, const CPU8 &);
+void fork8(const Snapshot8 &, CPU8 &);
+std::bitset<256> dirty8(const Snapshot8 &, const CPU8 &);
+
+void take16(Snapshot16 &, const CPU16 &);
+void fork16(const Snapshot16 &, CPU16 &);
+std::bitset<256> dirty16(const Snapshot16 &, const CPU16 &);
+
+// Runs many instances of the same 8-bit program in lockstep.
+// The state of every instance (a lane) is laid out as structure of arrays,
+// so that all the lanes which are at the same PC execute an instruction
+// together. Each instruction has its own loop over the lanes, which blends
+// its results into the lanes with a mask rather than branching, so that
+// the compiler can vectorize it when optimizing (-O2 and up; meson's
+// default debug buildtype doesn't). Memory accesses stay scalar,
+// since every lane accesses its own address.
+// Lanes which diverge run as separate groups until they reconverge.
+//
+// Only plain memory is supported. A lane which accesses IO stops
+// before the access with IO_WAIT, so that it can be extract()ed
+// into a CPU8 and finished there.
+struct Batch8 {
+	static constexpr int LANES = 32;
+
+	std::span<const uint8_t> pmem;
+
+	// What is mapped at each address, shared by all lanes
+	std::array<PageKind, 256> kinds{};
+
+	// 0xff for lanes which are still running
+	alignas(32) uint8_t active[LANES] = {};
+
+	// Why each lane stopped, or NONE while it's running:
+	// IO_WAIT if it's about to access IO, and has to be extract()ed
+	// into a CPU8 to go on; HALT if it executed an instruction which
+	// changes nothing, like B 0; or ERROR, with 'error' set.
+	alignas(32) StopReason reason[LANES] = {};
+	const char *error[LANES] = {};
+
+	// Steps since each lane last executed an instruction
+	uint32_t waited[LANES] = {};
+
+	alignas(32) uint8_t pc[LANES] = {};
+	alignas(32) uint8_t sp[LANES] = {};
+	alignas(32) uint8_t acc[LANES] = {};
+	alignas(32) uint8_t x[LANES] = {};
+	alignas(32) uint8_t y[LANES] = {};
+
+	alignas(32) uint8_t flagsOut[LANES] = {};
+	alignas(32) uint8_t flagsA[LANES] = {};
+	alignas(32) uint8_t flagsB[LANES] = {};
+	alignas(32) uint8_t flagsC[LANES] = {};
+	alignas(32) uint8_t flagsOp[LANES] = {};
+
+	// Indexed by address first, so that lanes accessing
+	// the same address touch contiguous bytes
+	alignas(32) uint8_t mem[256][LANES] = {};
+
+	// Take the program and memory layout from 'cpu',
+	// and make every lane a running copy of it
+	void init(CPU8 &cpu);
+
+	// Copy a lane's state from or to a CPU8 with the same memory layout
+	void load(int lane, CPU8 &cpu);
+	void extract(int lane, CPU8 &cpu);
+
+	// Execute 'n' lockstep steps. In each step, the group of lanes
+	// at the lowest PC executes one instruction. A lane which has waited
+	// for more than LANES steps has its group go first instead, so that
+	// every lane keeps making progress.
+	void step(int n);
+};
+
+// A CPU to be run by a Farm.
+// The job and its CPU must outlive the farm, or at least
+// stay alive and untouched until the job is done.
+struct FarmJob {
+	// Exactly one of these should be set
+	CPU8 *cpu8 = nullptr;
+	CPU16 *cpu16 = nullptr;
+
+	// Stop after this many instructions, or 0 to run until the CPU stops.
+	// A CPU waiting for IO doesn't stop the job, it's set aside until
+	// Farm::wake() is called for it, or for a while which grows
+	// for as long as it keeps waiting.
+	uint64_t budget = 0;
+
+	// Filled in by the farm.
+	// 'error' is the CPU's error, if the job stopped because of an error.
+	uint64_t executed = 0;
+	StopReason reason = StopReason::NONE;
+	const char *error = nullptr;
+	bool done = false;
+};
+
+struct FarmImpl;
+
+// Runs many CPUs on a pool of worker threads.
+// Every worker has a deque of jobs, and runs the job at the front
+// for one quantum before putting it at the back again.
+// Workers with nothing to do steal jobs from the back of other workers' deques.
+class Farm {
+public:
+	// 0 workers means one per hardware thread
+	explicit Farm(int workers = 0, int quantum = 4096);
+	~Farm();
+
+	Farm(const Farm &) = delete;
+	Farm &operator=(const Farm &) = delete;
+
+	// Called from a worker thread whenever a job is done.
+	// Set it before submitting any jobs.
+	void onDone(std::function<void(FarmJob &)> cb);
+
+	void submit(FarmJob &job);
+
+	// Let a job which is waiting for IO run again right away,
+	// for example when its input device has something to read.
+	// Can be called from any thread.
+	void wake(FarmJob &job);
+
+	// Wait until every submitted job is done
+	void wait();
+
+	int workers();
+
+private:
+	std::unique_ptr<FarmImpl> impl;
+};
+
+struct ConsoleOptions {
+	// Where the output goes
+	std::FILE *file = stderr;
+
+	// The size of the ring buffer, rounded up to a power of two
+	size_t bufferSize = 64 * 1024;
+
+	// Flush whenever the program writes a newline
+	bool flushOnNewline = true;
+
+	// Flush output which has been waiting for this long, 0 to never do that.
+	// The writer thread keeps time by itself; without it, the deadline
+	// is only checked when something is stored or poll() is called.
+	int flushMs = 50;
+
+	// Do the writing on a background thread,
+	// so that the CPU only waits for the host when the buffer is full
+	bool writerThread = false;
+};
+
+struct ConsoleImpl;
+
+// An output device which writes every byte stored to it to a file.
+// Output is collected in a ring buffer, and written out
+// when it fills up, on newlines and after a while, depending on the options.
+// Only one CPU may store to a console at a time.
+class ConsoleOut: public MemoryIO {
+public:
+	explicit ConsoleOut(ConsoleOptions opts = {});
+	~ConsoleOut();
+
+	ConsoleOut(const ConsoleOut &) = delete;
+	ConsoleOut &operator=(const ConsoleOut &) = delete;
+
+	void store(size_t offset, uint8_t val) override;
+	void storeBlock(size_t offset, std::span<const uint8_t> data) override;
+
+	// Write out everything stored so far, and wait until it's written
+	void flush();
+
+	// Without a writer thread, flush if output has been waiting
+	// for longer than flushMs. Call it between steps, so that output
+	// without a newline shows up even if the program stops storing.
+	void poll();
+
+private:
+	std::unique_ptr<ConsoleImpl> impl;
+};
+
+struct ConsoleInImpl;
+
+// An input device, fed from a file descriptor by a background thread.
+// It has two registers:
+//
+// 0: Status. Bit 0 is set when there's a byte to read,
+//    bit 1 is set when the input has ended.
+// 1: Data. Reading it consumes a byte, or gives 0 if there is none.
+//
+// Reading the data register while there's nothing to read (yet) stops
+// the CPU with IO_WAIT before the load, so that the host can wait()
+// rather than having the program spin, and the load is done again
+// when the CPU is resumed. Reading the status never stops the CPU,
+// so programs can poll it between other work; a loop which does
+// nothing but poll is caught by CPU::detectIdle instead.
+// Only one CPU may load from it at a time.
+class ConsoleIn: public MemoryIO {
+public:
+	static constexpr uint8_t STATUS_READY = 1 << 0;
+	static constexpr uint8_t STATUS_EOF = 1 << 1;
+
+	explicit ConsoleIn(int fd = 0, size_t bufferSize = 64 * 1024);
+	~ConsoleIn();
+
+	ConsoleIn(const ConsoleIn &) = delete;
+	ConsoleIn &operator=(const ConsoleIn &) = delete;
+
+	uint8_t load(size_t offset) override;
+
+	// Block until there's something to read.
+	// Returns false if the input has ended and everything has been read.
+	bool wait();
+
+private:
+	std::unique_ptr<ConsoleInImpl> impl;
+};
+
+struct ImageImpl;
+
+// A loaded SCE image.
+// Where possible, the file is mmap'd rather than read: 'text' points
+// straight into a read-only mapping, and 'data' into a private
+// copy-on-write mapping, so that only the pages the program
+// writes to are ever copied. Compressed sections are unpacked
+// into memory owned by the image instead.
+class Image {
+public:
+	Image();
+	~Image();
+
+	Image(const Image &) = delete;
+	Image &operator=(const Image &) = delete;
+
+	// The SCE version the file was written with, 1 or 2
+	int version = 0;
+
+	std::span<const uint8_t> text;
+	std::span<uint8_t> data;
+
+	std::unique_ptr<ImageImpl> impl;
+};
+
+// Section flags in an SCE v2 section directory
+enum ImageFlags: uint32_t {
+	IMAGE_COMPRESSED = 1 << 0,
+};
+
+// A section to be written to an SCE image.
+// The name is always 4 characters.
+struct ImageSection {
+	std::string_view name;
+	std::span<const uint8_t> content;
+	uint32_t flags = 0;
+};
+
+// Reads both SCE v1 and v2 images.
+// With 'verify', v2 section checksums are checked,
+// which means reading every page of the file.
+// Returns 0 on success, or -1 with 'err' set
+int loadImage(const char *path, Image &img, std::string *err, bool verify = true);
+
+// Serialize sections as an SCE v2 image.
+// IMAGE_COMPRESSED is only kept for sections it actually makes smaller.
+std::vector<uint8_t> encodeImage(std::span<const ImageSection> sections);
+
+// Translate a whole program to C++ for Engine::AOT.
+// The source has no dependencies; compile it as a shared object
+// and load it with loadAot(). 'bits' is 8 or 16.
+// Returns 0 on success, or -1 with 'err' set
+int translateAot(
+	std::span<const uint8_t> pmem, int bits, std::string &out, std::string *err);
+
+// Load a shared object compiled from translateAot()'s output,
+// checking that it was translated from 'pmem'.
+// Only supported where dlopen() is.
+// Returns 0 on success, or -1 with 'err' set
+int loadAot(
+	const char *path, std::span<const uint8_t> pmem, int bits,
+	std::shared_ptr<AotModule> &mod, std::string *err);
+
+template<typename T>
+StepResult CPU<T>::step(int n)
+{
+	if constexpr (sizeof(T) == sizeof(uint8_t)) {
+		return step8(*this, n);
+	} else if constexpr (sizeof(T) == sizeof(uint16_t)) {
+		return step16(*this, n);
+	} else {
+		abort();
+	}
+}
+
+template<typename T>
+void CPU<T>::remap()
+{
+	if constexpr (sizeof(T) == sizeof(uint8_t)) {
+		remap8(*this);
+	} else if constexpr (sizeof(T) == sizeof(uint16_t)) {
+		remap16(*this);
+	} else {
+		abort();
+	}
+}
+
+template<typename T>
+bool CPU<T>::readBlock(T addr, std::span<uint8_t> data)
+{
+	if constexpr (sizeof(T) == sizeof(uint8_t)) {
+		return readBlock8(*this, addr, data);
+	} else if constexpr (sizeof(T) == sizeof(uint16_t)) {
+		return readBlock16(*this, addr, data);
+	} else {
+		abort();
+	}
+}
+
+template<typename T>
+bool CPU<T>::writeBlock(T addr, std::span<const uint8_t> data)
+{
+	if constexpr (sizeof(T) == sizeof(uint8_t)) {
+		return writeBlock8(*this, addr, data);
+	} else if constexpr (sizeof(T) == sizeof(uint16_t)) {
+		return writeBlock16(*this, addr, data);
+	} else {
+		abort();
+	}
+}
+
+template<typename T>
+int CPU<T>::loadCompiled(const char *dir, std::string *err)
+{
+	if constexpr (sizeof(T) == sizeof(uint8_t)) {
+		return loadCompiled8(*this, dir, err);
+	} else if constexpr (sizeof(T) == sizeof(uint16_t)) {
+		return loadCompiled16(*this, dir, err);
+	} else {
+		abort();
+	}
+}
+
+template<typename T>
+int CPU<T>::saveCompiled(const char *dir, std::string *err)
+{
+	if constexpr (sizeof(T) == sizeof(uint8_t)) {
+		return saveCompiled8(*this, dir, err);
+	} else if constexpr (sizeof(T) == sizeof(uint16_t)) {
+		return saveCompiled16(*this, dir, err);
+	} else {
+		abort();
+	}
+}
+
+template<typename T>
+void Snapshot<T>::take(const CPU<T> &cpu)
+{
+	if constexpr (sizeof(T) == sizeof(uint8_t)) {
+		take8(*this, cpu);
+	} else if constexpr (sizeof(T) == sizeof(uint16_t)) {
+		take16(*this, cpu);
+	} else {
+		abort();
+	}
+}
 
 template<typename T>
-void CPU<T>::step(int n)
+void Snapshot<T>::fork(CPU<T> &child) const
 {
 	if constexpr (sizeof(T) == sizeof(uint8_t)) {
-		step8(*this, n);
+		fork8(*this, child);
 	} else if constexpr (sizeof(T) == sizeof(uint16_t)) {
-		step16(*this, n);
+		fork16(*this, child);
 	} else {
 		abort();
 	}
 }
 
 template<typename T>
-CPU<T>::CPU()
+std::bitset<256> Snapshot<T>::dirty(const CPU<T> &child) const
 {
 	if constexpr (sizeof(T) == sizeof(uint8_t)) {
-		init8(*this);
+		return dirty8(*this, child);
 	} else if constexpr (sizeof(T) == sizeof(uint16_t)) {
-		init16(*this);
+		return dirty16(*this, child);
 	} else {
 		abort();
 	}
@@ -0,0 +1,754 @@
+#include "aot.h"
+#include "isa.h"
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstddef>
+#include <cstring>
+
+#ifdef SCISAVM_AOT
+#include <dlfcn.h>
+#endif
+
+namespace scisavm {
+
+namespace {
+
+// Blocks are cut off at this many instructions,
+// to keep the step budget reasonably fine grained
+constexpr int MAX_BLOCK = 64;
+
+struct Instr {
+	Handler handler;
+	uint8_t paramMode;
+	uint8_t second;
+	uint32_t pc;
+	uint32_t next;
+
+	// Leaders start a block, and check that the budget
+	// has room for the rest of it
+	bool leader = false;
+
+	// The number of instructions from this one to the end of its block
+	int rest = 1;
+};
+
+int fail(std::string *err, std::string msg)
+{
+	if (err) {
+		*err = std::move(msg);
+	}
+	return -1;
+}
+
+[[gnu::format(printf, 2, 3)]]
+void emit(std::string &out, const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	out += buf;
+}
+
+// Whether translated code can execute the instruction.
+// Anything else is left to the interpreter, which also takes care
+// of raising the appropriate error.
+bool isTranslatable(Handler h, uint8_t paramMode, int bits)
+{
+	switch (h) {
+	case Handler::TRUNCATED:
+		return false;
+	case Handler::MHA:
+		return bits > 8;
+	case Handler::POP:
+		return paramMode <= 0b011;
+	default:
+		return true;
+	}
+}
+
+bool isImmediate(uint8_t paramMode)
+{
+	return paramMode == 0b000 || paramMode == 0b100;
+}
+
+// Where a jump or branch goes, if it's known without running anything
+bool directTarget(const Instr &in, uint32_t mask, uint32_t &target)
+{
+	if (!isImmediate(in.paramMode)) {
+		return false;
+	}
+
+	switch (in.handler) {
+	case Handler::JMP:
+	case Handler::JLR:
+		target = in.second;
+		return true;
+	case Handler::B:
+	case Handler::BCC: case Handler::BCS: case Handler::BEQ: case Handler::BNE:
+	case Handler::BMI: case Handler::BPL: case Handler::BVS: case Handler::BVC:
+		target = (in.pc + in.second) & mask;
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool isConditional(Handler h)
+{
+	return isTerminator(h) && h != Handler::JMP && h != Handler::JLR && h != Handler::B;
+}
+
+class Translator {
+public:
+	Translator(std::span<const uint8_t> pmem, int bits):
+		pmem_(pmem), bits_(bits), mask_((1u << bits) - 1),
+		index_(pmem.size(), -1) {}
+
+	void translate(std::string &out)
+	{
+		discover();
+		findBlocks();
+
+		prelude(out);
+		for (Instr &in: instrs_) {
+			instr(out, in);
+		}
+		epilogue(out);
+	}
+
+private:
+	// Decode the instruction at 'pc', if it's one we can translate
+	bool decode(uint32_t pc, Instr &in)
+	{
+		uint8_t instr = pmem_[pc];
+		in.handler = handlerFor(instr);
+		in.paramMode = instr & 0x07;
+		in.second = 0;
+		in.pc = pc;
+
+		size_t length = 1;
+		if (instr & 0b00000'100) {
+			if (pc + 1 >= pmem_.size()) {
+				return false;
+			}
+			in.second = pmem_[pc + 1];
+			length = 2;
+		}
+
+		in.next = (pc + length) & mask_;
+		return isTranslatable(in.handler, in.paramMode, bits_);
+	}
+
+	// Recover the control flow by following every path from the entry point
+	// and from every jump and branch target we can see.
+	// Code which is only reached through computed jumps is left out,
+	// and gets interpreted.
+	void discover()
+	{
+		std::vector<bool> seen(pmem_.size());
+		std::vector<bool> leader(pmem_.size());
+		std::vector<uint32_t> work;
+
+		auto add = [&](uint32_t pc, bool isLeader) {
+			if (pc < pmem_.size() && pc <= mask_) {
+				leader[pc] = leader[pc] || isLeader;
+				work.push_back(pc);
+			}
+		};
+
+		add(0, true);
+		while (!work.empty()) {
+			uint32_t pc = work.back();
+			work.pop_back();
+			if (seen[pc]) {
+				continue;
+			}
+			seen[pc] = true;
+
+			Instr in;
+			if (!decode(pc, in)) {
+				continue;
+			}
+
+			index_[pc] = 0;
+			found_.push_back(in);
+
+			uint32_t target;
+			if (directTarget(in, mask_, target)) {
+				add(target, true);
+			}
+
+			// The instruction after a JLR is where the callee returns to
+			if (in.handler == Handler::JLR) {
+				add(in.next, true);
+			} else if (!isTerminator(in.handler) || isConditional(in.handler)) {
+				add(in.next, isConditional(in.handler));
+			}
+		}
+
+		// Lay the code out in address order
+		std::sort(found_.begin(), found_.end(), [](const Instr &a, const Instr &b) {
+			return a.pc < b.pc;
+		});
+		instrs_ = std::move(found_);
+		for (size_t i = 0; i < instrs_.size(); ++i) {
+			instrs_[i].leader = leader[instrs_[i].pc];
+			index_[instrs_[i].pc] = i;
+		}
+	}
+
+	Instr *at(uint32_t pc)
+	{
+		if (pc >= index_.size() || index_[pc] < 0) {
+			return nullptr;
+		}
+		return &instrs_[index_[pc]];
+	}
+
+	// Whether control falls from 'i' straight into the code laid out after it
+	bool fallsThrough(size_t i)
+	{
+		return
+			i + 1 < instrs_.size() && instrs_[i + 1].pc == instrs_[i].next &&
+			!isTerminator(instrs_[i].handler);
+	}
+
+	void findBlocks()
+	{
+		// Anything which can't be reached by falling through
+		// has to be jumped to, which goes through a leader
+		for (size_t i = 0; i < instrs_.size(); ++i) {
+			Instr *next = at(instrs_[i].next);
+			if (next && !fallsThrough(i)) {
+				next->leader = true;
+			}
+		}
+
+		int count = 0;
+		for (size_t i = 0; i < instrs_.size(); ++i) {
+			if (instrs_[i].leader || count == MAX_BLOCK) {
+				instrs_[i].leader = true;
+				count = 0;
+			}
+			count += 1;
+		}
+
+		for (size_t i = instrs_.size(); i-- > 0;) {
+			Instr &in = instrs_[i];
+			if (fallsThrough(i) && !instrs_[i + 1].leader) {
+				in.rest = 1 + instrs_[i + 1].rest;
+			}
+		}
+	}
+
+	// The param as a C++ expression
+	std::string param(const Instr &in)
+	{
+		static const char *const regs[] = { "x", "y", "acc" };
+		char buf[64];
+		switch (in.paramMode) {
+		case 0b000:
+			return "T(0)";
+		case 0b100:
+			snprintf(buf, sizeof(buf), "T(0x%02x)", in.second);
+			return buf;
+		case 0b001:
+		case 0b010:
+		case 0b011:
+			return regs[in.paramMode - 1];
+		default:
+			snprintf(buf, sizeof(buf), "T(%s + 0x%02x)", regs[(in.paramMode & 0b011) - 1], in.second);
+			return buf;
+		}
+	}
+
+	void prelude(std::string &out)
+	{
+		emit(out, "// Translated by scisavm::translateAot() from a %zu byte program.\n", pmem_.size());
+		out += "// Do not edit, compile as a shared object and load with scisavm::loadAot().\n";
+		out += "\n";
+		out += "#include <cstddef>\n";
+		out += "#include <cstdint>\n";
+		out += "\n";
+		out += "namespace {\n";
+		out += "\n";
+		emit(out, "using T = %s;\n", bits_ == 8 ? "uint8_t" : "uint16_t");
+		emit(out, "constexpr unsigned BITS = %d;\n", bits_);
+		emit(out, "constexpr unsigned PAGE_BITS = %d;\n", bits_ - 8);
+		out += "constexpr unsigned PAGE_SIZE = 1u << PAGE_BITS;\n";
+		out += "constexpr unsigned PAGE_MASK = PAGE_SIZE - 1;\n";
+		emit(out, "constexpr uint8_t KIND_MEM = %d;\n", int(PageKind::MEM));
+		emit(out, "constexpr uint8_t OP_ADD = %d;\n", int(FlagsOp::ADD));
+		out += R"(
+struct Page {
+	uint8_t kind;
+	uint8_t *mem;
+	void *io;
+	size_t ioOffset;
+};
+)";
+		emit(out, "static_assert(sizeof(Page) == %zu && offsetof(Page, mem) == %zu);\n",
+			sizeof(Page), offsetof(Page, mem));
+		out += R"(
+struct State {
+	uint32_t pc;
+	uint32_t sp;
+	uint32_t acc;
+	uint32_t x;
+	uint32_t y;
+	uint32_t flagsOut;
+	uint32_t flagsA;
+	uint32_t flagsB;
+	uint32_t flagsC;
+	uint32_t flagsOp;
+	const Page *pages;
+};
+
+struct Flags {
+	T out, a, b, c;
+	uint8_t op;
+
+	void set(T out_, T a_, T b_, T c_, uint8_t op_)
+	{
+		out = out_; a = a_; b = b_; c = c_; op = op_;
+	}
+
+	bool carry() const
+	{
+		return op == OP_ADD ? ((uint32_t(a) + b + c) >> BITS) & 1 : c & 1;
+	}
+
+	bool zero() const { return out == 0; }
+	bool negative() const { return (out >> (BITS - 1)) & 1; }
+
+	bool overflow() const
+	{
+		return op == OP_ADD && ((((a ^ out) & (b ^ out)) >> (BITS - 1)) & 1);
+	}
+};
+
+// Only plain memory is accessed directly,
+// everything else is left to the interpreter
+inline uint8_t *byteAt(const Page *pages, T addr)
+{
+	const Page &page = pages[addr >> PAGE_BITS];
+	return page.kind == KIND_MEM ? page.mem + (addr & PAGE_MASK) : nullptr;
+}
+
+inline uint8_t *wordAt(const Page *pages, T addr)
+{
+	if ((addr & PAGE_MASK) + sizeof(T) > PAGE_SIZE) {
+		return nullptr;
+	}
+	return byteAt(pages, addr);
+}
+
+inline T loadWord(const uint8_t *mem)
+{
+	return sizeof(T) > 1 ? T(mem[0] | mem[1] << 8) : mem[0];
+}
+
+inline void storeWord(uint8_t *mem, T val)
+{
+	mem[0] = uint8_t(val);
+	if (sizeof(T) > 1) {
+		mem[1] = uint8_t(val >> 8);
+	}
+}
+
+}
+
+extern "C" {
+
+)";
+		emit(out, "extern const uint32_t scisavm_aot_abi = %u;\n", AOT_ABI);
+		emit(out, "extern const uint32_t scisavm_aot_bits = %d;\n", bits_);
+		emit(out, "extern const uint32_t scisavm_aot_size = %zu;\n", pmem_.size());
+		out += "extern const uint8_t scisavm_aot_text[] = {";
+		for (size_t i = 0; i < pmem_.size(); ++i) {
+			emit(out, "%s0x%02x,", i % 16 == 0 ? "\n\t" : " ", pmem_[i]);
+		}
+		out += "\n\t0,\n};\n";
+		out += R"(
+int scisavm_aot_run(State *st, int n)
+{
+	const Page *pages = st->pages;
+	T pc = T(st->pc);
+	T sp = T(st->sp);
+	T acc = T(st->acc);
+	T x = T(st->x);
+	T y = T(st->y);
+	Flags f;
+	f.set(T(st->flagsOut), T(st->flagsA), T(st->flagsB), T(st->flagsC), uint8_t(st->flagsOp));
+
+	int i = 0;
+	T param, out, carry;
+	uint8_t *mem;
+	(void)pages, (void)param, (void)out, (void)carry, (void)mem;
+
+dispatch:
+	switch (pc) {
+)";
+		for (Instr &in: instrs_) {
+			if (in.leader) {
+				emit(out, "\tcase 0x%04x: goto b_%04x;\n", in.pc, in.pc);
+			} else {
+				emit(out, "\tcase 0x%04x: if (n - i < %d) goto done; goto i_%04x;\n",
+					in.pc, in.rest, in.pc);
+			}
+		}
+		out += "\tdefault: goto done;\n";
+		out += "\t}\n";
+	}
+
+	void epilogue(std::string &out)
+	{
+		out += R"(
+done:
+	st->pc = pc;
+	st->sp = sp;
+	st->acc = acc;
+	st->x = x;
+	st->y = y;
+	st->flagsOut = f.out;
+	st->flagsA = f.a;
+	st->flagsB = f.b;
+	st->flagsC = f.c;
+	st->flagsOp = f.op;
+	return i;
+}
+
+}
+)";
+	}
+
+	// Go to the code for 'pc', or leave it to the interpreter
+	void jumpTo(std::string &out, uint32_t pc, const char *indent)
+	{
+		Instr *target = at(pc);
+		if (target && target->leader) {
+			emit(out, "%sgoto b_%04x;\n", indent, pc);
+		} else {
+			emit(out, "%spc = 0x%04x;\n%sgoto done;\n", indent, pc, indent);
+		}
+	}
+
+	void instr(std::string &out, const Instr &in)
+	{
+		out += "\n";
+		if (in.leader) {
+			emit(out, "b_%04x:\n", in.pc);
+			emit(out, "\tif (n - i < %d) {\n\t\tpc = 0x%04x;\n\t\tgoto done;\n\t}\n", in.rest, in.pc);
+		} else {
+			emit(out, "i_%04x:\n", in.pc);
+		}
+
+		// Leave the instruction to the interpreter
+		char exit[64];
+		snprintf(exit, sizeof(exit), "{ pc = 0x%04x; goto done; }", in.pc);
+
+		std::string p = param(in);
+		const char *word = bits_ > 8 ? "wordAt" : "byteAt";
+		const char *cond = nullptr;
+		switch (in.handler) {
+		case Handler::TRUNCATED:
+			// Never translated
+			break;
+
+		case Handler::NOP:
+			break;
+
+		case Handler::LSR:
+			out += "\tcarry = acc & 1;\n";
+			out += "\tout = T(acc >> 1);\n";
+			out += "\tf.set(out, 0, 0, carry, 0);\n";
+			out += "\tacc = out;\n";
+			break;
+
+		case Handler::ROR:
+			out += "\tcarry = acc & 1;\n";
+			out += "\tout = T((acc >> 1) | (f.carry() << (BITS - 1)));\n";
+			out += "\tf.set(out, 0, 0, carry, 0);\n";
+			out += "\tacc = out;\n";
+			break;
+
+		case Handler::INC:
+			out += "\tout = T(acc + 1);\n";
+			out += "\tf.set(out, acc, 1, 0, OP_ADD);\n";
+			out += "\tacc = out;\n";
+			break;
+
+		case Handler::LSP:
+		case Handler::LSW:
+			emit(out, "\tmem = %s(pages, T(sp - 0x%02x));\n",
+				in.handler == Handler::LSW ? word : "byteAt", in.second);
+			emit(out, "\tif (!mem) %s\n", exit);
+			emit(out, "\tacc = %s;\n", in.handler == Handler::LSW ? "loadWord(mem)" : "*mem");
+			out += "\tf.set(acc, 0, 0, 0, 0);\n";
+			break;
+
+		case Handler::SSP:
+		case Handler::SSW:
+			emit(out, "\tmem = %s(pages, T(sp - 0x%02x));\n",
+				in.handler == Handler::SSW ? word : "byteAt", in.second);
+			emit(out, "\tif (!mem) %s\n", exit);
+			out += in.handler == Handler::SSW ? "\tstoreWord(mem, acc);\n" : "\t*mem = uint8_t(acc);\n";
+			break;
+
+		case Handler::ADD:
+			emit(out, "\tparam = %s;\n", p.c_str());
+			out += "\tout = T(acc + param);\n";
+			out += "\tf.set(out, acc, param, 0, OP_ADD);\n";
+			out += "\tacc = out;\n";
+			break;
+
+		case Handler::SUB:
+		case Handler::CMP:
+			emit(out, "\tparam = %s;\n", p.c_str());
+			out += "\tout = T(acc - param);\n";
+			out += "\tf.set(out, acc, T(~param), 1, OP_ADD);\n";
+			if (in.handler == Handler::SUB) {
+				out += "\tacc = out;\n";
+			}
+			break;
+
+		case Handler::ADC:
+			emit(out, "\tparam = %s;\n", p.c_str());
+			out += "\tcarry = f.carry();\n";
+			out += "\tout = T(acc + param + carry);\n";
+			out += "\tf.set(out, acc, param, carry, OP_ADD);\n";
+			out += "\tacc = out;\n";
+			break;
+
+		case Handler::XOR:
+		case Handler::AND:
+		case Handler::OR:
+			emit(out, "\tout = T(acc %s %s);\n",
+				in.handler == Handler::XOR ? "^" : in.handler == Handler::AND ? "&" : "|",
+				p.c_str());
+			out += "\tf.set(out, 0, 0, 0, 0);\n";
+			out += "\tacc = out;\n";
+			break;
+
+		case Handler::MVX:
+			emit(out, "\tx = %s;\n", p.c_str());
+			break;
+
+		case Handler::MVY:
+			emit(out, "\ty = %s;\n", p.c_str());
+			break;
+
+		case Handler::MVA:
+			emit(out, "\tacc = %s;\n", p.c_str());
+			break;
+
+		case Handler::MHA:
+			emit(out, "\tacc = T(%s << 8);\n", p.c_str());
+			break;
+
+		case Handler::SPS:
+			emit(out, "\tsp = %s;\n", p.c_str());
+			break;
+
+		case Handler::LDX:
+		case Handler::LDA:
+			emit(out, "\tmem = byteAt(pages, %s);\n", p.c_str());
+			emit(out, "\tif (!mem) %s\n", exit);
+			emit(out, "\t%s = *mem;\n", in.handler == Handler::LDX ? "x" : "acc");
+			emit(out, "\tf.set(%s, 0, 0, 0, 0);\n", in.handler == Handler::LDX ? "x" : "acc");
+			break;
+
+		case Handler::LDW:
+			// The interpreter takes LDW's flags from Y, so we do too
+			emit(out, "\tmem = %s(pages, %s);\n", word, p.c_str());
+			emit(out, "\tif (!mem) %s\n", exit);
+			out += "\tacc = loadWord(mem);\n";
+			out += "\tf.set(y, 0, 0, 0, 0);\n";
+			break;
+
+		case Handler::STX:
+		case Handler::STA:
+			emit(out, "\tmem = byteAt(pages, %s);\n", p.c_str());
+			emit(out, "\tif (!mem) %s\n", exit);
+			emit(out, "\t*mem = uint8_t(%s);\n", in.handler == Handler::STX ? "x" : "acc");
+			break;
+
+		case Handler::STW:
+			emit(out, "\tmem = %s(pages, %s);\n", word, p.c_str());
+			emit(out, "\tif (!mem) %s\n", exit);
+			out += "\tstoreWord(mem, acc);\n";
+			break;
+
+		case Handler::PUSH:
+			emit(out, "\tparam = %s;\n", p.c_str());
+			emit(out, "\tmem = %s(pages, sp);\n", word);
+			emit(out, "\tif (!mem) %s\n", exit);
+			out += "\tstoreWord(mem, param);\n";
+			out += "\tsp = T(sp + sizeof(T));\n";
+			break;
+
+		case Handler::POP: {
+			static const char *const regs[] = { "x", "y", "acc" };
+			emit(out, "\tmem = %s(pages, T(sp - sizeof(T)));\n", word);
+			emit(out, "\tif (!mem) %s\n", exit);
+			out += "\tsp = T(sp - sizeof(T));\n";
+			if (in.paramMode != 0b000) {
+				emit(out, "\t%s = loadWord(mem);\n", regs[in.paramMode - 1]);
+			}
+			break;
+		}
+
+		case Handler::JMP:
+		case Handler::JLR:
+			emit(out, "\tparam = %s;\n", p.c_str());
+			if (in.handler == Handler::JLR) {
+				emit(out, "\ty = 0x%04x;\n", in.next);
+			}
+			break;
+
+		case Handler::B:
+			emit(out, "\tparam = %s;\n", p.c_str());
+			break;
+
+		case Handler::BCC: cond = "!f.carry()"; break;
+		case Handler::BCS: cond = "f.carry()"; break;
+		case Handler::BEQ: cond = "f.zero()"; break;
+		case Handler::BNE: cond = "!f.zero()"; break;
+		case Handler::BMI: cond = "f.negative()"; break;
+		case Handler::BPL: cond = "!f.negative()"; break;
+		case Handler::BVS: cond = "f.overflow()"; break;
+		case Handler::BVC: cond = "!f.overflow()"; break;
+		}
+
+		if (cond) {
+			emit(out, "\tparam = %s;\n", p.c_str());
+		}
+		out += "\ti += 1;\n";
+
+		// Jumps and branches go straight to their target when it's known,
+		// and through the dispatch switch when it isn't
+		if (isTerminator(in.handler)) {
+			const char *indent = cond ? "\t\t" : "\t";
+			if (cond) {
+				emit(out, "\tif (%s) {\n", cond);
+			}
+
+			uint32_t target;
+			if (directTarget(in, mask_, target)) {
+				jumpTo(out, target, indent);
+			} else if (in.handler == Handler::JMP || in.handler == Handler::JLR) {
+				emit(out, "%spc = param;\n%sgoto dispatch;\n", indent, indent);
+			} else {
+				emit(out, "%spc = T(0x%04x + param);\n%sgoto dispatch;\n", indent, in.pc, indent);
+			}
+
+			if (cond) {
+				out += "\t}\n";
+			} else {
+				return;
+			}
+		}
+
+		size_t idx = index_[in.pc];
+		if (!fallsThrough(idx) || isConditional(in.handler)) {
+			jumpTo(out, in.next, "\t");
+		}
+	}
+
+	std::span<const uint8_t> pmem_;
+	int bits_;
+	uint32_t mask_;
+
+	// Where each translated instruction is in 'instrs_', or -1
+	std::vector<int> index_;
+	std::vector<Instr> found_;
+	std::vector<Instr> instrs_;
+};
+
+}
+
+int translateAot(
+	std::span<const uint8_t> pmem, int bits, std::string &out, std::string *err)
+{
+	if (bits != 8 && bits != 16) {
+		return fail(err, "Only 8 and 16 bit programs can be translated");
+	}
+
+	out.clear();
+	Translator(pmem, bits).translate(out);
+	return 0;
+}
+
+AotModule::~AotModule()
+{
+#ifdef SCISAVM_AOT
+	if (handle) {
+		dlclose(handle);
+	}
+#endif
+}
+
+bool AotModule::matches(std::span<const uint8_t> pmem, int bits)
+{
+	if (bits != this->bits || pmem.size() != text.size()) {
+		return false;
+	} else if (pmem.data() == src.load(std::memory_order_relaxed)) {
+		return true;
+	} else if (memcmp(pmem.data(), text.data(), text.size()) != 0) {
+		return false;
+	}
+
+	src.store(pmem.data(), std::memory_order_relaxed);
+	return true;
+}
+
+int loadAot(
+	const char *path, std::span<const uint8_t> pmem, int bits,
+	std::shared_ptr<AotModule> &mod, std::string *err)
+{
+#ifdef SCISAVM_AOT
+	// Without a slash, dlopen() would search the library path
+	std::string file = path;
+	if (file.find('/') == std::string::npos) {
+		file = "./" + file;
+	}
+
+	auto m = std::make_shared<AotModule>();
+	m->handle = dlopen(file.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (!m->handle) {
+		return fail(err, dlerror());
+	}
+
+	auto abi = (const uint32_t *)dlsym(m->handle, "scisavm_aot_abi");
+	auto modBits = (const uint32_t *)dlsym(m->handle, "scisavm_aot_bits");
+	auto size = (const uint32_t *)dlsym(m->handle, "scisavm_aot_size");
+	auto text = (const uint8_t *)dlsym(m->handle, "scisavm_aot_text");
+	auto fn = (AotFn)dlsym(m->handle, "scisavm_aot_run");
+	if (!abi || !modBits || !size || !text || !fn) {
+		return fail(err, std::string(path) + " isn't a translated program");
+	} else if (*abi != AOT_ABI) {
+		return fail(err, std::string(path) + " was translated for a different VM version");
+	}
+
+	m->fn = fn;
+	m->bits = *modBits;
+	m->text = { text, *size };
+	if (!m->matches(pmem, bits)) {
+		return fail(err, std::string(path) + " was translated from a different program");
+	}
+
+	mod = std::move(m);
+	return 0;
+#else
+	(void)path;
+	(void)pmem;
+	(void)bits;
+	(void)mod;
+	return fail(err, "Translated programs aren't supported on this platform");
+#endif
+}
+
+}
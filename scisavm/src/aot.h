@@ -0,0 +1,66 @@
+#ifndef SCISAVM_AOT_H
+#define SCISAVM_AOT_H
+
+#include "scisavm.h"
+
+#include <atomic>
+
+// Translated programs are loaded with dlopen()
+#if defined(__unix__) || defined(__APPLE__)
+#define SCISAVM_AOT
+#endif
+
+namespace scisavm {
+
+// Bumped whenever the interface between translated code
+// and the VM changes, so that stale modules are refused
+constexpr uint32_t AOT_ABI = 1;
+
+// The guest state as seen by translated code.
+// This has to match the State struct written by translateAot().
+struct AotState {
+	uint32_t pc;
+	uint32_t sp;
+	uint32_t acc;
+	uint32_t x;
+	uint32_t y;
+
+	uint32_t flagsOut;
+	uint32_t flagsA;
+	uint32_t flagsB;
+	uint32_t flagsC;
+	uint32_t flagsOp;
+
+	const Page *pages;
+};
+
+// Translated code executes at most 'n' instructions,
+// and returns the number it executed. It returns early, with 'pc' at
+// the instruction, when it gets to something it leaves to the interpreter.
+using AotFn = int (*)(AotState *, int n);
+
+struct AotModule {
+	AotModule() = default;
+	~AotModule();
+
+	AotModule(const AotModule &) = delete;
+	AotModule &operator=(const AotModule &) = delete;
+
+	// Whether the module was translated from this program
+	bool matches(std::span<const uint8_t> pmem, int bits);
+
+	void *handle = nullptr;
+	AotFn fn = nullptr;
+	int bits = 0;
+
+	// The program the module was translated from
+	std::span<const uint8_t> text;
+
+	// The last pmem which was found to match,
+	// to avoid comparing the whole program on every step()
+	std::atomic<const uint8_t *> src = nullptr;
+};
+
+}
+
+#endif
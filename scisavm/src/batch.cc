@@ -0,0 +1,568 @@
+#include "scisavm.h"
+#include "isa.h"
+
+#include <algorithm>
+
+namespace scisavm {
+
+namespace {
+
+constexpr int LANES = Batch8::LANES;
+constexpr uint8_t ADD = uint8_t(FlagsOp::ADD);
+constexpr uint8_t Z = uint8_t(FlagsOp::Z);
+
+// A lane which has waited this many steps runs next,
+// even if other lanes are at a lower PC
+constexpr uint32_t MAX_WAIT = LANES;
+
+// Lanes are selected with masks of 0xff or 0x00, which are blended
+// into the results rather than branched on. Every instruction has
+// its own loop over the lanes, with anything which depends on the
+// instruction decided at compile time, so that the loops have
+// no control flow in them.
+uint8_t sel(uint8_t m, uint8_t a, uint8_t b)
+{
+	return (a & m) | (b & ~m);
+}
+
+uint8_t mask(bool cond)
+{
+	return cond ? 0xff : 0;
+}
+
+// Stop lane 'l' for 'why' if 'm' selects it
+void stop(Batch8 &b, uint8_t m, int l, StopReason why)
+{
+	b.active[l] &= ~m;
+	b.reason[l] = StopReason(sel(m, uint8_t(why), uint8_t(b.reason[l])));
+}
+
+void setFlags(
+	Batch8 &b, uint8_t m, int l,
+	uint8_t out, uint8_t fa, uint8_t fb, uint8_t fc, uint8_t op)
+{
+	b.flagsOut[l] = sel(m, out, b.flagsOut[l]);
+	b.flagsA[l] = sel(m, fa, b.flagsA[l]);
+	b.flagsB[l] = sel(m, fb, b.flagsB[l]);
+	b.flagsC[l] = sel(m, fc, b.flagsC[l]);
+	b.flagsOp[l] = sel(m, op, b.flagsOp[l]);
+}
+
+// These match Flags<uint8_t>
+uint8_t carry(const Batch8 &b, int l)
+{
+	uint16_t sum = uint16_t(b.flagsA[l]) + b.flagsB[l] + b.flagsC[l];
+	return sel(mask(b.flagsOp[l] == ADD), sum >> 8, b.flagsC[l]) & 1;
+}
+
+uint8_t overflow(const Batch8 &b, int l)
+{
+	uint8_t out = b.flagsOut[l];
+	uint8_t v = (((b.flagsA[l] ^ out) & (b.flagsB[l] ^ out)) >> 7) & 1;
+	return v & (b.flagsOp[l] == ADD);
+}
+
+// Only taken when something has gone wrong, so this one branches
+void fail(Batch8 &b, const uint8_t *m, const char *err)
+{
+	for (int l = 0; l < LANES; ++l) {
+		if (m[l]) {
+			b.error[l] = err;
+			b.active[l] = 0;
+			b.reason[l] = StopReason::ERROR;
+		}
+	}
+}
+
+void advance(Batch8 &b, const uint8_t *m, uint8_t next)
+{
+	for (int l = 0; l < LANES; ++l) {
+		b.pc[l] = sel(m[l], next, b.pc[l]);
+	}
+}
+
+// Check the addresses accessed by the lanes in 'm'.
+// Lanes which access IO are stopped before the instruction executes.
+// Lanes which access unmapped memory get an error,
+// but complete the instruction like a CPU8 would.
+// 'ok' is set for the lanes where the address is plain memory.
+void checkAccess(
+	Batch8 &b, uint8_t *m, const uint8_t *addr, uint8_t *ok,
+	const char *err)
+{
+	// Every lane looks up a different address, which doesn't vectorize
+	uint8_t kind[LANES];
+	for (int l = 0; l < LANES; ++l) {
+		kind[l] = uint8_t(b.kinds[addr[l]]);
+	}
+
+	uint8_t bad[LANES];
+	uint8_t anyBad = 0;
+	for (int l = 0; l < LANES; ++l) {
+		uint8_t io = m[l] & mask(kind[l] == uint8_t(PageKind::IO));
+		ok[l] = m[l] & mask(kind[l] == uint8_t(PageKind::MEM));
+		bad[l] = m[l] & ~ok[l] & ~io;
+		anyBad |= bad[l];
+		m[l] &= ~io;
+		stop(b, io, l, StopReason::IO_WAIT);
+	}
+
+	if (anyBad) {
+		fail(b, bad, err);
+	}
+}
+
+void load(Batch8 &b, uint8_t *m, const uint8_t *addr, uint8_t *val)
+{
+	uint8_t ok[LANES];
+	checkAccess(b, m, addr, ok, "Illegal load");
+	for (int l = 0; l < LANES; ++l) {
+		val[l] = b.mem[addr[l]][l] & ok[l];
+	}
+}
+
+void store(Batch8 &b, uint8_t *m, const uint8_t *addr, const uint8_t *val)
+{
+	// Lanes which don't store write back what's already there.
+	// Every lane has its own column of 'mem', so lanes never collide.
+	uint8_t ok[LANES];
+	checkAccess(b, m, addr, ok, "Illegal store");
+	for (int l = 0; l < LANES; ++l) {
+		uint8_t &dst = b.mem[addr[l]][l];
+		dst = sel(ok[l], val[l], dst);
+	}
+}
+
+void setReg(uint8_t *dst, const uint8_t *m, const uint8_t *val)
+{
+	for (int l = 0; l < LANES; ++l) {
+		dst[l] = sel(m[l], val[l], dst[l]);
+	}
+}
+
+// ADD, SUB, ADC and CMP, which are all acc + p + c
+template<Handler H>
+void arith(Batch8 &b, const uint8_t *m, const uint8_t *param)
+{
+	constexpr bool sub = H == Handler::SUB || H == Handler::CMP;
+	for (int l = 0; l < LANES; ++l) {
+		uint8_t a = b.acc[l];
+		uint8_t p = sub ? uint8_t(~param[l]) : param[l];
+		uint8_t c = sub ? 1 : H == Handler::ADC ? carry(b, l) : 0;
+		uint8_t out = a + p + c;
+		setFlags(b, m[l], l, out, a, p, c, ADD);
+		if constexpr (H != Handler::CMP) {
+			b.acc[l] = sel(m[l], out, a);
+		}
+	}
+}
+
+template<Handler H>
+void logic(Batch8 &b, const uint8_t *m, const uint8_t *param)
+{
+	for (int l = 0; l < LANES; ++l) {
+		uint8_t a = b.acc[l];
+		uint8_t out =
+			H == Handler::XOR ? a ^ param[l] :
+			H == Handler::AND ? a & param[l] :
+			a | param[l];
+		setFlags(b, m[l], l, out, 0, 0, 0, Z);
+		b.acc[l] = sel(m[l], out, a);
+	}
+}
+
+template<Handler H>
+void shift(Batch8 &b, const uint8_t *m)
+{
+	for (int l = 0; l < LANES; ++l) {
+		uint8_t a = b.acc[l];
+		uint8_t hi = H == Handler::ROR ? carry(b, l) << 7 : 0;
+		uint8_t out = (a >> 1) | hi;
+		setFlags(b, m[l], l, out, 0, 0, a & 0x01, Z);
+		b.acc[l] = sel(m[l], out, a);
+	}
+}
+
+void loadFlags(Batch8 &b, const uint8_t *m, const uint8_t *out)
+{
+	for (int l = 0; l < LANES; ++l) {
+		setFlags(b, m[l], l, out[l], 0, 0, 0, Z);
+	}
+}
+
+template<Handler H>
+bool cond(const Batch8 &b, int l)
+{
+	uint8_t out = b.flagsOut[l];
+	switch (H) {
+	case Handler::BCC: return !carry(b, l);
+	case Handler::BCS: return carry(b, l);
+	case Handler::BEQ: return out == 0;
+	case Handler::BNE: return out != 0;
+	case Handler::BMI: return out & 0x80;
+	case Handler::BPL: return !(out & 0x80);
+	case Handler::BVS: return overflow(b, l);
+	case Handler::BVC: return !overflow(b, l);
+	default: return true;
+	}
+}
+
+template<Handler H>
+void branch(Batch8 &b, const uint8_t *m, const uint8_t *param, uint8_t pc, uint8_t next)
+{
+	for (int l = 0; l < LANES; ++l) {
+		uint8_t target = sel(mask(cond<H>(b, l)), pc + param[l], next);
+		b.pc[l] = sel(m[l], target, b.pc[l]);
+	}
+}
+
+// Execute the instruction at 'pc' for the lanes in 'm'
+void execGroup(Batch8 &b, uint8_t *m, uint8_t pc)
+{
+	if (pc >= b.pmem.size()) {
+		fail(b, m, "PC out of bounds");
+		return;
+	}
+
+	uint8_t instr = b.pmem[pc];
+	uint8_t paramMode = instr & 0x07;
+	uint8_t next = pc + 1;
+	uint8_t second = 0;
+	if (instr & 0b00000'100) {
+		if (pc + 1u >= b.pmem.size()) {
+			advance(b, m, next);
+			fail(b, m, "PC out of bounds");
+			return;
+		}
+
+		second = b.pmem[pc + 1];
+		next = pc + 2;
+	}
+
+	// The param mode is the same for every lane,
+	// so pick the source register outside of the loop
+	static constexpr uint8_t zero[LANES] = {};
+	const uint8_t *src =
+		(paramMode & 0b011) == 0b001 ? b.x :
+		(paramMode & 0b011) == 0b010 ? b.y :
+		(paramMode & 0b011) == 0b011 ? b.acc : zero;
+	uint8_t param[LANES];
+	for (int l = 0; l < LANES; ++l) {
+		param[l] = src[l] + second;
+	}
+
+	uint8_t addr[LANES];
+	uint8_t val[LANES];
+
+	switch (handlerFor(instr)) {
+	case Handler::TRUNCATED:
+	case Handler::NOP:
+		break;
+
+	case Handler::LSR:
+		shift<Handler::LSR>(b, m);
+		break;
+
+	case Handler::ROR:
+		shift<Handler::ROR>(b, m);
+		break;
+
+	case Handler::INC:
+		for (int l = 0; l < LANES; ++l) {
+			uint8_t a = b.acc[l];
+			uint8_t out = a + 1;
+			setFlags(b, m[l], l, out, a, 1, 0, ADD);
+			b.acc[l] = sel(m[l], out, a);
+		}
+		break;
+
+	case Handler::LSP:
+	case Handler::LSW:
+		for (int l = 0; l < LANES; ++l) {
+			addr[l] = b.sp[l] - second;
+		}
+		load(b, m, addr, val);
+		setReg(b.acc, m, val);
+		loadFlags(b, m, val);
+		break;
+
+	case Handler::SSP:
+	case Handler::SSW:
+		for (int l = 0; l < LANES; ++l) {
+			addr[l] = b.sp[l] - second;
+		}
+		store(b, m, addr, b.acc);
+		break;
+
+	case Handler::ADD:
+		arith<Handler::ADD>(b, m, param);
+		break;
+
+	case Handler::SUB:
+		arith<Handler::SUB>(b, m, param);
+		break;
+
+	case Handler::ADC:
+		arith<Handler::ADC>(b, m, param);
+		break;
+
+	case Handler::CMP:
+		arith<Handler::CMP>(b, m, param);
+		break;
+
+	case Handler::XOR:
+		logic<Handler::XOR>(b, m, param);
+		break;
+
+	case Handler::AND:
+		logic<Handler::AND>(b, m, param);
+		break;
+
+	case Handler::OR:
+		logic<Handler::OR>(b, m, param);
+		break;
+
+	case Handler::MVX:
+		setReg(b.x, m, param);
+		break;
+
+	case Handler::MVY:
+		setReg(b.y, m, param);
+		break;
+
+	case Handler::MVA:
+		setReg(b.acc, m, param);
+		break;
+
+	case Handler::SPS:
+		setReg(b.sp, m, param);
+		break;
+
+	case Handler::MHA:
+		advance(b, m, next);
+		fail(b, m, "Invalid instruction for bitness");
+		return;
+
+	case Handler::LDX:
+		load(b, m, param, val);
+		setReg(b.x, m, val);
+		loadFlags(b, m, val);
+		break;
+
+	case Handler::LDW:
+		// Like the CPU, LDW takes its flags from Y
+		load(b, m, param, val);
+		setReg(b.acc, m, val);
+		loadFlags(b, m, b.y);
+		break;
+
+	case Handler::LDA:
+		load(b, m, param, val);
+		setReg(b.acc, m, val);
+		loadFlags(b, m, val);
+		break;
+
+	case Handler::STX:
+		store(b, m, param, b.x);
+		break;
+
+	case Handler::STW:
+	case Handler::STA:
+		store(b, m, param, b.acc);
+		break;
+
+	case Handler::JMP:
+		setReg(b.pc, m, param);
+		return;
+
+	case Handler::JLR:
+		for (int l = 0; l < LANES; ++l) {
+			b.y[l] = sel(m[l], next, b.y[l]);
+		}
+		setReg(b.pc, m, param);
+		return;
+
+#define BRANCH(name) \
+	case Handler::name: \
+		branch<Handler::name>(b, m, param, pc, next); \
+		return;
+	BRANCH(B)
+	BRANCH(BCC)
+	BRANCH(BCS)
+	BRANCH(BEQ)
+	BRANCH(BNE)
+	BRANCH(BMI)
+	BRANCH(BPL)
+	BRANCH(BVS)
+	BRANCH(BVC)
+#undef BRANCH
+
+	case Handler::PUSH:
+		store(b, m, b.sp, param);
+		for (int l = 0; l < LANES; ++l) {
+			b.sp[l] = sel(m[l], b.sp[l] + 1, b.sp[l]);
+		}
+		break;
+
+	case Handler::POP:
+		for (int l = 0; l < LANES; ++l) {
+			addr[l] = b.sp[l] - 1;
+		}
+		load(b, m, addr, val);
+		setReg(b.sp, m, addr);
+
+		if (paramMode == 0b001) {
+			setReg(b.x, m, val);
+		} else if (paramMode == 0b010) {
+			setReg(b.y, m, val);
+		} else if (paramMode == 0b011) {
+			setReg(b.acc, m, val);
+		} else if (paramMode != 0b000) {
+			advance(b, m, next);
+			fail(b, m, "Invalid pop");
+			return;
+		}
+		break;
+	}
+
+	advance(b, m, next);
+}
+
+}
+
+void Batch8::init(CPU8 &cpu)
+{
+	cpu.remap();
+	pmem = cpu.pmem;
+	for (size_t addr = 0; addr < kinds.size(); ++addr) {
+		kinds[addr] = cpu.map.pages[addr].kind;
+	}
+
+	for (int l = 0; l < LANES; ++l) {
+		load(l, cpu);
+	}
+}
+
+void Batch8::load(int lane, CPU8 &cpu)
+{
+	active[lane] = cpu.error ? 0 : 0xff;
+	reason[lane] = cpu.error ? StopReason::ERROR : StopReason::NONE;
+	error[lane] = cpu.error;
+	waited[lane] = 0;
+
+	pc[lane] = cpu.pc;
+	sp[lane] = cpu.sp;
+	acc[lane] = cpu.acc;
+	x[lane] = cpu.x;
+	y[lane] = cpu.y;
+
+	flagsOut[lane] = cpu.flags.out;
+	flagsA[lane] = cpu.flags.a;
+	flagsB[lane] = cpu.flags.b;
+	flagsC[lane] = cpu.flags.c;
+	flagsOp[lane] = uint8_t(cpu.flags.op);
+
+	cpu.remap();
+	for (size_t addr = 0; addr < kinds.size(); ++addr) {
+		const Page &page = cpu.map.pages[addr];
+		if (page.kind == PageKind::MEM) {
+			mem[addr][lane] = page.mem[0];
+		}
+	}
+}
+
+void Batch8::extract(int lane, CPU8 &cpu)
+{
+	cpu.error = error[lane];
+
+	cpu.pc = pc[lane];
+	cpu.sp = sp[lane];
+	cpu.acc = acc[lane];
+	cpu.x = x[lane];
+	cpu.y = y[lane];
+	cpu.flags = {
+		flagsOut[lane], flagsA[lane], flagsB[lane], flagsC[lane],
+		FlagsOp(flagsOp[lane]),
+	};
+
+	cpu.remap();
+	for (size_t addr = 0; addr < kinds.size(); ++addr) {
+		const Page &page = cpu.map.pages[addr];
+		if (page.kind == PageKind::MEM) {
+			page.mem[0] = mem[addr][lane];
+		}
+	}
+}
+
+// Everything execGroup() calls is inlined into here, so that the compiler
+// can see that the lane loops don't alias, without runtime checks
+[[gnu::flatten]] void Batch8::step(int n)
+{
+	for (int i = 0; i < n; ++i) {
+		// Running the group at the lowest PC gives lanes
+		// which fell behind a chance to catch up and reconverge,
+		// unless a lane has been waiting for too long
+		uint8_t any = 0;
+		uint8_t low = 0xff;
+		uint32_t longest = 0;
+		for (int l = 0; l < LANES; ++l) {
+			any |= active[l];
+			low = std::min(low, sel(active[l], pc[l], 0xff));
+			longest = std::max(longest, waited[l] & -uint32_t(active[l] & 1));
+		}
+
+		if (!any) {
+			return;
+		}
+
+		uint8_t at = low;
+		if (longest > MAX_WAIT) {
+			for (int l = 0; l < LANES; ++l) {
+				if (active[l] && waited[l] == longest) {
+					at = pc[l];
+					break;
+				}
+			}
+		}
+
+		uint8_t m[LANES];
+		for (int l = 0; l < LANES; ++l) {
+			m[l] = active[l] & mask(pc[l] == at);
+		}
+
+		// Every lane in the group is at the same PC,
+		// so only the other registers have to be kept
+		uint8_t oldSp[LANES], oldAcc[LANES], oldX[LANES], oldY[LANES];
+		uint8_t oldOut[LANES], oldA[LANES], oldB[LANES], oldC[LANES], oldOp[LANES];
+		for (int l = 0; l < LANES; ++l) {
+			oldSp[l] = sp[l];
+			oldAcc[l] = acc[l];
+			oldX[l] = x[l];
+			oldY[l] = y[l];
+			oldOut[l] = flagsOut[l];
+			oldA[l] = flagsA[l];
+			oldB[l] = flagsB[l];
+			oldC[l] = flagsC[l];
+			oldOp[l] = flagsOp[l];
+		}
+
+		// Lanes which touch IO drop out of 'm' here, and lanes which
+		// fail or touch IO drop out of 'active'
+		execGroup(*this, m, at);
+
+		for (int l = 0; l < LANES; ++l) {
+			waited[l] = m[l] ? 0 : waited[l] + 1;
+
+			// An instruction which doesn't change anything, like B 0,
+			// will never get anywhere, so the lane stops as if halted
+			bool same =
+				(pc[l] == at) & (sp[l] == oldSp[l]) & (acc[l] == oldAcc[l]) &
+				(x[l] == oldX[l]) & (y[l] == oldY[l]) &
+				(flagsOut[l] == oldOut[l]) & (flagsA[l] == oldA[l]) &
+				(flagsB[l] == oldB[l]) & (flagsC[l] == oldC[l]) & (flagsOp[l] == oldOp[l]);
+			stop(*this, m[l] & active[l] & mask(same), l, StopReason::HALT);
+		}
+	}
+}
+
+}
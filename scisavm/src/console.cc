@@ -0,0 +1,399 @@
+#include "scisavm.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include <poll.h>
+#include <unistd.h>
+
+namespace scisavm {
+
+using Clock = std::chrono::steady_clock;
+
+// The ring has one producer (the CPU storing to the device)
+// and one consumer (whoever is writing the output).
+// 'head' and 'tail' only ever grow, and are masked to index the ring.
+struct ConsoleImpl {
+	ConsoleOptions opts;
+	std::vector<char> ring;
+	size_t mask;
+
+	std::atomic<size_t> head = 0;
+	std::atomic<size_t> tail = 0;
+
+	// When the oldest unwritten byte was stored,
+	// only used without a writer thread
+	Clock::time_point pendingSince;
+
+	std::thread writer;
+	std::mutex mut;
+	std::condition_variable wakeCond;
+	std::condition_variable drainedCond;
+	std::atomic<bool> wakeRequested = false;
+	bool stopping = false;
+
+	void writeOut();
+	void wake();
+	void flush();
+	void run();
+	void poll();
+
+	size_t makeRoom(size_t h);
+	void stored(size_t before, size_t after, bool newline);
+};
+
+// Write everything between tail and head
+void ConsoleImpl::writeOut()
+{
+	size_t t = tail.load(std::memory_order_relaxed);
+	size_t h = head.load(std::memory_order_acquire);
+	if (t == h) {
+		return;
+	}
+
+	while (t != h) {
+		size_t start = t & mask;
+		size_t len = std::min(h - t, ring.size() - start);
+		fwrite(ring.data() + start, 1, len, opts.file);
+		t += len;
+	}
+
+	fflush(opts.file);
+	tail.store(h, std::memory_order_release);
+}
+
+void ConsoleImpl::wake()
+{
+	if (!wakeRequested.exchange(true)) {
+		std::lock_guard<std::mutex> lock(mut);
+		wakeCond.notify_one();
+	}
+}
+
+void ConsoleImpl::flush()
+{
+	if (!writer.joinable()) {
+		writeOut();
+		return;
+	}
+
+	size_t h = head.load(std::memory_order_relaxed);
+	wake();
+	std::unique_lock<std::mutex> lock(mut);
+	drainedCond.wait(lock, [&] { return tail.load() >= h; });
+}
+
+void ConsoleImpl::poll()
+{
+	if (writer.joinable() || opts.flushMs <= 0) {
+		return;
+	}
+
+	if (head.load(std::memory_order_relaxed) == tail.load(std::memory_order_relaxed)) {
+		return;
+	}
+
+	if (Clock::now() - pendingSince >= std::chrono::milliseconds(opts.flushMs)) {
+		writeOut();
+	}
+}
+
+void ConsoleImpl::run()
+{
+	auto interval = std::chrono::milliseconds(opts.flushMs);
+	std::unique_lock<std::mutex> lock(mut);
+	while (!stopping) {
+		auto woken = [&] { return wakeRequested.load() || stopping; };
+		if (opts.flushMs > 0) {
+			wakeCond.wait_for(lock, interval, woken);
+		} else {
+			wakeCond.wait(lock, woken);
+		}
+		wakeRequested = false;
+
+		lock.unlock();
+		writeOut();
+		lock.lock();
+		drainedCond.notify_all();
+	}
+}
+
+ConsoleOut::ConsoleOut(ConsoleOptions opts):
+	impl(std::make_unique<ConsoleImpl>())
+{
+	size_t size = 16;
+	while (size < opts.bufferSize) {
+		size *= 2;
+	}
+
+	impl->opts = opts;
+	impl->ring.resize(size);
+	impl->mask = size - 1;
+
+	if (opts.writerThread) {
+		impl->writer = std::thread([this] { impl->run(); });
+	}
+}
+
+ConsoleOut::~ConsoleOut()
+{
+	if (impl->writer.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(impl->mut);
+			impl->stopping = true;
+			impl->wakeCond.notify_one();
+		}
+		impl->writer.join();
+	}
+
+	impl->writeOut();
+}
+
+// Wait until there's space in the ring after 'h',
+// and return how much of it is used
+size_t ConsoleImpl::makeRoom(size_t h)
+{
+	size_t used = h - tail.load(std::memory_order_acquire);
+	if (used < ring.size()) {
+		return used;
+	}
+
+	if (writer.joinable()) {
+		wake();
+		std::unique_lock<std::mutex> lock(mut);
+		drainedCond.wait(lock, [&] { return h - tail.load() < ring.size(); });
+	} else {
+		writeOut();
+	}
+
+	return h - tail.load(std::memory_order_acquire);
+}
+
+// Flush if the options say so, now that the ring
+// went from 'before' to 'after' bytes used
+void ConsoleImpl::stored(size_t before, size_t after, bool newline)
+{
+	newline = newline && opts.flushOnNewline;
+	if (writer.joinable()) {
+		// Get the writer going before we run out of space
+		if (newline || after >= ring.size() / 2) {
+			wake();
+		}
+		return;
+	}
+
+	if (newline || after == ring.size()) {
+		writeOut();
+		return;
+	}
+
+	if (opts.flushMs > 0) {
+		if (before == 0) {
+			pendingSince = Clock::now();
+		} else {
+			poll();
+		}
+	}
+}
+
+void ConsoleOut::store(size_t, uint8_t val)
+{
+	ConsoleImpl &c = *impl;
+	size_t h = c.head.load(std::memory_order_relaxed);
+	size_t used = c.makeRoom(h);
+
+	c.ring[h & c.mask] = char(val);
+	c.head.store(h + 1, std::memory_order_release);
+	c.stored(used, used + 1, val == '\n');
+}
+
+void ConsoleOut::storeBlock(size_t, std::span<const uint8_t> data)
+{
+	ConsoleImpl &c = *impl;
+	while (!data.empty()) {
+		size_t h = c.head.load(std::memory_order_relaxed);
+		size_t used = c.makeRoom(h);
+
+		// Copy as much as fits, in at most two pieces
+		// when it wraps around the end of the ring
+		size_t len = std::min(data.size(), c.ring.size() - used);
+		size_t start = h & c.mask;
+		size_t first = std::min(len, c.ring.size() - start);
+		memcpy(c.ring.data() + start, data.data(), first);
+		memcpy(c.ring.data(), data.data() + first, len - first);
+		c.head.store(h + len, std::memory_order_release);
+
+		bool newline = memchr(data.data(), '\n', len) != nullptr;
+		c.stored(used, used + len, newline);
+		data = data.subspan(len);
+	}
+}
+
+void ConsoleOut::flush()
+{
+	impl->flush();
+}
+
+void ConsoleOut::poll()
+{
+	impl->poll();
+}
+
+// The input ring works like the output ring, except the reader thread
+// is the producer and the CPU is the consumer
+struct ConsoleInImpl {
+	int fd;
+	std::vector<char> ring;
+	size_t mask;
+
+	std::atomic<size_t> head = 0;
+	std::atomic<size_t> tail = 0;
+	std::atomic<bool> eof = false;
+
+	// Written to when the reader thread has to stop
+	int wakePipe[2] = { -1, -1 };
+
+	std::thread reader;
+	std::mutex mut;
+	std::condition_variable dataCond;
+	std::condition_variable spaceCond;
+	std::atomic<bool> spaceWanted = false;
+	bool stopping = false;
+
+	void run();
+};
+
+void ConsoleInImpl::run()
+{
+	while (true) {
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h - tail.load() == ring.size()) {
+			std::unique_lock<std::mutex> lock(mut);
+			spaceWanted = true;
+			spaceCond.wait(lock, [&] { return stopping || h - tail.load() < ring.size(); });
+			spaceWanted = false;
+			if (stopping) {
+				return;
+			}
+			continue;
+		}
+
+		pollfd fds[] = {
+			{ .fd = fd, .events = POLLIN, .revents = 0 },
+			{ .fd = wakePipe[0], .events = POLLIN, .revents = 0 },
+		};
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		if (fds[1].revents) {
+			return;
+		}
+
+		size_t start = h & mask;
+		size_t len = std::min(ring.size() - (h - tail.load()), ring.size() - start);
+		ssize_t n = read(fd, ring.data() + start, len);
+		if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+			continue;
+		} else if (n <= 0) {
+			break;
+		}
+
+		std::lock_guard<std::mutex> lock(mut);
+		head.store(h + n, std::memory_order_release);
+		dataCond.notify_all();
+	}
+
+	std::lock_guard<std::mutex> lock(mut);
+	eof = true;
+	dataCond.notify_all();
+}
+
+ConsoleIn::ConsoleIn(int fd, size_t bufferSize):
+	impl(std::make_unique<ConsoleInImpl>())
+{
+	size_t size = 16;
+	while (size < bufferSize) {
+		size *= 2;
+	}
+
+	impl->fd = fd;
+	impl->ring.resize(size);
+	impl->mask = size - 1;
+
+	if (pipe(impl->wakePipe) < 0) {
+		impl->eof = true;
+		return;
+	}
+
+	impl->reader = std::thread([this] { impl->run(); });
+}
+
+ConsoleIn::~ConsoleIn()
+{
+	if (impl->reader.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(impl->mut);
+			impl->stopping = true;
+			impl->spaceCond.notify_one();
+		}
+
+		char c = 0;
+		while (write(impl->wakePipe[1], &c, 1) < 0 && errno == EINTR);
+		impl->reader.join();
+	}
+
+	if (impl->wakePipe[0] >= 0) {
+		close(impl->wakePipe[0]);
+		close(impl->wakePipe[1]);
+	}
+}
+
+uint8_t ConsoleIn::load(size_t offset)
+{
+	ConsoleInImpl &c = *impl;
+	if (offset > 1) {
+		return 0;
+	}
+
+	// Check for the end of input first, so that the last bytes
+	// are seen before the end is
+	bool eof = c.eof.load();
+	size_t t = c.tail.load(std::memory_order_relaxed);
+	bool ready = c.head.load(std::memory_order_acquire) != t;
+	if (offset == 0) {
+		return (ready ? STATUS_READY : 0) | (!ready && eof ? STATUS_EOF : 0);
+	} else if (!ready) {
+		if (!eof) {
+			stop = StopReason::IO_WAIT;
+		}
+		return 0;
+	}
+
+	uint8_t val = c.ring[t & c.mask];
+	c.tail.store(t + 1);
+	if (c.spaceWanted.load()) {
+		std::lock_guard<std::mutex> lock(c.mut);
+		c.spaceCond.notify_one();
+	}
+
+	return val;
+}
+
+bool ConsoleIn::wait()
+{
+	ConsoleInImpl &c = *impl;
+	std::unique_lock<std::mutex> lock(c.mut);
+	c.dataCond.wait(lock, [&] { return c.head.load() != c.tail.load() || c.eof; });
+	return c.head.load() != c.tail.load();
+}
+
+}
@@ -0,0 +1,357 @@
+#include "scisavm.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace scisavm {
+
+using Clock = std::chrono::steady_clock;
+
+// A job which is waiting for IO is retried after this long,
+// twice as long every time it's still waiting, up to the maximum
+static constexpr auto MIN_BACKOFF = std::chrono::microseconds(50);
+static constexpr auto MAX_BACKOFF = std::chrono::milliseconds(10);
+
+struct FarmWorker {
+	std::mutex mut;
+	std::deque<FarmJob *> jobs;
+	std::thread thread;
+};
+
+// A job waiting for IO, which sits here rather than in a deque
+struct FarmParked {
+	FarmJob *job;
+	Clock::time_point until;
+};
+
+// What the farm knows about a job which has waited for IO
+struct FarmWaiter {
+	Clock::duration backoff = MIN_BACKOFF;
+
+	// wake() was called while the job wasn't parked yet
+	bool woken = false;
+};
+
+struct FarmImpl {
+	int quantum;
+	std::vector<std::unique_ptr<FarmWorker>> workers;
+	std::function<void(FarmJob &)> onDone;
+
+	// Protects the counters, and is what idle workers
+	// and wait() sleep on
+	std::mutex mut;
+	std::condition_variable workCond;
+	std::condition_variable doneCond;
+
+	// Jobs sitting in a deque, and jobs which aren't done yet
+	size_t queued = 0;
+	size_t pending = 0;
+	bool stopping = false;
+
+	// Jobs waiting for IO
+	std::vector<FarmParked> parked;
+	std::unordered_map<FarmJob *, FarmWaiter> waiters;
+
+	// Where the next submitted job goes
+	std::atomic<size_t> nextWorker = 0;
+
+	FarmJob *take(size_t self);
+	void requeue(size_t worker, std::span<FarmJob *const> jobs);
+	void park(size_t self, FarmJob *job);
+	std::vector<FarmJob *> unparkExpired();
+	void idle(size_t self);
+	void run(size_t self);
+};
+
+// Take a job from the front of our own deque,
+// or steal one from the back of someone else's
+FarmJob *FarmImpl::take(size_t self)
+{
+	for (size_t i = 0; i < workers.size(); ++i) {
+		FarmWorker &w = *workers[(self + i) % workers.size()];
+		std::lock_guard<std::mutex> lock(w.mut);
+		if (w.jobs.empty()) {
+			continue;
+		}
+
+		FarmJob *job;
+		if (i == 0) {
+			job = w.jobs.front();
+			w.jobs.pop_front();
+		} else {
+			job = w.jobs.back();
+			w.jobs.pop_back();
+		}
+
+		std::lock_guard<std::mutex> countLock(mut);
+		queued -= 1;
+		return job;
+	}
+
+	return nullptr;
+}
+
+template<typename T>
+static void runSlice(FarmJob &job, CPU<T> &cpu, int quantum)
+{
+	int n = quantum;
+	if (job.budget > 0 && job.budget - job.executed < uint64_t(n)) {
+		n = job.budget - job.executed;
+	}
+
+	StepResult res = cpu.step(n);
+	job.executed += res.retired;
+	job.reason = res.reason;
+
+	if (res.reason == StopReason::BUDGET || res.reason == StopReason::IO_WAIT) {
+		if (job.budget == 0 || job.executed < job.budget) {
+			return;
+		}
+	}
+
+	job.error = cpu.error;
+	job.done = true;
+}
+
+// Put jobs at the back of a worker's deque,
+// where idle workers can steal them
+void FarmImpl::requeue(size_t worker, std::span<FarmJob *const> jobs)
+{
+	if (jobs.empty()) {
+		return;
+	}
+
+	FarmWorker &w = *workers[worker];
+	{
+		std::lock_guard<std::mutex> lock(w.mut);
+		w.jobs.insert(w.jobs.end(), jobs.begin(), jobs.end());
+	}
+
+	std::lock_guard<std::mutex> lock(mut);
+	queued += jobs.size();
+	workCond.notify_all();
+}
+
+// Set a job which is waiting for IO aside until wake() is called
+// for it or its backoff runs out, rather than having it spin
+void FarmImpl::park(size_t self, FarmJob *job)
+{
+	{
+		std::lock_guard<std::mutex> lock(mut);
+		FarmWaiter &waiter = waiters[job];
+		if (!waiter.woken) {
+			parked.push_back({ job, Clock::now() + waiter.backoff });
+			waiter.backoff = std::min<Clock::duration>(waiter.backoff * 2, MAX_BACKOFF);
+			return;
+		}
+
+		waiter.woken = false;
+	}
+
+	requeue(self, std::span(&job, 1));
+}
+
+// Take the parked jobs whose backoff has run out. Needs 'mut'.
+std::vector<FarmJob *> FarmImpl::unparkExpired()
+{
+	std::vector<FarmJob *> jobs;
+	auto now = Clock::now();
+	std::erase_if(parked, [&](const FarmParked &p) {
+		if (p.until > now) {
+			return false;
+		}
+
+		jobs.push_back(p.job);
+		return true;
+	});
+
+	return jobs;
+}
+
+// Sleep until there's something to do
+void FarmImpl::idle(size_t self)
+{
+	std::vector<FarmJob *> jobs;
+	{
+		std::unique_lock<std::mutex> lock(mut);
+		auto ready = [&] { return queued > 0 || stopping; };
+		if (parked.empty()) {
+			workCond.wait(lock, ready);
+		} else {
+			auto first = std::min_element(
+				parked.begin(), parked.end(),
+				[](const FarmParked &a, const FarmParked &b) { return a.until < b.until; });
+			workCond.wait_until(lock, first->until, ready);
+		}
+
+		if (stopping) {
+			return;
+		}
+		jobs = unparkExpired();
+	}
+
+	requeue(self, jobs);
+}
+
+void FarmImpl::run(size_t self)
+{
+	FarmWorker &me = *workers[self];
+	while (true) {
+		FarmJob *job = take(self);
+		if (!job) {
+			idle(self);
+			std::lock_guard<std::mutex> lock(mut);
+			if (stopping) {
+				return;
+			}
+			continue;
+		}
+
+		if (job->cpu8) {
+			runSlice(*job, *job->cpu8, quantum);
+		} else if (job->cpu16) {
+			runSlice(*job, *job->cpu16, quantum);
+		} else {
+			job->error = "Job has no CPU";
+			job->reason = StopReason::ERROR;
+			job->done = true;
+		}
+
+		if (!job->done && job->reason == StopReason::IO_WAIT) {
+			park(self, job);
+			continue;
+		}
+
+		if (!job->done) {
+			{
+				std::lock_guard<std::mutex> lock(me.mut);
+				me.jobs.push_back(job);
+			}
+
+			// Someone else might be idle and want to steal it,
+			// and parked jobs which are due go along with it
+			std::vector<FarmJob *> due;
+			{
+				std::lock_guard<std::mutex> lock(mut);
+				queued += 1;
+				waiters.erase(job);
+				if (!parked.empty()) {
+					due = unparkExpired();
+				}
+				workCond.notify_one();
+			}
+
+			requeue(self, due);
+			continue;
+		}
+
+		if (onDone) {
+			onDone(*job);
+		}
+
+		std::lock_guard<std::mutex> lock(mut);
+		waiters.erase(job);
+		pending -= 1;
+		if (pending == 0) {
+			doneCond.notify_all();
+		}
+	}
+}
+
+Farm::Farm(int workers, int quantum):
+	impl(std::make_unique<FarmImpl>())
+{
+	if (workers <= 0) {
+		workers = std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	impl->quantum = quantum > 0 ? quantum : 1;
+	for (int i = 0; i < workers; ++i) {
+		impl->workers.push_back(std::make_unique<FarmWorker>());
+	}
+
+	for (int i = 0; i < workers; ++i) {
+		impl->workers[i]->thread = std::thread([this, i] { impl->run(i); });
+	}
+}
+
+Farm::~Farm()
+{
+	{
+		std::lock_guard<std::mutex> lock(impl->mut);
+		impl->stopping = true;
+		impl->workCond.notify_all();
+	}
+
+	for (auto &w: impl->workers) {
+		w->thread.join();
+	}
+}
+
+void Farm::onDone(std::function<void(FarmJob &)> cb)
+{
+	impl->onDone = std::move(cb);
+}
+
+void Farm::submit(FarmJob &job)
+{
+	job.executed = 0;
+	job.reason = StopReason::NONE;
+	job.error = nullptr;
+	job.done = false;
+
+	size_t idx = impl->nextWorker++ % impl->workers.size();
+	FarmWorker &w = *impl->workers[idx];
+	{
+		std::lock_guard<std::mutex> lock(w.mut);
+		w.jobs.push_back(&job);
+	}
+
+	std::lock_guard<std::mutex> lock(impl->mut);
+	impl->queued += 1;
+	impl->pending += 1;
+	impl->workCond.notify_one();
+}
+
+void Farm::wake(FarmJob &job)
+{
+	{
+		std::lock_guard<std::mutex> lock(impl->mut);
+		auto it = std::find_if(
+			impl->parked.begin(), impl->parked.end(),
+			[&](const FarmParked &p) { return p.job == &job; });
+		if (it == impl->parked.end()) {
+			// It's still running, and will be requeued instead of parked
+			auto waiter = impl->waiters.find(&job);
+			if (waiter != impl->waiters.end()) {
+				waiter->second.woken = true;
+			}
+			return;
+		}
+
+		impl->parked.erase(it);
+		impl->waiters[&job].backoff = MIN_BACKOFF;
+	}
+
+	FarmJob *ptr = &job;
+	impl->requeue(impl->nextWorker++ % impl->workers.size(), std::span(&ptr, 1));
+}
+
+void Farm::wait()
+{
+	std::unique_lock<std::mutex> lock(impl->mut);
+	impl->doneCond.wait(lock, [&] { return impl->pending == 0; });
+}
+
+int Farm::workers()
+{
+	return impl->workers.size();
+}
+
+}
@@ -0,0 +1,486 @@
+#include "scisavm.h"
+
+#include <cerrno>
+#include <cstring>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SCISAVM_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace scisavm {
+
+struct ImageImpl {
+	// The whole file, mapped twice: read-only for text,
+	// and privately writable for data
+	uint8_t *ro = nullptr;
+	uint8_t *rw = nullptr;
+	size_t size = 0;
+
+	// Used instead of the mappings if mmap isn't available
+	std::vector<uint8_t> copy;
+
+	// Unpacked compressed sections
+	std::vector<uint8_t> text;
+	std::vector<uint8_t> data;
+
+	~ImageImpl()
+	{
+#ifdef SCISAVM_MMAP
+		if (ro) {
+			munmap(ro, size);
+		}
+		if (rw) {
+			munmap(rw, size);
+		}
+#endif
+	}
+};
+
+Image::Image() = default;
+Image::~Image() = default;
+
+// SCE v2 layout, all integers little endian:
+//
+//   header:    "\033SCE", u32 version, u32 section count, u32 reserved
+//   directory: one entry per section:
+//              char name[4], u32 flags, u32 offset, u32 size,
+//              u32 unpacked size, u32 alignment, u32 CRC-32, u32 reserved
+//   payloads:  at their offsets, which are multiples of their alignment
+//
+// A v1 file has a section name where v2 has its version,
+// so the two can't be confused.
+static constexpr size_t HEADER_SIZE = 16;
+static constexpr size_t ENTRY_SIZE = 32;
+
+// Uncompressed payloads start on host page boundaries,
+// so that each section can be mapped on its own
+static constexpr uint32_t PAGE_ALIGN = 4096;
+
+struct SectionSpan {
+	size_t offset = 0;
+	size_t size = 0;
+	size_t unpackedSize = 0;
+	uint32_t flags = 0;
+	uint32_t checksum = 0;
+	bool hasChecksum = false;
+	bool found = false;
+};
+
+static int fail(std::string *err, std::string msg)
+{
+	if (err) {
+		*err = std::move(msg);
+	}
+	return -1;
+}
+
+static uint32_t readU32(const uint8_t *ptr)
+{
+	return
+		(uint32_t(ptr[0]) << 0) |
+		(uint32_t(ptr[1]) << 8) |
+		(uint32_t(ptr[2]) << 16) |
+		(uint32_t(ptr[3]) << 24);
+}
+
+static void writeU32(std::vector<uint8_t> &out, size_t pos, uint32_t val)
+{
+	out[pos + 0] = uint8_t((val & 0x000000ffu) >> 0);
+	out[pos + 1] = uint8_t((val & 0x0000ff00u) >> 8);
+	out[pos + 2] = uint8_t((val & 0x00ff0000u) >> 16);
+	out[pos + 3] = uint8_t((val & 0xff000000u) >> 24);
+}
+
+static constexpr std::array<uint32_t, 256> crcTable = [] {
+	std::array<uint32_t, 256> table{};
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t crc = i;
+		for (int j = 0; j < 8; ++j) {
+			crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320u : 0);
+		}
+		table[i] = crc;
+	}
+	return table;
+}();
+
+static uint32_t crc32(std::span<const uint8_t> bytes)
+{
+	uint32_t crc = 0xffffffffu;
+	for (uint8_t b: bytes) {
+		crc = crcTable[(crc ^ b) & 0xff] ^ (crc >> 8);
+	}
+	return crc ^ 0xffffffffu;
+}
+
+// Compressed sections are run-length encoded. Each run starts with
+// a control byte 'c': below 0x80, c + 1 literal bytes follow;
+// otherwise the next byte is repeated c - 0x80 + 3 times.
+static std::vector<uint8_t> compress(std::span<const uint8_t> in)
+{
+	std::vector<uint8_t> out;
+	size_t i = 0;
+	size_t literals = 0;
+
+	auto flushLiterals = [&](size_t end) {
+		while (literals > 0) {
+			size_t n = std::min<size_t>(literals, 128);
+			out.push_back(uint8_t(n - 1));
+			out.insert(out.end(), in.begin() + (end - literals), in.begin() + (end - literals + n));
+			literals -= n;
+		}
+	};
+
+	while (i < in.size()) {
+		size_t run = 1;
+		while (i + run < in.size() && run < 130 && in[i + run] == in[i]) {
+			run += 1;
+		}
+
+		if (run < 3) {
+			literals += run;
+			i += run;
+			continue;
+		}
+
+		flushLiterals(i);
+		out.push_back(uint8_t(0x80 + run - 3));
+		out.push_back(in[i]);
+		i += run;
+	}
+
+	flushLiterals(i);
+	return out;
+}
+
+static int decompress(
+	std::span<const uint8_t> in, std::vector<uint8_t> &out, size_t size,
+	std::string *err)
+{
+	out.clear();
+	out.reserve(size);
+
+	size_t i = 0;
+	while (i < in.size()) {
+		uint8_t c = in[i++];
+		if (c < 0x80) {
+			size_t n = c + 1;
+			if (n > in.size() - i || n > size - out.size()) {
+				return fail(err, "Corrupt compressed section");
+			}
+			out.insert(out.end(), in.begin() + i, in.begin() + i + n);
+			i += n;
+		} else {
+			size_t n = c - 0x80 + 3;
+			if (i == in.size() || n > size - out.size()) {
+				return fail(err, "Corrupt compressed section");
+			}
+			out.insert(out.end(), n, in[i++]);
+		}
+	}
+
+	if (out.size() != size) {
+		return fail(err, "Corrupt compressed section");
+	}
+
+	return 0;
+}
+
+static SectionSpan *findSection(std::string_view name, SectionSpan &text, SectionSpan &data)
+{
+	if (name == "TEXT") {
+		return &text;
+	} else if (name == "DATA") {
+		return &data;
+	} else {
+		return nullptr;
+	}
+}
+
+// v1: sequential name, size and content records
+static int parseV1(
+	std::span<const uint8_t> file, SectionSpan &text, SectionSpan &data,
+	std::string *err)
+{
+	size_t pos = 4;
+	while (pos < file.size()) {
+		if (file.size() - pos < 8) {
+			return fail(err, "Short section header");
+		}
+
+		std::string_view name((const char *)file.data() + pos, 4);
+		size_t size = readU32(file.data() + pos + 4);
+		pos += 8;
+
+		SectionSpan *section = findSection(name, text, data);
+		if (!section) {
+			return fail(err, "Unknown section name: '" + std::string(name) + "'");
+		} else if (section->found) {
+			return fail(err, "Duplicate section: '" + std::string(name) + "'");
+		} else if (size > file.size() - pos) {
+			return fail(err, "Section '" + std::string(name) + "' extends past the end of the file");
+		}
+
+		section->offset = pos;
+		section->size = size;
+		section->unpackedSize = size;
+		section->found = true;
+		pos += size;
+	}
+
+	return 0;
+}
+
+static int parseV2(
+	std::span<const uint8_t> file, SectionSpan &text, SectionSpan &data,
+	std::string *err)
+{
+	if (file.size() < HEADER_SIZE) {
+		return fail(err, "Short SCE header");
+	}
+
+	size_t count = readU32(file.data() + 8);
+	if (count > (file.size() - HEADER_SIZE) / ENTRY_SIZE) {
+		return fail(err, "Section directory extends past the end of the file");
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		const uint8_t *entry = file.data() + HEADER_SIZE + i * ENTRY_SIZE;
+		std::string_view name((const char *)entry, 4);
+		uint32_t flags = readU32(entry + 4);
+		size_t offset = readU32(entry + 8);
+		size_t size = readU32(entry + 12);
+		size_t unpackedSize = readU32(entry + 16);
+		uint32_t align = readU32(entry + 20);
+
+		// Sections we don't know about are skipped,
+		// so that new ones can be added without a new version
+		SectionSpan *section = findSection(name, text, data);
+		if (!section) {
+			continue;
+		}
+
+		if (section->found) {
+			return fail(err, "Duplicate section: '" + std::string(name) + "'");
+		} else if (flags & ~uint32_t(IMAGE_COMPRESSED)) {
+			return fail(err, "Section '" + std::string(name) + "' has unknown flags");
+		} else if (align == 0 || (align & (align - 1)) != 0 || offset % align != 0) {
+			return fail(err, "Section '" + std::string(name) + "' is misaligned");
+		} else if (offset > file.size() || size > file.size() - offset) {
+			return fail(err, "Section '" + std::string(name) + "' extends past the end of the file");
+		} else if (!(flags & IMAGE_COMPRESSED) && unpackedSize != size) {
+			return fail(err, "Section '" + std::string(name) + "' has a bad size");
+		}
+
+		section->offset = offset;
+		section->size = size;
+		section->unpackedSize = unpackedSize;
+		section->flags = flags;
+		section->checksum = readU32(entry + 24);
+		section->hasChecksum = true;
+		section->found = true;
+	}
+
+	return 0;
+}
+
+// Find the TEXT and DATA sections, returns the version
+static int parseImage(
+	std::span<const uint8_t> file, SectionSpan &text, SectionSpan &data,
+	std::string *err)
+{
+	if (file.size() < 4 || memcmp(file.data(), "\033SCE", 4) != 0) {
+		return fail(err, "Missing SCE magic");
+	}
+
+	if (file.size() >= 8 && readU32(file.data() + 4) == 2) {
+		return parseV2(file, text, data, err) < 0 ? -1 : 2;
+	}
+
+	return parseV1(file, text, data, err) < 0 ? -1 : 1;
+}
+
+// Check and unpack a section if necessary. Returns the bytes
+// the section should be served from.
+static int loadSection(
+	std::string_view name, uint8_t *base, const SectionSpan &section,
+	std::vector<uint8_t> &unpacked, std::span<uint8_t> &out,
+	bool verify, std::string *err)
+{
+	std::span<uint8_t> stored(base + section.offset, section.size);
+	if (verify && section.hasChecksum && crc32(stored) != section.checksum) {
+		return fail(err, "Section '" + std::string(name) + "' has a bad checksum");
+	}
+
+	if (!(section.flags & IMAGE_COMPRESSED)) {
+		out = stored;
+		return 0;
+	}
+
+	if (decompress(stored, unpacked, section.unpackedSize, err) < 0) {
+		return -1;
+	}
+
+	out = unpacked;
+	return 0;
+}
+
+#ifdef SCISAVM_MMAP
+// Returns 0 if the file was mapped, 1 if it should be read instead,
+// or -1 with 'err' set if it can't be opened at all
+static int mapFile(const char *path, ImageImpl &impl, std::string *err)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return fail(err, std::string("Failed to open ") + path + ": " + strerror(errno));
+	}
+
+	// Empty files and the like can't be mapped
+	struct stat st;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		close(fd);
+		return 1;
+	}
+
+	impl.size = st.st_size;
+	void *ro = mmap(nullptr, impl.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	void *rw = mmap(nullptr, impl.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	impl.ro = ro == MAP_FAILED ? nullptr : (uint8_t *)ro;
+	impl.rw = rw == MAP_FAILED ? nullptr : (uint8_t *)rw;
+	return impl.ro && impl.rw ? 0 : 1;
+}
+#endif
+
+static bool readFile(const char *path, ImageImpl &impl, std::string *err)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		fail(err, std::string("Failed to open ") + path + ": " + strerror(errno));
+		return false;
+	}
+
+	uint8_t buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+		impl.copy.insert(impl.copy.end(), buf, buf + n);
+	}
+
+	bool ok = !ferror(f);
+	fclose(f);
+	if (!ok) {
+		fail(err, std::string("Failed to read ") + path);
+	}
+	return ok;
+}
+
+int loadImage(const char *path, Image &img, std::string *err, bool verify)
+{
+	img.impl = std::make_unique<ImageImpl>();
+	ImageImpl &impl = *img.impl;
+	img.version = 0;
+	img.text = {};
+	img.data = {};
+
+	uint8_t *ro;
+	uint8_t *rw;
+	size_t size;
+
+#ifdef SCISAVM_MMAP
+	int ret = mapFile(path, impl, err);
+	if (ret < 0) {
+		return -1;
+	}
+	bool mapped = ret == 0;
+#else
+	bool mapped = false;
+#endif
+
+	if (mapped) {
+		ro = impl.ro;
+		rw = impl.rw;
+		size = impl.size;
+	} else {
+		if (!readFile(path, impl, err)) {
+			return -1;
+		}
+
+		ro = rw = impl.copy.data();
+		size = impl.copy.size();
+	}
+
+	SectionSpan text;
+	SectionSpan data;
+	int version = parseImage({ ro, size }, text, data, err);
+	if (version < 0) {
+		img.impl.reset();
+		return -1;
+	}
+
+	std::span<uint8_t> textSpan;
+	std::span<uint8_t> dataSpan;
+	if (
+		loadSection("TEXT", ro, text, impl.text, textSpan, verify, err) < 0 ||
+		loadSection("DATA", rw, data, impl.data, dataSpan, verify, err) < 0
+	) {
+		img.impl.reset();
+		return -1;
+	}
+
+	img.version = version;
+	img.text = textSpan;
+	img.data = dataSpan;
+	return 0;
+}
+
+std::vector<uint8_t> encodeImage(std::span<const ImageSection> sections)
+{
+	std::vector<uint8_t> out(HEADER_SIZE + sections.size() * ENTRY_SIZE);
+	memcpy(out.data(), "\033SCE", 4);
+	writeU32(out, 4, 2);
+	writeU32(out, 8, sections.size());
+	writeU32(out, 12, 0);
+
+	for (size_t i = 0; i < sections.size(); ++i) {
+		const ImageSection &sec = sections[i];
+		std::span<const uint8_t> content = sec.content;
+		uint32_t flags = sec.flags & ~uint32_t(IMAGE_COMPRESSED);
+
+		std::vector<uint8_t> packed;
+		if (sec.flags & IMAGE_COMPRESSED) {
+			packed = compress(content);
+			if (packed.size() < content.size()) {
+				content = packed;
+				flags |= IMAGE_COMPRESSED;
+			}
+		}
+
+		// Compressed sections are unpacked into memory anyway,
+		// so there's no point in padding them
+		uint32_t align = flags & IMAGE_COMPRESSED ? 1 : PAGE_ALIGN;
+		size_t offset = (out.size() + align - 1) / align * align;
+
+		size_t entry = HEADER_SIZE + i * ENTRY_SIZE;
+		char name[4] = {};
+		memcpy(name, sec.name.data(), std::min<size_t>(sec.name.size(), 4));
+		memcpy(out.data() + entry, name, 4);
+		writeU32(out, entry + 4, flags);
+		writeU32(out, entry + 8, offset);
+		writeU32(out, entry + 12, content.size());
+		writeU32(out, entry + 16, sec.content.size());
+		writeU32(out, entry + 20, align);
+		writeU32(out, entry + 24, crc32(content));
+		writeU32(out, entry + 28, 0);
+
+		out.resize(offset);
+		out.insert(out.end(), content.begin(), content.end());
+	}
+
+	return out;
+}
+
+}
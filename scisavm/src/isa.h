@@ -0,0 +1,103 @@
+#ifndef SCISAVM_ISA_H
+#define SCISAVM_ISA_H
+
+#include <cstdint>
+
+namespace scisavm {
+
+enum class Op {
+	SPECIAL = 0b00000,
+	ADD = 0b00001,
+	SUB = 0b00010,
+	ADC = 0b00011,
+	XOR = 0b00100,
+	AND = 0b00101,
+	OR  = 0b00110,
+	CMP = 0b00111,
+	MVX = 0b01000,
+	MVY = 0b01001,
+	MVA = 0b01010,
+	MHA = 0b01011,
+	SPS = 0b01100,
+	LDX = 0b01101,
+	LDW = 0b01110,
+	LDA = 0b01111,
+	STX = 0b10000,
+	STW = 0b10001,
+	STA = 0b10010,
+	JMP = 0b10011,
+	JLR = 0b10100,
+	B   = 0b10101,
+	BCC = 0b10110,
+	BCS = 0b10111,
+	BEQ = 0b11000,
+	BNE = 0b11001,
+	BMI = 0b11010,
+	BPL = 0b11011,
+	BVS = 0b11100,
+	BVC = 0b11101,
+	PUSH = 0b11110,
+	POP = 0b11111,
+};
+
+enum class SpecOp {
+	NOP = 0b000,
+	LSR = 0b001,
+	ROR = 0b010,
+	INC = 0b011,
+	LSP = 0b100,
+	SSP = 0b101,
+	LSW = 0b110,
+	SSW = 0b111,
+};
+
+// Every instruction decodes to one of these.
+// Normal instructions use their op code,
+// special instructions are numbered after the normal ones.
+// Op code 0 is SPECIAL, which is never a handler on its own,
+// so handler 0 is used for a 2-byte instruction at the very end of pmem.
+#define FOR_EACH_HANDLER(X) \
+	X(TRUNCATED) \
+	X(ADD) X(SUB) X(ADC) X(XOR) X(AND) X(OR) X(CMP) \
+	X(MVX) X(MVY) X(MVA) X(MHA) X(SPS) \
+	X(LDX) X(LDW) X(LDA) X(STX) X(STW) X(STA) \
+	X(JMP) X(JLR) X(B) \
+	X(BCC) X(BCS) X(BEQ) X(BNE) X(BMI) X(BPL) X(BVS) X(BVC) \
+	X(PUSH) X(POP) \
+	X(NOP) X(LSR) X(ROR) X(INC) X(LSP) X(SSP) X(LSW) X(SSW)
+
+enum class Handler: uint8_t {
+#define X(name) name,
+	FOR_EACH_HANDLER(X)
+#undef X
+};
+static_assert(uint8_t(Handler::ADD) == uint8_t(Op::ADD));
+static_assert(uint8_t(Handler::POP) == uint8_t(Op::POP));
+static_assert(uint8_t(Handler::SSW) == uint8_t(Handler::NOP) + uint8_t(SpecOp::SSW));
+
+inline Handler handlerFor(uint8_t instr)
+{
+	auto op = Op(instr >> 3);
+	if (op == Op::SPECIAL) {
+		return Handler(uint8_t(Handler::NOP) + (instr & 0x07));
+	}
+
+	return Handler(op);
+}
+
+// Whether the handler is a jump or branch
+inline bool isTerminator(Handler h)
+{
+	switch (h) {
+	case Handler::JMP: case Handler::JLR: case Handler::B:
+	case Handler::BCC: case Handler::BCS: case Handler::BEQ: case Handler::BNE:
+	case Handler::BMI: case Handler::BPL: case Handler::BVS: case Handler::BVC:
+		return true;
+	default:
+		return false;
+	}
+}
+
+}
+
+#endif
@@ -0,0 +1,1216 @@
+#include "jit.h"
+
+#ifdef SCISAVM_JIT
+
+#include "isa.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace scisavm {
+
+namespace {
+
+enum Reg: uint8_t {
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11,
+};
+
+// Guest registers live in these host registers for the duration of a block.
+// Everything used is caller-saved, so blocks don't need to save anything.
+// R8 holds the param or address, R9-R11 are scratch.
+constexpr Reg ACC = RAX;
+constexpr Reg X = RCX;
+constexpr Reg Y = RDX;
+constexpr Reg SP = RSI;
+constexpr Reg STATE = RDI;
+
+enum Cond: uint8_t {
+	CC_E = 0x4,
+	CC_NE = 0x5,
+	CC_A = 0x7,
+};
+
+enum Alu: uint8_t {
+	ALU_ADD = 0,
+	ALU_OR = 1,
+	ALU_AND = 4,
+	ALU_SUB = 5,
+	ALU_XOR = 6,
+	ALU_CMP = 7,
+};
+
+// Just enough of an x86-64 assembler for the code we generate.
+// Memory operands always use a 32-bit displacement to keep things simple.
+class Emitter {
+public:
+	std::vector<uint8_t> buf;
+
+	void byte(uint8_t b) { buf.push_back(b); }
+
+	void u32(uint32_t v)
+	{
+		for (int i = 0; i < 4; ++i) {
+			byte(v >> (i * 8));
+		}
+	}
+
+	void rex(bool w, int reg, int index, int base, bool force = false)
+	{
+		uint8_t r = 0x40 | (w << 3) |
+			((reg & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3);
+		if (r != 0x40 || force) {
+			byte(r);
+		}
+	}
+
+	void modrmReg(int reg, int rm)
+	{
+		byte(0xc0 | ((reg & 7) << 3) | (rm & 7));
+	}
+
+	// [base + disp32]
+	void modrmMem(int reg, Reg base, int32_t disp)
+	{
+		byte(0x80 | ((reg & 7) << 3) | (base & 7));
+		if ((base & 7) == RSP) {
+			byte(0x24);
+		}
+		u32(disp);
+	}
+
+	// [base + index + disp32]
+	void modrmSib(int reg, Reg base, Reg index, int32_t disp)
+	{
+		byte(0x80 | ((reg & 7) << 3) | 0b100);
+		byte(((index & 7) << 3) | (base & 7));
+		u32(disp);
+	}
+
+	void movRR(Reg dst, Reg src)
+	{
+		rex(false, src, 0, dst);
+		byte(0x89);
+		modrmReg(src, dst);
+	}
+
+	void movRI(Reg dst, uint32_t imm)
+	{
+		rex(false, 0, 0, dst);
+		byte(0xb8 + (dst & 7));
+		u32(imm);
+	}
+
+	void load32(Reg dst, Reg base, int32_t disp)
+	{
+		rex(false, dst, 0, base);
+		byte(0x8b);
+		modrmMem(dst, base, disp);
+	}
+
+	void load64(Reg dst, Reg base, int32_t disp)
+	{
+		rex(true, dst, 0, base);
+		byte(0x8b);
+		modrmMem(dst, base, disp);
+	}
+
+	void store32(Reg base, int32_t disp, Reg src)
+	{
+		rex(false, src, 0, base);
+		byte(0x89);
+		modrmMem(src, base, disp);
+	}
+
+	void store32I(Reg base, int32_t disp, uint32_t imm)
+	{
+		rex(false, 0, 0, base);
+		byte(0xc7);
+		modrmMem(0, base, disp);
+		u32(imm);
+	}
+
+	void aluRR(Alu op, Reg dst, Reg src)
+	{
+		rex(false, src, 0, dst);
+		byte(op * 8 + 1);
+		modrmReg(src, dst);
+	}
+
+	void aluRI(Alu op, Reg dst, uint32_t imm)
+	{
+		rex(false, 0, 0, dst);
+		byte(0x81);
+		modrmReg(op, dst);
+		u32(imm);
+	}
+
+	void aluRM(Alu op, Reg dst, Reg base, int32_t disp)
+	{
+		rex(false, dst, 0, base);
+		byte(op * 8 + 3);
+		modrmMem(dst, base, disp);
+	}
+
+	void aluMI(Alu op, Reg base, int32_t disp, uint32_t imm)
+	{
+		rex(false, 0, 0, base);
+		byte(0x81);
+		modrmMem(op, base, disp);
+		u32(imm);
+	}
+
+	void add64RM(Reg dst, Reg base, int32_t disp)
+	{
+		rex(true, dst, 0, base);
+		byte(0x03);
+		modrmMem(dst, base, disp);
+	}
+
+	void imul64RRI(Reg dst, Reg src, int32_t imm)
+	{
+		rex(true, dst, 0, src);
+		byte(0x69);
+		modrmReg(dst, src);
+		u32(imm);
+	}
+
+	void shlRI(Reg r, uint8_t n)
+	{
+		rex(false, 0, 0, r);
+		byte(0xc1);
+		modrmReg(4, r);
+		byte(n);
+	}
+
+	void shrRI(Reg r, uint8_t n)
+	{
+		rex(false, 0, 0, r);
+		byte(0xc1);
+		modrmReg(5, r);
+		byte(n);
+	}
+
+	void testRR(Reg a, Reg b)
+	{
+		rex(false, b, 0, a);
+		byte(0x85);
+		modrmReg(b, a);
+	}
+
+	void testRI(Reg r, uint32_t imm)
+	{
+		rex(false, 0, 0, r);
+		byte(0xf7);
+		modrmReg(0, r);
+		u32(imm);
+	}
+
+	void cmov(Cond cc, Reg dst, Reg src)
+	{
+		rex(false, dst, 0, src);
+		byte(0x0f);
+		byte(0x40 + cc);
+		modrmReg(dst, src);
+	}
+
+	void cmpByteMI(Reg base, int32_t disp, uint8_t imm)
+	{
+		rex(false, 0, 0, base);
+		byte(0x80);
+		modrmMem(7, base, disp);
+		byte(imm);
+	}
+
+	void loadByte(Reg dst, Reg base, Reg index)
+	{
+		rex(false, dst, index, base);
+		byte(0x0f);
+		byte(0xb6);
+		modrmSib(dst, base, index, 0);
+	}
+
+	void loadWord(Reg dst, Reg base, Reg index)
+	{
+		rex(false, dst, index, base);
+		byte(0x0f);
+		byte(0xb7);
+		modrmSib(dst, base, index, 0);
+	}
+
+	void storeByte(Reg base, Reg index, Reg src)
+	{
+		// Without a REX prefix, 4-7 would be AH, CH, DH and BH
+		rex(false, src, index, base, src >= RSP && src <= RDI);
+		byte(0x88);
+		modrmSib(src, base, index, 0);
+	}
+
+	void storeWord(Reg base, Reg index, Reg src)
+	{
+		byte(0x66);
+		rex(false, src, index, base);
+		byte(0x89);
+		modrmSib(src, base, index, 0);
+	}
+
+	// Jumps return the location of their rel32, for patch()
+	size_t jcc(Cond cc)
+	{
+		byte(0x0f);
+		byte(0x80 + cc);
+		u32(0);
+		return buf.size() - 4;
+	}
+
+	size_t jmp()
+	{
+		byte(0xe9);
+		u32(0);
+		return buf.size() - 4;
+	}
+
+	void patch(size_t at, size_t target)
+	{
+		uint32_t rel = uint32_t(target - (at + 4));
+		memcpy(&buf[at], &rel, 4);
+	}
+
+	void ret() { byte(0xc3); }
+};
+
+#define STATE_OFFSET(field) int32_t(offsetof(JitState, field))
+
+// A param is either known at compile time, or ends up in a register
+struct Operand {
+	bool isImm;
+	uint32_t imm;
+	Reg reg;
+};
+
+Operand imm(uint32_t val) { return { true, val, RAX }; }
+Operand reg(Reg r) { return { false, 0, r }; }
+
+struct Instr {
+	Handler handler;
+	uint8_t paramMode;
+	uint8_t second;
+	uint32_t pc;
+	uint32_t next;
+
+	// Whether anything can observe the flags this instruction sets
+	bool flagsLive;
+};
+
+bool isMemory(Handler h)
+{
+	switch (h) {
+	case Handler::LDX: case Handler::LDW: case Handler::LDA:
+	case Handler::STX: case Handler::STW: case Handler::STA:
+	case Handler::LSP: case Handler::SSP: case Handler::LSW: case Handler::SSW:
+	case Handler::PUSH: case Handler::POP:
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool writesFlags(Handler h)
+{
+	switch (h) {
+	case Handler::ADD: case Handler::SUB: case Handler::ADC: case Handler::XOR:
+	case Handler::AND: case Handler::OR: case Handler::CMP:
+	case Handler::LSR: case Handler::ROR: case Handler::INC:
+	case Handler::LDX: case Handler::LDW: case Handler::LDA:
+	case Handler::LSP: case Handler::LSW:
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool readsFlags(Handler h)
+{
+	switch (h) {
+	case Handler::ADC: case Handler::ROR:
+	case Handler::BCC: case Handler::BCS: case Handler::BEQ: case Handler::BNE:
+	case Handler::BMI: case Handler::BPL: case Handler::BVS: case Handler::BVC:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Whether we know how to compile the instruction at all.
+// Anything else is left to the interpreter, which also takes care
+// of raising the appropriate error.
+bool isCompilable(Handler h, uint8_t paramMode, int bits)
+{
+	switch (h) {
+	case Handler::TRUNCATED:
+		return false;
+	case Handler::MHA:
+		return bits > 8;
+	case Handler::POP:
+		return paramMode <= 0b011;
+	default:
+		return true;
+	}
+}
+
+class Compiler {
+public:
+	Compiler(int bits):
+		bits_(bits), mask_((1u << bits) - 1) {}
+
+	void compile(std::span<const Instr> instrs)
+	{
+		e.load32(ACC, STATE, STATE_OFFSET(acc));
+		e.load32(X, STATE, STATE_OFFSET(x));
+		e.load32(Y, STATE, STATE_OFFSET(y));
+		e.load32(SP, STATE, STATE_OFFSET(sp));
+
+		for (size_t i = 0; i < instrs.size(); ++i) {
+			index_ = i;
+			emit(instrs[i]);
+		}
+
+		// If we get here, the block didn't end with a jump or branch
+		const Instr &last = instrs.back();
+		if (!isTerminator(last.handler)) {
+			e.store32I(STATE, STATE_OFFSET(pc), last.next);
+		}
+		e.movRI(R11, instrs.size());
+		std::vector<size_t> toEpilogue = { e.jmp() };
+
+		// Side exits leave the instruction which couldn't be handled
+		// for the interpreter, and report only the instructions before it
+		for (auto &exit: exits_) {
+			size_t stub = e.buf.size();
+			for (size_t at: exit.fixups) {
+				e.patch(at, stub);
+			}
+
+			e.store32I(STATE, STATE_OFFSET(pc), instrs[exit.index].pc);
+			e.movRI(R11, exit.index);
+			toEpilogue.push_back(e.jmp());
+		}
+
+		size_t epilogue = e.buf.size();
+		for (size_t at: toEpilogue) {
+			e.patch(at, epilogue);
+		}
+
+		e.store32(STATE, STATE_OFFSET(acc), ACC);
+		e.store32(STATE, STATE_OFFSET(x), X);
+		e.store32(STATE, STATE_OFFSET(y), Y);
+		e.store32(STATE, STATE_OFFSET(sp), SP);
+		e.movRR(RAX, R11);
+		e.ret();
+	}
+
+	Emitter e;
+
+private:
+	struct Exit {
+		size_t index;
+		std::vector<size_t> fixups;
+	};
+
+	void sideExit(size_t fixup)
+	{
+		if (exits_.empty() || exits_.back().index != index_) {
+			exits_.push_back({ index_, {} });
+		}
+		exits_.back().fixups.push_back(fixup);
+	}
+
+	// Put the param in 'scratch' unless it's known at compile time.
+	// Register params are always copied,
+	// so they survive the instruction modifying the register.
+	Operand param(const Instr &in, Reg scratch = R8)
+	{
+		switch (in.paramMode) {
+		case 0b000:
+			return imm(0);
+		case 0b100:
+			return imm(in.second);
+		}
+
+		static const Reg regs[] = { X, Y, ACC };
+		e.movRR(scratch, regs[(in.paramMode & 0b011) - 1]);
+		if (in.paramMode & 0b100) {
+			e.aluRI(ALU_ADD, scratch, in.second);
+			e.aluRI(ALU_AND, scratch, mask_);
+		}
+		return reg(scratch);
+	}
+
+	void toReg(Reg dst, Operand op)
+	{
+		if (op.isImm) {
+			e.movRI(dst, op.imm);
+		} else if (op.reg != dst) {
+			e.movRR(dst, op.reg);
+		}
+	}
+
+	void alu(Alu alu, Reg dst, Operand op)
+	{
+		if (op.isImm) {
+			e.aluRI(alu, dst, op.imm);
+		} else {
+			e.aluRR(alu, dst, op.reg);
+		}
+	}
+
+	void storeState(int32_t offset, Operand op)
+	{
+		if (op.isImm) {
+			e.store32I(STATE, offset, op.imm);
+		} else {
+			e.store32(STATE, offset, op.reg);
+		}
+	}
+
+	void setFlags(Operand out, Operand a, Operand b, Operand c, FlagsOp op)
+	{
+		storeState(STATE_OFFSET(flagsOut), out);
+		storeState(STATE_OFFSET(flagsA), a);
+		storeState(STATE_OFFSET(flagsB), b);
+		storeState(STATE_OFFSET(flagsC), c);
+		storeState(STATE_OFFSET(flagsOp), imm(uint32_t(op)));
+	}
+
+	// Evaluate the carry flag into R11, using R10 as scratch
+	void evalCarry()
+	{
+		e.load32(R11, STATE, STATE_OFFSET(flagsA));
+		e.aluRM(ALU_ADD, R11, STATE, STATE_OFFSET(flagsB));
+		e.aluRM(ALU_ADD, R11, STATE, STATE_OFFSET(flagsC));
+		e.shrRI(R11, bits_);
+		e.aluRI(ALU_AND, R11, 1);
+		e.load32(R10, STATE, STATE_OFFSET(flagsC));
+		e.aluRI(ALU_AND, R10, 1);
+		e.aluMI(ALU_CMP, STATE, STATE_OFFSET(flagsOp), uint32_t(FlagsOp::ADD));
+		e.cmov(CC_NE, R11, R10);
+	}
+
+	// Evaluate the overflow flag into R11, using R10 as scratch
+	void evalOverflow()
+	{
+		e.load32(R11, STATE, STATE_OFFSET(flagsA));
+		e.aluRM(ALU_XOR, R11, STATE, STATE_OFFSET(flagsOut));
+		e.load32(R10, STATE, STATE_OFFSET(flagsB));
+		e.aluRM(ALU_XOR, R10, STATE, STATE_OFFSET(flagsOut));
+		e.aluRR(ALU_AND, R11, R10);
+		e.shrRI(R11, bits_ - 1);
+		e.aluRI(ALU_AND, R11, 1);
+		e.movRI(R10, 0);
+		e.aluMI(ALU_CMP, STATE, STATE_OFFSET(flagsOp), uint32_t(FlagsOp::ADD));
+		e.cmov(CC_NE, R11, R10);
+	}
+
+	// Turn the guest address in R8 into a host address at R9 + R10,
+	// leaving the instruction to the interpreter
+	// if the address isn't in a plain memory page
+	void translate(bool word)
+	{
+		int pageBits = bits_ - 8;
+		uint32_t pageMask = (1u << pageBits) - 1;
+
+		e.movRR(R9, R8);
+		if (pageBits > 0) {
+			e.shrRI(R9, pageBits);
+		}
+		e.imul64RRI(R9, R9, sizeof(Page));
+		e.add64RM(R9, STATE, STATE_OFFSET(pages));
+		e.cmpByteMI(R9, offsetof(Page, kind), uint8_t(PageKind::MEM));
+		sideExit(e.jcc(CC_NE));
+		e.load64(R9, R9, offsetof(Page, mem));
+
+		e.movRR(R10, R8);
+		e.aluRI(ALU_AND, R10, pageMask);
+		if (word && bits_ > 8) {
+			e.aluRI(ALU_CMP, R10, pageMask - 1);
+			sideExit(e.jcc(CC_A));
+		}
+	}
+
+	void spAddress(const Instr &in)
+	{
+		e.movRR(R8, SP);
+		e.aluRI(ALU_SUB, R8, in.second);
+		e.aluRI(ALU_AND, R8, mask_);
+	}
+
+	void load(Reg dst, bool word)
+	{
+		translate(word);
+		if (word && bits_ > 8) {
+			e.loadWord(dst, R9, R10);
+		} else {
+			e.loadByte(dst, R9, R10);
+		}
+	}
+
+	void store(Reg src, bool word)
+	{
+		translate(word);
+		if (word && bits_ > 8) {
+			e.storeWord(R9, R10, src);
+		} else {
+			e.storeByte(R9, R10, src);
+		}
+	}
+
+	Operand notParam(Operand p, Reg scratch)
+	{
+		if (p.isImm) {
+			return imm(~p.imm & mask_);
+		}
+
+		e.movRR(scratch, p.reg);
+		e.aluRI(ALU_XOR, scratch, mask_);
+		return reg(scratch);
+	}
+
+	// Pick between the targets set up by branchTargets()
+	void branch(Cond taken, bool flagInR11)
+	{
+		if (flagInR11) {
+			e.testRR(R11, R11);
+		}
+		e.cmov(taken, R9, R8);
+		e.store32(STATE, STATE_OFFSET(pc), R9);
+	}
+
+	// Put the branch target in R8 and the fallthrough address in R9
+	void branchTargets(const Instr &in)
+	{
+		toReg(R8, param(in));
+		e.aluRI(ALU_ADD, R8, in.pc);
+		e.aluRI(ALU_AND, R8, mask_);
+		e.movRI(R9, in.next);
+	}
+
+	void emit(const Instr &in)
+	{
+		Operand p = imm(0);
+		switch (in.handler) {
+		case Handler::TRUNCATED:
+			// Never compiled
+			break;
+
+		case Handler::NOP:
+			break;
+
+		case Handler::ADD:
+		case Handler::SUB:
+		case Handler::INC:
+			p = in.handler == Handler::INC ? imm(1) : param(in);
+			if (in.flagsLive) {
+				e.movRR(R9, ACC);
+			}
+			alu(in.handler == Handler::SUB ? ALU_SUB : ALU_ADD, ACC, p);
+			e.aluRI(ALU_AND, ACC, mask_);
+			if (in.flagsLive) {
+				if (in.handler == Handler::SUB) {
+					setFlags(reg(ACC), reg(R9), notParam(p, R10), imm(1), FlagsOp::ADD);
+				} else {
+					setFlags(reg(ACC), reg(R9), p, imm(0), FlagsOp::ADD);
+				}
+			}
+			break;
+
+		case Handler::CMP:
+			if (in.flagsLive) {
+				p = param(in);
+				e.movRR(R9, ACC);
+				alu(ALU_SUB, R9, p);
+				e.aluRI(ALU_AND, R9, mask_);
+				setFlags(reg(R9), reg(ACC), notParam(p, R10), imm(1), FlagsOp::ADD);
+			}
+			break;
+
+		case Handler::ADC:
+			evalCarry();
+			p = param(in);
+			if (in.flagsLive) {
+				e.movRR(R9, ACC);
+			}
+			alu(ALU_ADD, ACC, p);
+			e.aluRR(ALU_ADD, ACC, R11);
+			e.aluRI(ALU_AND, ACC, mask_);
+			if (in.flagsLive) {
+				setFlags(reg(ACC), reg(R9), p, reg(R11), FlagsOp::ADD);
+			}
+			break;
+
+		case Handler::XOR:
+		case Handler::AND:
+		case Handler::OR:
+			p = param(in);
+			alu(
+				in.handler == Handler::XOR ? ALU_XOR :
+				in.handler == Handler::AND ? ALU_AND : ALU_OR,
+				ACC, p);
+			if (in.flagsLive) {
+				setFlags(reg(ACC), imm(0), imm(0), imm(0), FlagsOp::Z);
+			}
+			break;
+
+		case Handler::LSR:
+		case Handler::ROR:
+			if (in.handler == Handler::ROR) {
+				evalCarry();
+			}
+			if (in.flagsLive) {
+				e.movRR(R9, ACC);
+				e.aluRI(ALU_AND, R9, 1);
+			}
+			e.shrRI(ACC, 1);
+			if (in.handler == Handler::ROR) {
+				e.shlRI(R11, bits_ - 1);
+				e.aluRR(ALU_OR, ACC, R11);
+			}
+			if (in.flagsLive) {
+				setFlags(reg(ACC), imm(0), imm(0), reg(R9), FlagsOp::Z);
+			}
+			break;
+
+		case Handler::MVX:
+			toReg(X, param(in));
+			break;
+
+		case Handler::MVY:
+			toReg(Y, param(in));
+			break;
+
+		case Handler::MVA:
+			toReg(ACC, param(in));
+			break;
+
+		case Handler::MHA:
+			toReg(ACC, param(in));
+			e.shlRI(ACC, 8);
+			e.aluRI(ALU_AND, ACC, mask_);
+			break;
+
+		case Handler::SPS:
+			toReg(SP, param(in));
+			break;
+
+		case Handler::LDX:
+		case Handler::LDA:
+		case Handler::LDW:
+		case Handler::LSP:
+		case Handler::LSW: {
+			bool word = in.handler == Handler::LDW || in.handler == Handler::LSW;
+			Reg dst = in.handler == Handler::LDX ? X : ACC;
+			if (in.handler == Handler::LSP || in.handler == Handler::LSW) {
+				spAddress(in);
+			} else {
+				toReg(R8, param(in));
+			}
+
+			load(dst, word);
+			if (in.flagsLive) {
+				// The interpreter takes LDW's flags from Y, so we do too
+				Reg out = in.handler == Handler::LDW ? Y : dst;
+				setFlags(reg(out), imm(0), imm(0), imm(0), FlagsOp::Z);
+			}
+			break;
+		}
+
+		case Handler::STX:
+		case Handler::STA:
+		case Handler::STW:
+			toReg(R8, param(in));
+			store(in.handler == Handler::STX ? X : ACC, in.handler == Handler::STW);
+			break;
+
+		case Handler::SSP:
+		case Handler::SSW:
+			spAddress(in);
+			store(ACC, in.handler == Handler::SSW);
+			break;
+
+		case Handler::PUSH:
+			toReg(R11, param(in, R11));
+			e.movRR(R8, SP);
+			store(R11, true);
+			e.aluRI(ALU_ADD, SP, bits_ / 8);
+			e.aluRI(ALU_AND, SP, mask_);
+			break;
+
+		case Handler::POP: {
+			e.movRR(R8, SP);
+			e.aluRI(ALU_SUB, R8, bits_ / 8);
+			e.aluRI(ALU_AND, R8, mask_);
+			load(R11, true);
+			e.movRR(SP, R8);
+
+			static const Reg regs[] = { X, Y, ACC };
+			if (in.paramMode != 0b000) {
+				e.movRR(regs[in.paramMode - 1], R11);
+			}
+			break;
+		}
+
+		case Handler::JMP:
+			toReg(R8, param(in));
+			e.store32(STATE, STATE_OFFSET(pc), R8);
+			break;
+
+		case Handler::JLR:
+			toReg(R8, param(in));
+			e.movRI(Y, in.next);
+			e.store32(STATE, STATE_OFFSET(pc), R8);
+			break;
+
+		case Handler::B:
+			branchTargets(in);
+			e.store32(STATE, STATE_OFFSET(pc), R8);
+			break;
+
+		case Handler::BEQ:
+		case Handler::BNE:
+			branchTargets(in);
+			e.load32(R10, STATE, STATE_OFFSET(flagsOut));
+			e.testRR(R10, R10);
+			branch(in.handler == Handler::BEQ ? CC_E : CC_NE, false);
+			break;
+
+		case Handler::BMI:
+		case Handler::BPL:
+			branchTargets(in);
+			e.load32(R10, STATE, STATE_OFFSET(flagsOut));
+			e.testRI(R10, 1u << (bits_ - 1));
+			branch(in.handler == Handler::BMI ? CC_NE : CC_E, false);
+			break;
+
+		case Handler::BCC:
+		case Handler::BCS:
+			branchTargets(in);
+			evalCarry();
+			branch(in.handler == Handler::BCS ? CC_NE : CC_E, true);
+			break;
+
+		case Handler::BVS:
+		case Handler::BVC:
+			branchTargets(in);
+			evalOverflow();
+			branch(in.handler == Handler::BVS ? CC_NE : CC_E, true);
+			break;
+		}
+	}
+
+	int bits_;
+	uint32_t mask_;
+	size_t index_ = 0;
+	std::vector<Exit> exits_;
+};
+
+// Blocks are cut off at this many instructions,
+// to keep the step budget reasonably fine grained
+constexpr size_t MAX_BLOCK = 64;
+
+constexpr size_t CODE_SIZE = 4 * 1024 * 1024;
+
+// Saved code starts with this header, followed by a copy of the program,
+// a CacheBlock for every address, and then the code itself
+// on a page boundary, so that the whole file can be mapped executable.
+struct CacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t bits;
+	uint64_t textSize;
+	uint64_t codeOffset;
+	uint64_t codeSize;
+};
+
+struct CacheBlock {
+	// Where the block's code is, relative to the start of the code
+	uint32_t offset;
+
+	// The number of instructions, 0 if the block has no code,
+	// or -1 if it was never compiled
+	int32_t count;
+};
+
+constexpr char CACHE_MAGIC[8] = { 'S', 'C', 'I', 'S', 'A', 'J', 'I', 'T' };
+constexpr size_t CACHE_ALIGN = 4096;
+
+size_t alignUp(size_t n, size_t align)
+{
+	return (n + align - 1) / align * align;
+}
+
+int fail(std::string *err, std::string msg)
+{
+	if (err) {
+		*err = std::move(msg);
+	}
+	return -1;
+}
+
+bool writeAll(int fd, const void *data, size_t size)
+{
+	const uint8_t *ptr = (const uint8_t *)data;
+	while (size > 0) {
+		ssize_t n = write(fd, ptr, size);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			return false;
+		}
+		ptr += n;
+		size -= n;
+	}
+
+	return true;
+}
+
+}
+
+JitCache::JitCache(std::span<const uint8_t> pmem, int bits):
+	src(pmem.data()), size(pmem.size()), bits(bits), blocks(pmem.size())
+{
+	void *mem = mmap(
+		nullptr, CODE_SIZE, PROT_READ | PROT_EXEC,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem != MAP_FAILED) {
+		code = (uint8_t *)mem;
+		codeSize = CODE_SIZE;
+	}
+}
+
+JitCache::~JitCache()
+{
+	if (code) {
+		munmap(code, codeSize);
+	}
+	if (file) {
+		munmap(file, fileSize);
+	}
+}
+
+void JitCache::compile(size_t pc)
+{
+	blocks[pc].compiled = true;
+	dirty = true;
+	if (!code) {
+		return;
+	}
+
+	// Decode the block
+	uint32_t mask = (1u << bits) - 1;
+	std::vector<Instr> instrs;
+	size_t addr = pc;
+	while (instrs.size() < MAX_BLOCK && addr < size) {
+		uint8_t instr = src[addr];
+		Instr in = {
+			.handler = handlerFor(instr),
+			.paramMode = uint8_t(instr & 0x07),
+			.second = 0,
+			.pc = uint32_t(addr),
+			.next = 0,
+			.flagsLive = false,
+		};
+
+		size_t length = 1;
+		if (instr & 0b00000'100) {
+			if (addr + 1 >= size) {
+				break;
+			}
+			in.second = src[addr + 1];
+			length = 2;
+		}
+
+		if (!isCompilable(in.handler, in.paramMode, bits)) {
+			break;
+		}
+
+		in.next = (addr + length) & mask;
+		instrs.push_back(in);
+		if (isTerminator(in.handler) || in.next != addr + length) {
+			break;
+		}
+		addr = in.next;
+	}
+
+	if (instrs.empty()) {
+		return;
+	}
+
+	// Flags only need to be stored if something can observe them
+	// before the next instruction which overwrites them.
+	// Branches and flag-reading instructions observe them,
+	// and so does the interpreter, after any exit from the block.
+	bool live = true;
+	for (size_t i = instrs.size(); i-- > 0;) {
+		Instr &in = instrs[i];
+		if (writesFlags(in.handler)) {
+			in.flagsLive = live;
+			live = false;
+		}
+
+		if (readsFlags(in.handler) || isMemory(in.handler)) {
+			live = true;
+		}
+	}
+
+	Compiler c(bits);
+	c.compile(instrs);
+
+	// When the code buffer fills up, just throw everything away
+	// and start over
+	if (codeUsed + c.e.buf.size() > codeSize) {
+		for (auto &b: blocks) {
+			b = {};
+		}
+		blocks[pc].compiled = true;
+		codeUsed = 0;
+	}
+
+	if (mprotect(code, codeSize, PROT_READ | PROT_WRITE) < 0) {
+		return;
+	}
+
+	uint8_t *fn = code + codeUsed;
+	memcpy(fn, c.e.buf.data(), c.e.buf.size());
+	codeUsed += c.e.buf.size();
+	codeUsed = (codeUsed + 15) & ~size_t(15);
+
+	if (mprotect(code, codeSize, PROT_READ | PROT_EXEC) < 0) {
+		return;
+	}
+
+	blocks[pc].fn = (JitFn)fn;
+	blocks[pc].count = instrs.size();
+}
+
+int JitCache::load(const std::string &path, std::string *err)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return errno == ENOENT ? 1 : fail(err, path + ": " + strerror(errno));
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || size_t(st.st_size) < sizeof(CacheHeader)) {
+		close(fd);
+		return 1;
+	}
+
+	size_t mapSize = st.st_size;
+	void *mem = mmap(nullptr, mapSize, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) {
+		return fail(err, path + ": " + strerror(errno));
+	}
+
+	// Anything which doesn't look exactly right is ignored,
+	// and will be overwritten by the next save()
+	const uint8_t *base = (const uint8_t *)mem;
+	CacheHeader hdr;
+	memcpy(&hdr, base, sizeof(hdr));
+	size_t tableOffset = alignUp(sizeof(hdr) + size, alignof(CacheBlock));
+	size_t tableEnd = tableOffset + size * sizeof(CacheBlock);
+	if (
+		memcmp(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic)) != 0 ||
+		hdr.version != JIT_VERSION || hdr.bits != uint32_t(bits) ||
+		hdr.textSize != size || tableEnd > mapSize ||
+		hdr.codeOffset < tableEnd || hdr.codeOffset % CACHE_ALIGN != 0 ||
+		hdr.codeOffset > mapSize || hdr.codeSize > mapSize - hdr.codeOffset ||
+		memcmp(base + sizeof(hdr), src, size) != 0
+	) {
+		munmap(mem, mapSize);
+		return 1;
+	}
+
+	const CacheBlock *table = (const CacheBlock *)(base + tableOffset);
+	for (size_t pc = 0; pc < size; ++pc) {
+		if (table[pc].count > 0 && table[pc].offset >= hdr.codeSize) {
+			munmap(mem, mapSize);
+			return 1;
+		}
+	}
+
+	// Blocks from a file loaded before are about to be unmapped,
+	// so they have to come from the new file or be compiled again
+	if (file) {
+		for (JitBlock &b: blocks) {
+			auto fn = (const uint8_t *)b.fn;
+			if (fn >= fileCode && fn < fileCode + fileCodeSize) {
+				b = JitBlock{};
+			}
+		}
+		munmap(file, fileSize);
+	}
+	file = (uint8_t *)mem;
+	fileSize = mapSize;
+	fileCode = base + hdr.codeOffset;
+	fileCodeSize = hdr.codeSize;
+
+	// Blocks compiled in this run are kept, they might be newer
+	for (size_t pc = 0; pc < size; ++pc) {
+		JitBlock &b = blocks[pc];
+		const CacheBlock &cb = table[pc];
+		if (b.compiled || cb.count < 0) {
+			continue;
+		}
+
+		b.compiled = true;
+		if (cb.count > 0) {
+			b.fn = (JitFn)(fileCode + cb.offset);
+			b.count = cb.count;
+		}
+	}
+
+	dirty = false;
+	return 0;
+}
+
+int JitCache::save(const std::string &path, std::string *err)
+{
+	if (!dirty) {
+		return 0;
+	}
+
+	// The code from the loaded file comes first, then our own
+	CacheHeader hdr;
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = JIT_VERSION;
+	hdr.bits = bits;
+	hdr.textSize = size;
+	size_t tableOffset = alignUp(sizeof(hdr) + size, alignof(CacheBlock));
+	hdr.codeOffset = alignUp(tableOffset + size * sizeof(CacheBlock), CACHE_ALIGN);
+	hdr.codeSize = fileCodeSize + codeUsed;
+
+	std::vector<uint8_t> head(hdr.codeOffset);
+	memcpy(head.data(), &hdr, sizeof(hdr));
+	memcpy(head.data() + sizeof(hdr), src, size);
+
+	CacheBlock *table = (CacheBlock *)(head.data() + tableOffset);
+	for (size_t pc = 0; pc < size; ++pc) {
+		const JitBlock &b = blocks[pc];
+		CacheBlock &cb = table[pc];
+		cb.offset = 0;
+		cb.count = b.compiled ? 0 : -1;
+
+		auto fn = (const uint8_t *)b.fn;
+		if (!fn) {
+			continue;
+		} else if (fn >= fileCode && fn < fileCode + fileCodeSize) {
+			cb.offset = fn - fileCode;
+		} else {
+			cb.offset = fileCodeSize + (fn - code);
+		}
+		cb.count = b.count;
+	}
+
+	// Write to a temporary file first, so that other processes
+	// never see a half written file
+	std::string tmp = path + ".tmp" + std::to_string(getpid());
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return fail(err, tmp + ": " + strerror(errno));
+	}
+
+	bool ok =
+		writeAll(fd, head.data(), head.size()) &&
+		writeAll(fd, fileCode, fileCodeSize) &&
+		writeAll(fd, code, codeUsed);
+	ok = close(fd) == 0 && ok;
+	if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+		int e = errno;
+		unlink(tmp.c_str());
+		return fail(err, path + ": " + strerror(e));
+	}
+
+	dirty = false;
+	return 0;
+}
+
+}
+
+#endif
+
+namespace scisavm {
+
+#ifdef SCISAVM_JIT
+// Saved code is keyed by the program's FNV-1a hash,
+// the bitness and the JIT version
+static std::string cachePath(const char *dir, std::span<const uint8_t> pmem, int bits)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (uint8_t b: pmem) {
+		hash = (hash ^ b) * 0x100000001b3ull;
+	}
+
+	char name[64];
+	snprintf(
+		name, sizeof(name), "/jit%d-%016llx-v%u.bin",
+		bits, (unsigned long long)hash, unsigned(JIT_VERSION));
+	return dir + std::string(name);
+}
+#endif
+
+template<typename T>
+static int loadCompiled(CPU<T> &cpu, const char *dir, std::string *err)
+{
+#ifdef SCISAVM_JIT
+	if (!cpu.jit || !cpu.jit->matches(cpu.pmem)) {
+		cpu.jit = std::make_shared<JitCache>(cpu.pmem, sizeof(T) * 8);
+	}
+	return cpu.jit->load(cachePath(dir, cpu.pmem, sizeof(T) * 8), err);
+#else
+	(void)cpu;
+	(void)dir;
+	(void)err;
+	return 1;
+#endif
+}
+
+template<typename T>
+static int saveCompiled(CPU<T> &cpu, const char *dir, std::string *err)
+{
+#ifdef SCISAVM_JIT
+	if (!cpu.jit || !cpu.jit->matches(cpu.pmem)) {
+		return 0;
+	}
+
+	// Create the directory and any missing parents
+	std::string path = dir;
+	for (size_t i = 1; i <= path.size(); ++i) {
+		if (i == path.size() || path[i] == '/') {
+			std::string parent = path.substr(0, i);
+			if (mkdir(parent.c_str(), 0755) < 0 && errno != EEXIST) {
+				return fail(err, parent + ": " + strerror(errno));
+			}
+		}
+	}
+
+	return cpu.jit->save(cachePath(dir, cpu.pmem, sizeof(T) * 8), err);
+#else
+	(void)cpu;
+	(void)dir;
+	(void)err;
+	return 0;
+#endif
+}
+
+int loadCompiled8(CPU8 &cpu, const char *dir, std::string *err) { return loadCompiled(cpu, dir, err); }
+int saveCompiled8(CPU8 &cpu, const char *dir, std::string *err) { return saveCompiled(cpu, dir, err); }
+
+int loadCompiled16(CPU16 &cpu, const char *dir, std::string *err) { return loadCompiled(cpu, dir, err); }
+int saveCompiled16(CPU16 &cpu, const char *dir, std::string *err) { return saveCompiled(cpu, dir, err); }
+
+}
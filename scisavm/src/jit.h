@@ -0,0 +1,108 @@
+#ifndef SCISAVM_JIT_H
+#define SCISAVM_JIT_H
+
+#include "scisavm.h"
+
+// The JIT only knows how to generate x86-64 code for Linux,
+// everywhere else Engine::JIT falls back to Engine::THREADED
+#if defined(__x86_64__) && defined(__linux__) && !defined(SCISAVM_NO_JIT)
+#define SCISAVM_JIT
+#endif
+
+namespace scisavm {
+
+// Bumped whenever the generated code changes,
+// so that code saved by an older version isn't used
+constexpr uint32_t JIT_VERSION = 1;
+
+// The guest state as seen by compiled code.
+// Everything is widened to 32 bits so that the code
+// can stick to 32-bit host registers.
+struct JitState {
+	uint32_t pc;
+	uint32_t sp;
+	uint32_t acc;
+	uint32_t x;
+	uint32_t y;
+
+	uint32_t flagsOut;
+	uint32_t flagsA;
+	uint32_t flagsB;
+	uint32_t flagsC;
+	uint32_t flagsOp;
+
+	const Page *pages;
+};
+
+// Compiled code returns the number of instructions it executed.
+// It returns 0 if the first instruction has to be interpreted.
+using JitFn = int (*)(JitState *);
+
+struct JitBlock {
+	JitFn fn = nullptr;
+
+	// The most instructions the block will execute
+	int count = 0;
+
+	bool compiled = false;
+};
+
+struct JitCache {
+	JitCache(std::span<const uint8_t> pmem, int bits);
+	~JitCache();
+
+	JitCache(const JitCache &) = delete;
+	JitCache &operator=(const JitCache &) = delete;
+
+	bool matches(std::span<const uint8_t> pmem)
+	{
+		return pmem.data() == src && pmem.size() == size;
+	}
+
+	// Get the block starting at 'pc', compiling it if necessary.
+	// The block has no code if the instruction at 'pc' can't be compiled.
+	JitBlock &block(size_t pc)
+	{
+		JitBlock &b = blocks[pc];
+		if (!b.compiled) {
+			compile(pc);
+		}
+		return b;
+	}
+
+	// Use the code saved to 'path' by an earlier save().
+	// Returns 0 on success, 1 if there's no usable file,
+	// or -1 with 'err' set.
+	int load(const std::string &path, std::string *err);
+
+	// Save the compiled code, unless nothing was compiled since
+	// the last load() or save().
+	// Returns 0 on success, or -1 with 'err' set
+	int save(const std::string &path, std::string *err);
+
+private:
+	void compile(size_t pc);
+
+	const uint8_t *src;
+	size_t size;
+	int bits;
+
+	std::vector<JitBlock> blocks;
+
+	uint8_t *code = nullptr;
+	size_t codeSize = 0;
+	size_t codeUsed = 0;
+
+	// A file from load(), mapped executable
+	uint8_t *file = nullptr;
+	size_t fileSize = 0;
+	const uint8_t *fileCode = nullptr;
+	size_t fileCodeSize = 0;
+
+	// Whether anything was compiled since the last load() or save()
+	bool dirty = false;
+};
+
+}
+
+#endif
@@ -1,97 +1,117 @@
 #include "scisavm.h"
+#include "aot.h"
+#include "isa.h"
+#include "jit.h"
+
+#include <cstring>
+
+// Use computed gotos for the threaded engine where the compiler supports it,
+// otherwise Engine::THREADED falls back to the predecoded switch loop
+#if defined(__GNUC__) && !defined(SCISAVM_NO_COMPUTED_GOTO)
+#define SCISAVM_COMPUTED_GOTO
+#endif
 
 namespace scisavm {
 
-enum class Op {
-	SPECIAL = 0b00000,
-	ADD = 0b00001,
-	SUB = 0b00010,
-	ADC = 0b00011,
-	XOR = 0b00100,
-	AND = 0b00101,
-	OR  = 0b00110,
-	CMP = 0b00111,
-	MVX = 0b01000,
-	MVY = 0b01001,
-	MVA = 0b01010,
-	MHA = 0b01011,
-	SPS = 0b01100,
-	LDX = 0b01101,
-	LDW = 0b01110,
-	LDA = 0b01111,
-	STX = 0b10000,
-	STW = 0b10001,
-	STA = 0b10010,
-	JMP = 0b10011,
-	JLR = 0b10100,
-	B   = 0b10101,
-	BCC = 0b10110,
-	BCS = 0b10111,
-	BEQ = 0b11000,
-	BNE = 0b11001,
-	BMI = 0b11010,
-	BPL = 0b11011,
-	BVS = 0b11100,
-	BVC = 0b11101,
-	PUSH = 0b11110,
-	POP = 0b11111,
-};
-
-enum class SpecOp {
-	NOP = 0b000,
-	LSR = 0b001,
-	ROR = 0b010,
-	INC = 0b011,
-	LSP = 0b100,
-	SSP = 0b101,
-	LSW = 0b110,
-	SSW = 0b111,
-};
-
-template<typename T>
-class AddOp: public FlagsOp<T> {
-public:
-	static AddOp<T> self;
-
-	bool carry(Flags<T> &f) override
-	{
-		static_assert(sizeof(uint32_t) > sizeof(T));
-		uint32_t out = uint32_t(f.a) + uint32_t(f.b) + uint32_t(f.c);
-		return out & (1 << (8 * sizeof(T)));
-	}
-
-	bool overflow(Flags<T> &f) override
-	{
-		auto aSign = f.a & (1 << (sizeof(T) * 8 - 1));
-		auto bSign = f.b & (1 << (sizeof(T) * 8 - 1));
-		if (aSign == bSign) {
-			auto outSign = f.out & (1 << (sizeof(T) * 8 - 1));
-			return aSign != outSign;
-		} else {
-			return false;
+template<typename T>
+static void remap(CPU<T> &cpu)
+{
+	using Map = MemoryMap<T>;
+	auto &map = cpu.map;
+
+	for (size_t p = 0; p < map.pages.size(); ++p) {
+		size_t pageStart = p << Map::pageBits;
+		size_t pageEnd = pageStart + Map::pageSize;
+		Page &page = map.pages[p];
+		page = {};
+
+		// IO takes precedence over memory, and earlier mappings
+		// take precedence over later ones, so only the first mapping
+		// which overlaps the page can own the whole page
+		for (MappedIO<T> &io: cpu.io) {
+			size_t start = io.start;
+			size_t end = start + io.size;
+			if (end <= pageStart || start >= pageEnd) {
+				continue;
+			}
+
+			if (start <= pageStart && end >= pageEnd) {
+				page.kind = PageKind::IO;
+				page.io = io.io;
+				page.ioOffset = pageStart - start;
+			} else {
+				page.kind = PageKind::MIXED;
+			}
+			break;
+		}
+
+		if (page.kind != PageKind::NONE) {
+			continue;
+		}
+
+		for (MappedMem<T> &mem: cpu.dmem) {
+			size_t start = mem.start;
+			size_t end = start + mem.data.size();
+			if (end <= pageStart || start >= pageEnd) {
+				continue;
+			}
+
+			if (start <= pageStart && end >= pageEnd) {
+				page.kind = PageKind::MEM;
+				page.mem = mem.data.data() + (pageStart - start);
+			} else {
+				page.kind = PageKind::MIXED;
+			}
+			break;
 		}
 	}
-};
+
+	map.numIO = cpu.io.size();
+	map.numMem = cpu.dmem.size();
+}
+
+// Pass on a device's request to stop the CPU
 template<typename T>
-AddOp<T> AddOp<T>::self;
+static void takeStop(CPU<T> &cpu, MemoryIO *io)
+{
+	if (io->stop != StopReason::NONE) {
+		cpu.stop = io->stop;
+		io->stop = StopReason::NONE;
+	}
+}
 
+// A word is a byte on 8-bit CPUs
 template<typename T>
-class ZOp: public FlagsOp<T> {
-public:
-	static ZOp<T> self;
+static T ioLoadWord(MemoryIO *io, size_t offset)
+{
+	if constexpr (sizeof(T) > 1) {
+		return io->loadWord(offset);
+	} else {
+		return io->load(offset);
+	}
+}
 
-	bool carry(Flags<T> &f) override { return f.c; }
-	bool overflow(Flags<T> &) override { return false; }
-};
 template<typename T>
-ZOp<T> ZOp<T>::self;
+static void ioStoreWord(MemoryIO *io, size_t offset, T val)
+{
+	if constexpr (sizeof(T) > 1) {
+		io->storeWord(offset, val);
+	} else {
+		io->store(offset, val);
+	}
+}
+
+// The slow paths scan the mappings in order.
+// They're used for MIXED pages, and for words which cross a page boundary.
 
 template<typename T>
-uint8_t loadByte(CPU<T> &cpu, T addr)
+static uint8_t loadByteSlow(CPU<T> &cpu, T addr)
 {
 	for (MappedIO<T> &io: cpu.io) {
 		if (addr >= io.start && addr < io.start + io.size) {
-			return io.io->load(addr - io.start);
+			uint8_t val = io.io->load(addr - io.start);
+			takeStop(cpu, io.io);
+			return val;
 		}
 	}
 
@@ -102,12 +122,27 @@ uint8_t loadByte(CPU<T> &cpu, T addr)
 	}
 
 	cpu.error = "Illegal load";
+	cpu.stop = StopReason::ERROR;
 	return 0;
 }
 
 template<typename T>
-T loadWord(CPU<T> &cpu, T addr)
+static T loadWordSlow(CPU<T> &cpu, T addr)
 {
+	// A word has to be entirely inside one mapping
+	for (MappedIO<T> &io: cpu.io) {
+		if (addr + sizeof(T) <= io.start || addr >= io.start + io.size) {
+			continue;
+		}
+
+		if (addr >= io.start && addr + sizeof(T) <= io.start + io.size) {
+			T val = ioLoadWord<T>(io.io, addr - io.start);
+			takeStop(cpu, io.io);
+			return val;
+		}
+		break;
+	}
+
 	for (MappedMem<T> &mem: cpu.dmem) {
 		if (addr >= mem.start && addr + sizeof(T) <= mem.start + mem.data.size()) {
 			T val = mem.data[addr - mem.start];
@@ -119,15 +154,17 @@ T loadWord(CPU<T> &cpu, T addr)
 	}
 
 	cpu.error = "Illegal load";
+	cpu.stop = StopReason::ERROR;
 	return 0;
 }
 
 template<typename T>
-void storeByte(CPU<T> &cpu, T addr, uint8_t val)
+static void storeByteSlow(CPU<T> &cpu, T addr, uint8_t val)
 {
 	for (MappedIO<T> &io: cpu.io) {
 		if (addr >= io.start && addr < io.start + io.size) {
 			io.io->store(addr - io.start, val);
+			takeStop(cpu, io.io);
 			return;
 		}
 	}
@@ -140,11 +177,25 @@ void storeByte(CPU<T> &cpu, T addr, uint8_t val)
 	}
 
 	cpu.error = "Illegal store";
+	cpu.stop = StopReason::ERROR;
 }
 
 template<typename T>
-void storeWord(CPU<T> &cpu, T addr, T val)
+static void storeWordSlow(CPU<T> &cpu, T addr, T val)
 {
+	for (MappedIO<T> &io: cpu.io) {
+		if (addr + sizeof(T) <= io.start || addr >= io.start + io.size) {
+			continue;
+		}
+
+		if (addr >= io.start && addr + sizeof(T) <= io.start + io.size) {
+			ioStoreWord<T>(io.io, addr - io.start, val);
+			takeStop(cpu, io.io);
+			return;
+		}
+		break;
+	}
+
 	for (MappedMem<T> &mem: cpu.dmem) {
 		if (addr >= mem.start && addr + sizeof(T) <= mem.start + mem.data.size()) {
 			mem.data[addr - mem.start] = val & 0x00ff;
@@ -156,6 +207,211 @@ void storeWord(CPU<T> &cpu, T addr, T val)
 	}
 
 	cpu.error = "Illegal store";
+	cpu.stop = StopReason::ERROR;
+}
+
+template<typename T>
+uint8_t loadByte(CPU<T> &cpu, T addr)
+{
+	using Map = MemoryMap<T>;
+	const Page &page = cpu.map.pages[addr >> Map::pageBits];
+	if (page.kind == PageKind::MEM) {
+		return page.mem[addr & Map::pageMask];
+	} else if (page.kind == PageKind::IO) {
+		uint8_t val = page.io->load(page.ioOffset + (addr & Map::pageMask));
+		takeStop(cpu, page.io);
+		return val;
+	} else if (page.kind == PageKind::MIXED) {
+		return loadByteSlow(cpu, addr);
+	}
+
+	cpu.error = "Illegal load";
+	cpu.stop = StopReason::ERROR;
+	return 0;
+}
+
+template<typename T>
+T loadWord(CPU<T> &cpu, T addr)
+{
+	// A word which crosses into the next page takes the slow path
+	using Map = MemoryMap<T>;
+	const Page &page = cpu.map.pages[addr >> Map::pageBits];
+	size_t offset = addr & Map::pageMask;
+	if (offset + sizeof(T) <= Map::pageSize) {
+		if (page.kind == PageKind::MEM) {
+			T val = page.mem[offset];
+			if constexpr (sizeof(T) > 1) {
+				val |= T(page.mem[offset + 1]) << 8;
+			}
+			return val;
+		} else if (page.kind == PageKind::IO) {
+			T val = ioLoadWord<T>(page.io, page.ioOffset + offset);
+			takeStop(cpu, page.io);
+			return val;
+		}
+	}
+
+	return loadWordSlow(cpu, addr);
+}
+
+template<typename T>
+void storeByte(CPU<T> &cpu, T addr, uint8_t val)
+{
+	using Map = MemoryMap<T>;
+	const Page &page = cpu.map.pages[addr >> Map::pageBits];
+	if (page.kind == PageKind::MEM) {
+		page.mem[addr & Map::pageMask] = val;
+		return;
+	} else if (page.kind == PageKind::IO) {
+		page.io->store(page.ioOffset + (addr & Map::pageMask), val);
+		takeStop(cpu, page.io);
+		return;
+	} else if (page.kind == PageKind::MIXED) {
+		storeByteSlow(cpu, addr, val);
+		return;
+	}
+
+	cpu.error = "Illegal store";
+	cpu.stop = StopReason::ERROR;
+}
+
+template<typename T>
+void storeWord(CPU<T> &cpu, T addr, T val)
+{
+	using Map = MemoryMap<T>;
+	const Page &page = cpu.map.pages[addr >> Map::pageBits];
+	size_t offset = addr & Map::pageMask;
+	if (offset + sizeof(T) <= Map::pageSize) {
+		if (page.kind == PageKind::MEM) {
+			page.mem[offset] = val & 0x00ff;
+			if constexpr (sizeof(T) > 1) {
+				page.mem[offset + 1] = (val & 0xff00) >> 8;
+			}
+			return;
+		} else if (page.kind == PageKind::IO) {
+			ioStoreWord<T>(page.io, page.ioOffset + offset, val);
+			takeStop(cpu, page.io);
+			return;
+		}
+	}
+
+	storeWordSlow(cpu, addr, val);
+}
+
+// Copy one page's worth (or less) at a time,
+// since each page can be backed by something different
+template<typename T, typename Mem, typename IO, typename Slow>
+static bool forEachChunk(
+	CPU<T> &cpu, T addr, size_t size, Mem mem, IO io, Slow slow)
+{
+	using Map = MemoryMap<T>;
+	if (cpu.map.numIO != cpu.io.size() || cpu.map.numMem != cpu.dmem.size()) {
+		remap(cpu);
+	}
+
+	size_t done = 0;
+	size_t a = addr;
+	while (done < size) {
+		if (a > T(~T(0))) {
+			return false;
+		}
+
+		const Page &page = cpu.map.pages[a >> Map::pageBits];
+		size_t offset = a & Map::pageMask;
+		size_t len = std::min(size - done, Map::pageSize - offset);
+		if (page.kind == PageKind::MEM) {
+			mem(page.mem + offset, done, len);
+		} else if (page.kind == PageKind::IO) {
+			io(page.io, page.ioOffset + offset, done, len);
+		} else if (page.kind == PageKind::MIXED) {
+			for (size_t i = 0; i < len; ++i) {
+				if (!slow(T(a + i), done + i)) {
+					return false;
+				}
+			}
+		} else {
+			return false;
+		}
+
+		done += len;
+		a += len;
+	}
+
+	return true;
+}
+
+// Find what's mapped at a single address, for MIXED pages
+template<typename T>
+static bool findMapping(CPU<T> &cpu, T addr, MemoryIO *&io, size_t &ioOffset, uint8_t *&mem)
+{
+	io = nullptr;
+	mem = nullptr;
+	for (MappedIO<T> &m: cpu.io) {
+		if (addr >= m.start && addr < m.start + m.size) {
+			io = m.io;
+			ioOffset = addr - m.start;
+			return true;
+		}
+	}
+
+	for (MappedMem<T> &m: cpu.dmem) {
+		if (addr >= m.start && addr < m.start + m.data.size()) {
+			mem = &m.data[addr - m.start];
+			return true;
+		}
+	}
+
+	return false;
+}
+
+template<typename T>
+static bool readBlock(CPU<T> &cpu, T addr, std::span<uint8_t> data)
+{
+	return forEachChunk(cpu, addr, data.size(),
+		[&](const uint8_t *mem, size_t done, size_t len) {
+			memcpy(data.data() + done, mem, len);
+		},
+		[&](MemoryIO *io, size_t offset, size_t done, size_t len) {
+			io->loadBlock(offset, data.subspan(done, len));
+		},
+		[&](T a, size_t done) {
+			MemoryIO *io;
+			size_t ioOffset;
+			uint8_t *mem;
+			if (!findMapping(cpu, a, io, ioOffset, mem)) {
+				return false;
+			}
+
+			data[done] = io ? io->load(ioOffset) : *mem;
+			return true;
+		});
+}
+
+template<typename T>
+static bool writeBlock(CPU<T> &cpu, T addr, std::span<const uint8_t> data)
+{
+	return forEachChunk(cpu, addr, data.size(),
+		[&](uint8_t *mem, size_t done, size_t len) {
+			memcpy(mem, data.data() + done, len);
+		},
+		[&](MemoryIO *io, size_t offset, size_t done, size_t len) {
+			io->storeBlock(offset, data.subspan(done, len));
+		},
+		[&](T a, size_t done) {
+			MemoryIO *io;
+			size_t ioOffset;
+			uint8_t *mem;
+			if (!findMapping(cpu, a, io, ioOffset, mem)) {
+				return false;
+			}
+
+			if (io) {
+				io->store(ioOffset, data[done]);
+			} else {
+				*mem = data[done];
+			}
+			return true;
+		});
 }
 
 template<typename T>
@@ -192,24 +448,313 @@ T getParam(CPU<T> &cpu, uint8_t paramMode, uint8_t second)
 	abort();
 }
 
+// Execute one instruction.
+// 'pc' is the address of the instruction,
+// cpu.pc has already been moved past it.
+// Returns false if execution must stop,
+// either because of an error or because cpu.stop was set.
+// An access which a device answers with IO_WAIT leaves the registers
+// alone, and finish() then puts the PC back on the instruction.
 template<typename T>
-void step(CPU<T> &cpu, int n)
+[[gnu::always_inline]] static inline bool exec(
+	CPU<T> &cpu, Handler handler, uint8_t paramMode, uint8_t second, T pc)
 {
-	if (cpu.error) {
-		return;
+	// We don't *always* need the param,
+	// but we *almost* always need the param.
+	// It never *hurts* to call getParam,
+	// so I'm hoping that by pulling the call outside of the switch,
+	// we get better code gen.
+	T param = getParam(cpu, paramMode, second);
+
+	T out, carry;
+	switch (handler) {
+	case Handler::NOP:
+		break;
+
+	case Handler::LSR:
+		out = cpu.acc >> 1;
+		carry = cpu.acc & 0x01;
+		cpu.flags = { out, 0, 0, carry, FlagsOp::Z };
+		cpu.acc = out;
+		break;
+
+	case Handler::ROR:
+		carry = cpu.acc & 0x01;
+		out = (cpu.acc >> 1) | (cpu.flags.carry() << (sizeof(T) * 8 - 1));
+		cpu.flags = { out, 0, 0, carry, FlagsOp::Z };
+		cpu.acc = out;
+		break;
+
+	case Handler::INC:
+		out = cpu.acc + 1;
+		cpu.flags = { out, cpu.acc, 1, 0, FlagsOp::ADD };
+		cpu.acc = out;
+		break;
+
+	case Handler::LSP:
+		out = loadByte(cpu, T(cpu.sp - second));
+		if (cpu.stop == StopReason::IO_WAIT) {
+			return false;
+		}
+		cpu.acc = out;
+		cpu.flags = { cpu.acc, 0, 0, 0, FlagsOp::Z };
+		return cpu.stop == StopReason::NONE;
+
+	case Handler::SSP:
+		storeByte(cpu, T(cpu.sp - second), cpu.acc);
+		return cpu.stop == StopReason::NONE;
+
+	case Handler::LSW:
+		out = loadWord(cpu, T(cpu.sp - second));
+		if (cpu.stop == StopReason::IO_WAIT) {
+			return false;
+		}
+		cpu.acc = out;
+		cpu.flags = { cpu.acc, 0, 0, 0, FlagsOp::Z };
+		return cpu.stop == StopReason::NONE;
+
+	case Handler::SSW:
+		storeWord(cpu, T(cpu.sp - second), cpu.acc);
+		return cpu.stop == StopReason::NONE;
+
+	case Handler::ADD:
+		out = cpu.acc + param;
+		cpu.flags = { out, cpu.acc, param, 0, FlagsOp::ADD };
+		cpu.acc = out;
+		break;
+
+	case Handler::SUB:
+		out = cpu.acc - param;
+		cpu.flags = { out, cpu.acc, T(~param), 1, FlagsOp::ADD };
+		cpu.acc = out;
+		break;
+
+	case Handler::ADC:
+		carry = cpu.flags.carry();
+		out = cpu.acc + param + carry;
+		cpu.flags = { out, cpu.acc, param, carry, FlagsOp::ADD };
+		cpu.acc = out;
+		break;
+
+	case Handler::XOR:
+		out = cpu.acc ^ param;
+		cpu.flags = { out, 0, 0, 0, FlagsOp::Z };
+		cpu.acc = out;
+		break;
+
+	case Handler::AND:
+		out = cpu.acc & param;
+		cpu.flags = { out, 0, 0, 0, FlagsOp::Z };
+		cpu.acc = cpu.acc & param;
+		break;
+
+	case Handler::OR:
+		out = cpu.acc | param;
+		cpu.flags = { out, 0, 0, 0, FlagsOp::Z };
+		cpu.acc = out;
+		break;
+
+	case Handler::CMP:
+		out = cpu.acc - param;
+		cpu.flags = { out, cpu.acc, T(~param), 1, FlagsOp::ADD };
+		break;
+
+	case Handler::MVX:
+		cpu.x = param;
+		break;
+
+	case Handler::MVY:
+		cpu.y = param;
+		break;
+
+	case Handler::MVA:
+		cpu.acc = param;
+		break;
+
+	case Handler::MHA:
+		if constexpr (sizeof(T) > sizeof(uint8_t)) {
+			cpu.acc = param << 8;
+		} else {
+			cpu.error = "Invalid instruction for bitness";
+			return false;
+		}
+		break;
+
+	case Handler::SPS:
+		cpu.sp = param;
+		break;
+
+	case Handler::LDX:
+		out = loadByte(cpu, param);
+		if (cpu.stop == StopReason::IO_WAIT) {
+			return false;
+		}
+		cpu.x = out;
+		cpu.flags = { cpu.x, 0, 0, 0, FlagsOp::Z };
+		return cpu.stop == StopReason::NONE;
+
+	case Handler::LDW:
+		out = loadWord(cpu, param);
+		if (cpu.stop == StopReason::IO_WAIT) {
+			return false;
+		}
+		cpu.acc = out;
+		cpu.flags = { cpu.y, 0, 0, 0, FlagsOp::Z };
+		return cpu.stop == StopReason::NONE;
+
+	case Handler::LDA:
+		out = loadByte(cpu, param);
+		if (cpu.stop == StopReason::IO_WAIT) {
+			return false;
+		}
+		cpu.acc = out;
+		cpu.flags = { cpu.acc, 0, 0, 0, FlagsOp::Z };
+		return cpu.stop == StopReason::NONE;
+
+	case Handler::STX:
+		storeByte(cpu, param, cpu.x);
+		return cpu.stop == StopReason::NONE;
+
+	case Handler::STW:
+		storeWord(cpu, param, cpu.acc);
+		return cpu.stop == StopReason::NONE;
+
+	case Handler::STA:
+		storeByte(cpu, param, cpu.acc);
+		return cpu.stop == StopReason::NONE;
+
+	case Handler::JMP:
+		cpu.pc = param;
+		break;
+
+	case Handler::JLR:
+		cpu.y = cpu.pc;
+		cpu.pc = param;
+		break;
+
+	case Handler::B:
+		cpu.pc = pc + param;
+		break;
+
+	case Handler::BCC:
+		if (!cpu.flags.carry()) {
+			cpu.pc = pc + param;
+		}
+		break;
+
+	case Handler::BCS:
+		if (cpu.flags.carry()) {
+			cpu.pc = pc + param;
+		}
+		break;
+
+	case Handler::BEQ:
+		if (cpu.flags.zero()) {
+			cpu.pc = pc + param;
+		}
+		break;
+
+	case Handler::BNE:
+		if (!cpu.flags.zero()) {
+			cpu.pc = pc + param;
+		}
+		break;
+
+	case Handler::BMI:
+		if (cpu.flags.negative()) {
+			cpu.pc = pc + param;
+		}
+		break;
+
+	case Handler::BPL:
+		if (!cpu.flags.negative()) {
+			cpu.pc = pc + param;
+		}
+		break;
+
+	case Handler::BVS:
+		if (cpu.flags.overflow()) {
+			cpu.pc = pc + param;
+		}
+		break;
+
+	case Handler::BVC:
+		if (!cpu.flags.overflow()) {
+			cpu.pc = pc + param;
+		}
+		break;
+
+	case Handler::PUSH:
+		storeWord(cpu, cpu.sp, param);
+		if (cpu.stop == StopReason::IO_WAIT) {
+			return false;
+		}
+		cpu.sp += sizeof(T);
+		return cpu.stop == StopReason::NONE;
+
+	case Handler::POP:
+		out = loadWord(cpu, T(cpu.sp - sizeof(T)));
+		if (cpu.stop == StopReason::IO_WAIT) {
+			return false;
+		}
+		cpu.sp -= sizeof(T);
+		switch (paramMode) {
+		case 0b000:
+			break;
+		case 0b001:
+			cpu.x = out;
+			break;
+		case 0b010:
+			cpu.y = out;
+			break;
+		case 0b011:
+			cpu.acc = out;
+			break;
+		default:
+			cpu.error = "Invalid pop";
+			return false;
+		}
+
+		return cpu.stop == StopReason::NONE;
+
+	case Handler::TRUNCATED:
+		cpu.error = "PC out of bounds";
+		return false;
+	}
+
+	return true;
+}
+
+// Whether the instruction at 'pc', which made exec() return false,
+// counts as retired. One which raised an error doesn't, and neither
+// does one which is waiting for IO, which has to run again
+// once the CPU is resumed.
+template<typename T>
+static int finish(CPU<T> &cpu, T pc)
+{
+	if (cpu.stop == StopReason::IO_WAIT) {
+		cpu.pc = pc;
+		return 0;
 	}
 
+	return !cpu.error;
+}
+
+// The engines return the number of instructions retired.
+// They stop early when exec() says so, or when the PC goes out of bounds.
+template<typename T>
+static int stepInterp(CPU<T> &cpu, int n)
+{
 	for (int i = 0; i < n; ++i) {
 		if (cpu.pc >= cpu.pmem.size()) {
 			cpu.error = "PC out of bounds";
-			return;
+			return i;
 		}
 
 		auto pc = cpu.pc;
 
 		// Load instruction
 		uint8_t instr = cpu.pmem[cpu.pc++];
-		auto op = Op(instr >> 3);
 		uint8_t paramMode = instr & 0x07;
 
 		// Load second byte of instruction, if it's a 2-byte instruction
@@ -218,262 +763,720 @@ void step(CPU<T> &cpu, int n)
 		if (hasSecond) {
 			if (cpu.pc >= cpu.pmem.size()) {
 				cpu.error = "PC out of bounds";
-				return;
+				return i;
 			}
 
 			second = cpu.pmem[cpu.pc++];
 		}
 
-		// We don't *always* need the param,
-		// but we *almost* always need the param.
-		// It never *hurts* to call getParam,
-		// so I'm hoping that by pulling the call outside of the switch,
-		// we get better code gen.
-		T param = getParam(cpu, paramMode, second);
-
-		T out, carry;
-		switch (op) {
-		case Op::SPECIAL:
-			switch (SpecOp(paramMode)) {
-			case SpecOp::NOP:
-				break;
-
-			case SpecOp::LSR:
-				out = cpu.acc >> 1;
-				carry = cpu.acc & 0x01;
-				cpu.flags = { out, 0, 0, carry, &ZOp<T>::self };
-				cpu.acc = out;
-				break;
-
-			case SpecOp::ROR:
-				carry = cpu.acc & 0x01;
-				out = (cpu.acc >> 1) | (cpu.flags.carry() << (sizeof(T) * 8 - 1));
-				cpu.flags = { out, 0, 0, carry, &ZOp<T>::self };
-				cpu.acc = out;
-				break;
-
-			case SpecOp::INC:
-				out = cpu.acc + 1;
-				cpu.flags = { out, cpu.acc, 1, 0, &AddOp<T>::self };
-				cpu.acc = out;
-				break;
-
-			case SpecOp::LSP:
-				cpu.acc = loadByte(cpu, T(cpu.sp - second));
-				cpu.flags = { cpu.acc, 0, 0, 0, &ZOp<T>::self };
-				break;
-
-			case SpecOp::SSP:
-				storeByte(cpu, T(cpu.sp - second), cpu.acc);
-				break;
-
-			case SpecOp::LSW:
-				cpu.acc = loadWord(cpu, T(cpu.sp - second));
-				cpu.flags = { cpu.acc, 0, 0, 0, &ZOp<T>::self };
-				break;
-
-			case SpecOp::SSW:
-				storeWord(cpu, T(cpu.sp - second), cpu.acc);
-				break;
+		if (!exec(cpu, handlerFor(instr), paramMode, second, pc)) {
+			return i + finish(cpu, pc);
+		}
+	}
+
+	return n;
+}
+
+static Fusion fusionFor(const DecodedOp &first, const DecodedOp &second)
+{
+	auto next = Handler(second.handler);
+	switch (Handler(first.handler)) {
+	case Handler::CMP:
+		switch (next) {
+		case Handler::BEQ:
+			return Fusion::CMP_BEQ;
+		case Handler::BNE:
+			return Fusion::CMP_BNE;
+		case Handler::BCC:
+			return Fusion::CMP_BCC;
+		case Handler::BCS:
+			return Fusion::CMP_BCS;
+		default:
+			return Fusion::NONE;
+		}
+
+	case Handler::LDA:
+		return next == Handler::ADD ? Fusion::LDA_ADD : Fusion::NONE;
+
+	case Handler::MVA:
+		return next == Handler::STA ? Fusion::MVA_STA : Fusion::NONE;
+
+	case Handler::PUSH:
+		return next == Handler::JLR ? Fusion::PUSH_JLR : Fusion::NONE;
+
+	case Handler::POP:
+		if (next == Handler::JMP && first.paramMode <= 0b011) {
+			return Fusion::POP_JMP;
+		}
+		return Fusion::NONE;
+
+	default:
+		return Fusion::NONE;
+	}
+}
+
+template<typename T>
+static void decode(CPU<T> &cpu)
+{
+	auto &dec = cpu.decoded;
+	dec.src = cpu.pmem.data();
+	dec.size = cpu.pmem.size();
+	dec.ops.resize(cpu.pmem.size());
+
+	for (size_t pc = 0; pc < cpu.pmem.size(); ++pc) {
+		uint8_t instr = cpu.pmem[pc];
+		DecodedOp &op = dec.ops[pc];
+		op.handler = uint8_t(handlerFor(instr));
+		op.paramMode = instr & 0x07;
+		op.second = 0;
+		op.length = 1;
+
+		if (instr & 0b00000'100) {
+			if (pc + 1 >= cpu.pmem.size()) {
+				op.handler = uint8_t(Handler::TRUNCATED);
+			} else {
+				op.second = cpu.pmem[pc + 1];
+				op.length = 2;
 			}
+		}
+	}
 
-			break;
+	for (size_t pc = 0; pc < dec.ops.size(); ++pc) {
+		DecodedOp &op = dec.ops[pc];
+		size_t next = pc + op.length;
+		op.fusion = Fusion::NONE;
 
-		case Op::ADD:
-			out = cpu.acc + param;
-			cpu.flags = { out, cpu.acc, param, 0, &AddOp<T>::self };
-			cpu.acc = out;
-			break;
+		// The pair has to be contiguous without the PC wrapping around
+		if (next < dec.ops.size() && next == T(next)) {
+			op.fusion = fusionFor(op, dec.ops[next]);
+		}
+	}
+}
 
-		case Op::SUB:
-			out = cpu.acc - param;
-			cpu.flags = { out, cpu.acc, T(~param), 1, &AddOp<T>::self };
-			cpu.acc = out;
-			break;
+template<typename T>
+static int stepPredecoded(CPU<T> &cpu, int n)
+{
+	auto &dec = cpu.decoded;
+	if (dec.src != cpu.pmem.data() || dec.size != cpu.pmem.size()) {
+		decode(cpu);
+	}
 
-		case Op::ADC:
-			carry = cpu.flags.carry();
-			out = cpu.acc + param + carry;
-			cpu.flags = { out, cpu.acc, param, carry, &AddOp<T>::self };
-			cpu.acc = out;
-			break;
+	const DecodedOp *ops = dec.ops.data();
+	size_t size = dec.ops.size();
 
-		case Op::XOR:
-			out = cpu.acc ^ param;
-			cpu.flags = { out, 0, 0, 0, &ZOp<T>::self };
-			cpu.acc = out;
-			break;
+	for (int i = 0; i < n; ++i) {
+		if (cpu.pc >= size) {
+			cpu.error = "PC out of bounds";
+			return i;
+		}
 
-		case Op::AND:
-			out = cpu.acc & param;
-			cpu.flags = { out, 0, 0, 0, &ZOp<T>::self };
-			cpu.acc = cpu.acc & param;
-			break;
+		auto pc = cpu.pc;
+		const DecodedOp &op = ops[pc];
+		cpu.pc = pc + op.length;
+
+		if (!exec(cpu, Handler(op.handler), op.paramMode, op.second, pc)) {
+			return i + finish(cpu, pc);
+		}
+	}
+
+	return n;
+}
+
+// Execute a fused pair of instructions.
+// This has the same effect as executing 'a' then 'b',
+// except that flags which 'b' overwrites are never written by 'a',
+// and branches are decided without going through the flags.
+// Returns the number of instructions executed, which is 1
+// if the CPU has to stop after the first one,
+// or 0 if the first one is waiting for IO.
+template<typename T>
+static int execFused(
+	CPU<T> &cpu, Fusion fusion, const DecodedOp &a, const DecodedOp &b, T pc)
+{
+	T pc2 = pc + a.length;
+	cpu.pc = pc2 + b.length;
+
+	// The second param is only read after the first instruction's effects,
+	// since it may depend on a register which the first one changed
+	T param = getParam(cpu, a.paramMode, a.second);
+	T out;
+	bool taken;
+
+	switch (fusion) {
+	case Fusion::NONE:
+	case Fusion::COUNT:
+		// Never executed
+		break;
+
+	case Fusion::CMP_BEQ:
+	case Fusion::CMP_BNE:
+	case Fusion::CMP_BCC:
+	case Fusion::CMP_BCS:
+		out = cpu.acc - param;
+		cpu.flags = { out, cpu.acc, T(~param), 1, FlagsOp::ADD };
+
+		// The carry out of acc + ~param + 1 is set when acc >= param
+		if (fusion == Fusion::CMP_BEQ) {
+			taken = out == 0;
+		} else if (fusion == Fusion::CMP_BNE) {
+			taken = out != 0;
+		} else if (fusion == Fusion::CMP_BCC) {
+			taken = cpu.acc < param;
+		} else {
+			taken = cpu.acc >= param;
+		}
+
+		if (taken) {
+			cpu.pc = pc2 + getParam(cpu, b.paramMode, b.second);
+		}
+		break;
 
-		case Op::OR:
-			out = cpu.acc | param;
-			cpu.flags = { out, 0, 0, 0, &ZOp<T>::self };
+	case Fusion::LDA_ADD:
+		out = loadByte(cpu, param);
+		if (cpu.stop == StopReason::IO_WAIT) {
+			cpu.pc = pc;
+			return 0;
+		}
+		cpu.acc = out;
+		if (cpu.stop != StopReason::NONE) {
+			cpu.flags = { cpu.acc, 0, 0, 0, FlagsOp::Z };
+			cpu.pc = pc2;
+			return 1;
+		}
+		param = getParam(cpu, b.paramMode, b.second);
+		out = cpu.acc + param;
+		cpu.flags = { out, cpu.acc, param, 0, FlagsOp::ADD };
+		cpu.acc = out;
+		break;
+
+	case Fusion::MVA_STA:
+		cpu.acc = param;
+		storeByte(cpu, getParam(cpu, b.paramMode, b.second), cpu.acc);
+		if (cpu.stop == StopReason::IO_WAIT) {
+			cpu.pc = pc2;
+			return 1;
+		}
+		break;
+
+	case Fusion::PUSH_JLR:
+		storeWord(cpu, cpu.sp, param);
+		if (cpu.stop == StopReason::IO_WAIT) {
+			cpu.pc = pc;
+			return 0;
+		}
+		cpu.sp += sizeof(T);
+		if (cpu.stop != StopReason::NONE) {
+			cpu.pc = pc2;
+			return 1;
+		}
+		param = getParam(cpu, b.paramMode, b.second);
+		cpu.y = cpu.pc;
+		cpu.pc = param;
+		break;
+
+	case Fusion::POP_JMP:
+		out = loadWord(cpu, T(cpu.sp - sizeof(T)));
+		if (cpu.stop == StopReason::IO_WAIT) {
+			cpu.pc = pc;
+			return 0;
+		}
+		cpu.sp -= sizeof(T);
+		if (a.paramMode == 0b001) {
+			cpu.x = out;
+		} else if (a.paramMode == 0b010) {
+			cpu.y = out;
+		} else if (a.paramMode == 0b011) {
 			cpu.acc = out;
-			break;
+		}
+		if (cpu.stop != StopReason::NONE) {
+			cpu.pc = pc2;
+			return 1;
+		}
+		cpu.pc = getParam(cpu, b.paramMode, b.second);
+		break;
+	}
 
-		case Op::CMP:
-			out = cpu.acc - param;
-			cpu.flags = { out, cpu.acc, T(~param), 1, &AddOp<T>::self };
-			break;
+	cpu.fusions[size_t(fusion)] += 1;
+	return 2;
+}
 
-		case Op::MVX:
-			cpu.x = param;
-			break;
+template<typename T>
+static int stepFused(CPU<T> &cpu, int n)
+{
+	auto &dec = cpu.decoded;
+	if (dec.src != cpu.pmem.data() || dec.size != cpu.pmem.size()) {
+		decode(cpu);
+	}
 
-		case Op::MVY:
-			cpu.y = param;
-			break;
+	const DecodedOp *ops = dec.ops.data();
+	size_t size = dec.ops.size();
 
-		case Op::MVA:
-			cpu.acc = param;
-			break;
+	for (int i = 0; i < n; ++i) {
+		if (cpu.pc >= size) {
+			cpu.error = "PC out of bounds";
+			return i;
+		}
 
-		case Op::MHA:
-			if constexpr (sizeof(T) > sizeof(uint8_t)) {
-				cpu.acc = param << 8;
-			} else {
-				cpu.error = "Invalid instruction for bitness";
-				return;
+		auto pc = cpu.pc;
+		const DecodedOp &op = ops[pc];
+
+		// A fused pair counts as two instructions,
+		// so it has to fit in what's left of the budget
+		if (op.fusion != Fusion::NONE && i + 1 < n) {
+			int count = execFused(cpu, op.fusion, op, ops[pc + op.length], pc);
+			if (cpu.stop != StopReason::NONE) {
+				return i + count - !!cpu.error;
 			}
-			break;
+			i += 1;
+			continue;
+		}
 
-		case Op::SPS:
-			cpu.sp = param;
-			break;
+		cpu.pc = pc + op.length;
+		if (!exec(cpu, Handler(op.handler), op.paramMode, op.second, pc)) {
+			return i + finish(cpu, pc);
+		}
+	}
 
-		case Op::LDX:
-			cpu.x = loadByte(cpu, param);
-			cpu.flags = { cpu.x, 0, 0, 0, &ZOp<T>::self };
-			break;
+	return n;
+}
 
-		case Op::LDW:
-			cpu.acc = loadWord(cpu, param);
-			cpu.flags = { cpu.y, 0, 0, 0, &ZOp<T>::self };
-			break;
+#ifdef SCISAVM_COMPUTED_GOTO
+// Direct threaded dispatch over the predecoded ops.
+// Every handler ends with its own indirect jump to the next handler,
+// rather than everything going through the one indirect jump
+// of a switch statement, which makes branch prediction much happier.
+// Labels as values is a GNU extension, hence the pragmas.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+template<typename T>
+static int stepThreaded(CPU<T> &cpu, int n)
+{
+	auto &dec = cpu.decoded;
+	if (dec.src != cpu.pmem.data() || dec.size != cpu.pmem.size()) {
+		decode(cpu);
+	}
 
-		case Op::LDA:
-			cpu.acc = loadByte(cpu, param);
-			cpu.flags = { cpu.acc, 0, 0, 0, &ZOp<T>::self };
-			break;
+	static const void *const labels[] = {
+#define X(name) &&handle_##name,
+		FOR_EACH_HANDLER(X)
+#undef X
+	};
+
+	const DecodedOp *ops = dec.ops.data();
+	size_t size = dec.ops.size();
+	const DecodedOp *op;
+	T pc;
+
+	// The number of instructions retired
+	int i = 0;
+
+#define DISPATCH() \
+	do { \
+		if (i >= n) { \
+			return i; \
+		} \
+		if (cpu.pc >= size) { \
+			cpu.error = "PC out of bounds"; \
+			return i; \
+		} \
+		pc = cpu.pc; \
+		op = &ops[pc]; \
+		cpu.pc = pc + op->length; \
+		goto *labels[op->handler]; \
+	} while (0)
+
+	DISPATCH();
+
+	// exec() is always inlined, so with a constant handler,
+	// each of these compiles down to just that handler's case
+#define X(name) \
+	handle_##name: \
+		if (!exec(cpu, Handler::name, op->paramMode, op->second, pc)) { \
+			return i + finish(cpu, pc); \
+		} \
+		i += 1; \
+		DISPATCH();
+	FOR_EACH_HANDLER(X)
+#undef X
+
+#undef DISPATCH
+}
+#pragma GCC diagnostic pop
+#endif
 
-		case Op::STX:
-			storeByte(cpu, param, cpu.x);
-			break;
+#ifdef SCISAVM_JIT
+// Run compiled blocks where we can,
+// and interpret single instructions where we can't
+template<typename T>
+static int stepJit(CPU<T> &cpu, int n)
+{
+	auto &jit = cpu.jit;
+	if (!jit || !jit->matches(cpu.pmem)) {
+		jit = std::make_shared<JitCache>(cpu.pmem, sizeof(T) * 8);
+	}
 
-		case Op::STW:
-			storeWord(cpu, param, cpu.acc);
-			break;
+	JitState st;
+	st.pages = cpu.map.pages.data();
 
-		case Op::STA:
-			storeByte(cpu, param, cpu.acc);
-			break;
+	int i = 0;
+	while (i < n) {
+		if (cpu.pc >= cpu.pmem.size()) {
+			cpu.error = "PC out of bounds";
+			return i;
+		}
 
-		case Op::JMP:
-			cpu.pc = param;
-			break;
+		JitBlock &block = jit->block(cpu.pc);
+		if (block.fn && block.count <= n - i) {
+			st.pc = cpu.pc;
+			st.sp = cpu.sp;
+			st.acc = cpu.acc;
+			st.x = cpu.x;
+			st.y = cpu.y;
+			st.flagsOut = cpu.flags.out;
+			st.flagsA = cpu.flags.a;
+			st.flagsB = cpu.flags.b;
+			st.flagsC = cpu.flags.c;
+			st.flagsOp = uint32_t(cpu.flags.op);
+
+			int count = block.fn(&st);
+
+			cpu.pc = st.pc;
+			cpu.sp = st.sp;
+			cpu.acc = st.acc;
+			cpu.x = st.x;
+			cpu.y = st.y;
+			cpu.flags = {
+				T(st.flagsOut), T(st.flagsA), T(st.flagsB), T(st.flagsC),
+				FlagsOp(st.flagsOp),
+			};
+
+			// A block which didn't get anywhere left its first
+			// instruction to the interpreter
+			i += count;
+			if (count > 0) {
+				continue;
+			}
+		}
 
-		case Op::JLR:
-			cpu.y = cpu.pc;
-			cpu.pc = param;
-			break;
+		// Compiled code never stops the CPU,
+		// since it leaves IO and errors to the interpreter
+		i += stepInterp(cpu, 1);
+		if (cpu.error || cpu.stop != StopReason::NONE) {
+			return i;
+		}
+	}
 
-		case Op::B:
-			cpu.pc = pc + param;
-			break;
+	return i;
+}
+#endif
 
-		case Op::BCC:
-			if (!cpu.flags.carry()) {
-				cpu.pc = pc + param;
-			}
+#ifdef SCISAVM_AOT
+// Run translated code for as long as it can,
+// and interpret single instructions where it can't
+template<typename T>
+static int stepAot(CPU<T> &cpu, int n)
+{
+	AotState st;
+	st.pages = cpu.map.pages.data();
+
+	int i = 0;
+	while (i < n) {
+		st.pc = cpu.pc;
+		st.sp = cpu.sp;
+		st.acc = cpu.acc;
+		st.x = cpu.x;
+		st.y = cpu.y;
+		st.flagsOut = cpu.flags.out;
+		st.flagsA = cpu.flags.a;
+		st.flagsB = cpu.flags.b;
+		st.flagsC = cpu.flags.c;
+		st.flagsOp = uint32_t(cpu.flags.op);
+
+		i += cpu.aot->fn(&st, n - i);
+
+		cpu.pc = st.pc;
+		cpu.sp = st.sp;
+		cpu.acc = st.acc;
+		cpu.x = st.x;
+		cpu.y = st.y;
+		cpu.flags = {
+			T(st.flagsOut), T(st.flagsA), T(st.flagsB), T(st.flagsC),
+			FlagsOp(st.flagsOp),
+		};
+
+		// Translated code only stops early at an instruction
+		// it leaves to us, or when the rest of its block doesn't fit
+		if (i >= n) {
 			break;
+		}
 
-		case Op::BCS:
-			if (cpu.flags.carry()) {
-				cpu.pc = pc + param;
-			}
-			break;
+		i += stepInterp(cpu, 1);
+		if (cpu.error || cpu.stop != StopReason::NONE) {
+			return i;
+		}
+	}
 
-		case Op::BEQ:
-			if (cpu.flags.zero()) {
-				cpu.pc = pc + param;
-			}
-			break;
+	return i;
+}
+#endif
 
-		case Op::BNE:
-			if (!cpu.flags.zero()) {
-				cpu.pc = pc + param;
+template<typename T>
+static int run(CPU<T> &cpu, int n)
+{
+	switch (cpu.engine) {
+	case Engine::INTERP:
+		return stepInterp(cpu, n);
+
+	case Engine::PREDECODED:
+		return stepPredecoded(cpu, n);
+
+	case Engine::THREADED:
+#ifdef SCISAVM_COMPUTED_GOTO
+		return stepThreaded(cpu, n);
+#else
+		return stepPredecoded(cpu, n);
+#endif
+
+	case Engine::JIT:
+#if defined(SCISAVM_JIT)
+		return stepJit(cpu, n);
+#elif defined(SCISAVM_COMPUTED_GOTO)
+		return stepThreaded(cpu, n);
+#else
+		return stepPredecoded(cpu, n);
+#endif
+
+	case Engine::FUSED:
+		return stepFused(cpu, n);
+
+	case Engine::AOT:
+#ifdef SCISAVM_AOT
+		if (cpu.aot && cpu.aot->matches(cpu.pmem, sizeof(T) * 8)) {
+			return stepAot(cpu, n);
+		}
+#endif
+#ifdef SCISAVM_COMPUTED_GOTO
+		return stepThreaded(cpu, n);
+#else
+		return stepPredecoded(cpu, n);
+#endif
+	}
+
+	return 0;
+}
+
+template<typename T>
+static bool isIO(CPU<T> &cpu, T addr)
+{
+	const Page &page = cpu.map.pages[addr >> MemoryMap<T>::pageBits];
+	if (page.kind == PageKind::MIXED) {
+		for (MappedIO<T> &io: cpu.io) {
+			if (addr >= io.start && addr < io.start + io.size) {
+				return true;
 			}
+		}
+	}
+
+	return page.kind == PageKind::IO;
+}
+
+template<typename T>
+static bool atBreakpoint(CPU<T> &cpu)
+{
+	for (T bp: cpu.breakpoints) {
+		if (cpu.pc == bp) {
+			cpu.stop = StopReason::BREAKPOINT;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// With breakpoints, the engine has to stop and check after every instruction.
+// 'first' is whether the first instruction is the first one step() executes,
+// which never stops at a breakpoint.
+template<typename T>
+static int runBreakpoints(CPU<T> &cpu, int n, bool first)
+{
+	int i = 0;
+	while (i < n) {
+		if ((i > 0 || !first) && atBreakpoint(cpu)) {
+			return i;
+		}
+
+		i += run(cpu, 1);
+		if (cpu.error || cpu.stop != StopReason::NONE) {
 			break;
+		}
+	}
 
-		case Op::BMI:
-			if (cpu.flags.negative()) {
-				cpu.pc = pc + param;
-			}
+	return i;
+}
+
+template<typename T>
+static int runChecked(CPU<T> &cpu, int n, bool first)
+{
+	return cpu.breakpoints.empty() ? run(cpu, n) : runBreakpoints(cpu, n, first);
+}
+
+// The last few instructions of every slice of a budget are interpreted
+// one at a time, looking for a loop which can't get anywhere.
+// Returns the number of instructions retired.
+static constexpr int IDLE_PROBE = 64;
+
+// How far step() runs between probes, so that a big budget
+// doesn't spin in an idle loop for all of it before noticing
+static constexpr int IDLE_SLICE = 64 * 1024;
+
+template<typename T>
+static int probeIdle(CPU<T> &cpu, int n, bool first)
+{
+	T pc = cpu.pc;
+	T sp = cpu.sp;
+	T acc = cpu.acc;
+	T x = cpu.x;
+	T y = cpu.y;
+	Flags<T> flags = cpu.flags;
+	bool loadsIO = false;
+
+	int i = 0;
+	while (i < n) {
+		if ((i > 0 || !first) && atBreakpoint(cpu)) {
+			return i;
+		}
+
+		if (cpu.pc >= cpu.pmem.size()) {
 			break;
+		}
 
-		case Op::BPL:
-			if (!cpu.flags.negative()) {
-				cpu.pc = pc + param;
-			}
+		// Look at what the instruction accesses before executing it
+		uint8_t instr = cpu.pmem[cpu.pc];
+		uint8_t second = 0;
+		if ((instr & 0b00000'100) && cpu.pc + 1u < cpu.pmem.size()) {
+			second = cpu.pmem[cpu.pc + 1];
+		}
+
+		T param = getParam(cpu, instr & 0x07, second);
+		T addr;
+		switch (handlerFor(instr)) {
+		case Handler::SSP:
+		case Handler::SSW:
+		case Handler::STX:
+		case Handler::STW:
+		case Handler::STA:
+		case Handler::PUSH:
+			// Anything which stores might be getting somewhere
+			return i + runChecked(cpu, n - i, first && i == 0);
+
+		case Handler::LSP:
+		case Handler::LSW:
+			addr = cpu.sp - second;
+			loadsIO = loadsIO || isIO(cpu, addr) || isIO(cpu, T(addr + sizeof(T) - 1));
 			break;
 
-		case Op::BVS:
-			if (cpu.flags.overflow()) {
-				cpu.pc = pc + param;
-			}
+		case Handler::LDX:
+		case Handler::LDW:
+		case Handler::LDA:
+			loadsIO = loadsIO || isIO(cpu, param) || isIO(cpu, T(param + sizeof(T) - 1));
 			break;
 
-		case Op::BVC:
-			if (!cpu.flags.overflow()) {
-				cpu.pc = pc + param;
-			}
+		case Handler::POP:
+			addr = cpu.sp - sizeof(T);
+			loadsIO = loadsIO || isIO(cpu, addr) || isIO(cpu, T(addr + sizeof(T) - 1));
 			break;
 
-		case Op::PUSH:
-			storeWord(cpu, cpu.sp, param);
-			cpu.sp += sizeof(T);
+		default:
 			break;
+		}
 
-		case Op::POP:
-			cpu.sp -= sizeof(T);
-			out = loadWord(cpu, cpu.sp);
-			switch (paramMode) {
-			case 0b000:
-				break;
-			case 0b001:
-				cpu.x = out;
-				break;
-			case 0b010:
-				cpu.y = out;
-				break;
-			case 0b011:
-				cpu.acc = out;
-				break;
-			default:
-				cpu.error = "Invalid pop";
-				return;
-			}
+		i += stepInterp(cpu, 1);
+		if (cpu.error || cpu.stop != StopReason::NONE) {
+			return i;
+		}
 
-			break;
+		if (
+			cpu.pc == pc && cpu.sp == sp && cpu.acc == acc &&
+			cpu.x == x && cpu.y == y &&
+			cpu.flags.out == flags.out && cpu.flags.a == flags.a &&
+			cpu.flags.b == flags.b && cpu.flags.c == flags.c &&
+			cpu.flags.op == flags.op) {
+			cpu.stop = loadsIO ? StopReason::IO_WAIT : StopReason::HALT;
+			return i;
 		}
 	}
+
+	return i + runChecked(cpu, n - i, first && i == 0);
 }
 
 template<typename T>
-void init(CPU<T> &cpu)
+StepResult step(CPU<T> &cpu, int n)
 {
-	cpu.flags.op = &ZOp<T>::self;
+	if (cpu.error) {
+		return { 0, StopReason::ERROR };
+	}
+
+	if (cpu.map.numIO != cpu.io.size() || cpu.map.numMem != cpu.dmem.size()) {
+		remap(cpu);
+	}
+
+	StepResult res;
+	cpu.stop = StopReason::NONE;
+	if (cpu.detectIdle) {
+		// Small budgets are probed all the way,
+		// so that stepping in small slices still sees HALT
+		while (res.retired < n && !cpu.error && cpu.stop == StopReason::NONE) {
+			int slice = std::min(n - res.retired, IDLE_SLICE);
+			int probe = std::min(slice, IDLE_PROBE);
+			if (slice > probe) {
+				res.retired += runChecked(cpu, slice - probe, res.retired == 0);
+			}
+			if (!cpu.error && cpu.stop == StopReason::NONE) {
+				res.retired += probeIdle(cpu, probe, res.retired == 0);
+			}
+		}
+	} else {
+		res.retired = runChecked(cpu, n, true);
+	}
+
+	if (cpu.error) {
+		res.reason = StopReason::ERROR;
+	} else if (cpu.stop != StopReason::NONE) {
+		res.reason = cpu.stop;
+	} else {
+		res.reason = StopReason::BUDGET;
+	}
+
+	cpu.stop = StopReason::NONE;
+	return res;
+}
+
+const char *fusionName(Fusion fusion)
+{
+	switch (fusion) {
+	case Fusion::NONE: return "NONE";
+	case Fusion::CMP_BEQ: return "CMP+BEQ";
+	case Fusion::CMP_BNE: return "CMP+BNE";
+	case Fusion::CMP_BCC: return "CMP+BCC";
+	case Fusion::CMP_BCS: return "CMP+BCS";
+	case Fusion::LDA_ADD: return "LDA+ADD";
+	case Fusion::MVA_STA: return "MVA+STA";
+	case Fusion::PUSH_JLR: return "PUSH+JLR";
+	case Fusion::POP_JMP: return "POP+JMP";
+	case Fusion::COUNT: break;
+	}
+
+	return "?";
 }
 
-void step8(CPU8 &cpu, int n) { step(cpu, n); }
-void init8(CPU8 &cpu) { init(cpu); }
+StepResult step8(CPU8 &cpu, int n) { return step(cpu, n); }
+void remap8(CPU8 &cpu) { remap(cpu); }
+bool readBlock8(CPU8 &cpu, uint8_t addr, std::span<uint8_t> data) { return readBlock(cpu, addr, data); }
+bool writeBlock8(CPU8 &cpu, uint8_t addr, std::span<const uint8_t> data) { return writeBlock(cpu, addr, data); }
 
-void step16(CPU16 &cpu, int n) { step(cpu, n); }
-void init16(CPU16 &cpu) { init(cpu); }
+StepResult step16(CPU16 &cpu, int n) { return step(cpu, n); }
+void remap16(CPU16 &cpu) { remap(cpu); }
+bool readBlock16(CPU16 &cpu, uint16_t addr, std::span<uint8_t> data) { return readBlock(cpu, addr, data); }
+bool writeBlock16(CPU16 &cpu, uint16_t addr, std::span<const uint8_t> data) { return writeBlock(cpu, addr, data); }
 
 }
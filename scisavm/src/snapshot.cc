@@ -0,0 +1,210 @@
+#include "scisavm.h"
+
+#include <cstring>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace scisavm {
+
+struct CowMem {
+	uint8_t *data = nullptr;
+	size_t size = 0;
+
+	// The memfd behind a snapshot's memory, which children map privately.
+	// -1 if the memory is a plain copy.
+	int fd = -1;
+	bool mapped = false;
+	std::vector<uint8_t> copy;
+
+	CowMem() = default;
+	CowMem(const CowMem &) = delete;
+	CowMem &operator=(const CowMem &) = delete;
+
+	~CowMem()
+	{
+#ifdef __linux__
+		if (mapped) {
+			munmap(data, size);
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+#endif
+	}
+
+	void allocCopy(size_t n)
+	{
+		copy.resize(n);
+		data = copy.data();
+		size = n;
+	}
+};
+
+// Mappings start on host page boundaries,
+// so that a child only copies the pages it writes to
+static constexpr size_t ALIGN = 4096;
+
+static std::shared_ptr<CowMem> allocShared(size_t size)
+{
+	auto mem = std::make_shared<CowMem>();
+	if (size == 0) {
+		return mem;
+	}
+
+#ifdef __linux__
+	int fd = memfd_create("scisavm-snapshot", MFD_CLOEXEC);
+	if (fd >= 0 && ftruncate(fd, size) == 0) {
+		void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (ptr != MAP_FAILED) {
+			mem->data = (uint8_t *)ptr;
+			mem->size = size;
+			mem->fd = fd;
+			mem->mapped = true;
+			return mem;
+		}
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+#endif
+
+	mem->allocCopy(size);
+	return mem;
+}
+
+static std::shared_ptr<CowMem> allocPrivate(const CowMem &shared)
+{
+	auto mem = std::make_shared<CowMem>();
+	if (shared.size == 0) {
+		return mem;
+	}
+
+#ifdef __linux__
+	if (shared.fd >= 0) {
+		void *ptr = mmap(
+			nullptr, shared.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, shared.fd, 0);
+		if (ptr != MAP_FAILED) {
+			mem->data = (uint8_t *)ptr;
+			mem->size = shared.size;
+			mem->mapped = true;
+			return mem;
+		}
+	}
+#endif
+
+	mem->allocCopy(shared.size);
+	memcpy(mem->data, shared.data, shared.size);
+	return mem;
+}
+
+template<typename T>
+static void take(Snapshot<T> &snap, const CPU<T> &cpu)
+{
+	snap.pc = cpu.pc;
+	snap.sp = cpu.sp;
+	snap.acc = cpu.acc;
+	snap.x = cpu.x;
+	snap.y = cpu.y;
+	snap.flags = cpu.flags;
+	snap.error = cpu.error;
+	snap.io = cpu.io;
+	snap.pmem = cpu.pmem;
+	snap.engine = cpu.engine;
+	snap.aot = cpu.aot;
+
+	size_t size = 0;
+	std::vector<size_t> offsets;
+	for (auto &m: cpu.dmem) {
+		offsets.push_back(size);
+		size += (m.data.size() + ALIGN - 1) / ALIGN * ALIGN;
+	}
+
+	snap.mem = allocShared(size);
+	snap.dmem.clear();
+	for (size_t i = 0; i < cpu.dmem.size(); ++i) {
+		auto &m = cpu.dmem[i];
+		uint8_t *data = snap.mem->data + offsets[i];
+		memcpy(data, m.data.data(), m.data.size());
+		snap.dmem.push_back({m.start, {data, m.data.size()}});
+	}
+
+#ifdef __linux__
+	// Catch anyone writing to the frozen memory
+	if (snap.mem->mapped) {
+		mprotect(snap.mem->data, snap.mem->size, PROT_READ);
+	}
+#endif
+}
+
+template<typename T>
+static void fork(const Snapshot<T> &snap, CPU<T> &child)
+{
+	child.pc = snap.pc;
+	child.sp = snap.sp;
+	child.acc = snap.acc;
+	child.x = snap.x;
+	child.y = snap.y;
+	child.flags = snap.flags;
+	child.error = snap.error;
+	child.io = snap.io;
+	child.pmem = snap.pmem;
+	child.engine = snap.engine;
+	child.aot = snap.aot;
+
+	child.decoded = {};
+	child.jit.reset();
+	child.fusions = {};
+
+	child.cow = allocPrivate(*snap.mem);
+	child.dmem.clear();
+	for (auto &m: snap.dmem) {
+		size_t offset = m.data.data() - snap.mem->data;
+		child.dmem.push_back({m.start, {child.cow->data + offset, m.data.size()}});
+	}
+
+	child.remap();
+}
+
+template<typename T>
+static std::bitset<256> dirty(const Snapshot<T> &snap, const CPU<T> &child)
+{
+	constexpr size_t pageSize = MemoryMap<T>::pageSize;
+	constexpr size_t addrSpace = pageSize * 256;
+
+	std::bitset<256> pages;
+	size_t count = std::min(snap.dmem.size(), child.dmem.size());
+	for (size_t i = 0; i < count; ++i) {
+		auto &frozen = snap.dmem[i];
+		auto &mine = child.dmem[i];
+		size_t size = std::min(frozen.data.size(), mine.data.size());
+
+		// Compare one page of the address space at a time
+		size_t offset = 0;
+		while (offset < size && frozen.start + offset < addrSpace) {
+			size_t addr = frozen.start + offset;
+			size_t page = addr / pageSize;
+			size_t len = std::min(size - offset, (page + 1) * pageSize - addr);
+			if (memcmp(frozen.data.data() + offset, mine.data.data() + offset, len) != 0) {
+				pages[page] = true;
+			}
+
+			offset += len;
+		}
+	}
+
+	return pages;
+}
+
+void take8(Snapshot8 &snap, const CPU8 &cpu) { take(snap, cpu); }
+void fork8(const Snapshot8 &snap, CPU8 &child) { fork(snap, child); }
+std::bitset<256> dirty8(const Snapshot8 &snap, const CPU8 &child) { return dirty(snap, child); }
+
+void take16(Snapshot16 &snap, const CPU16 &cpu) { take(snap, cpu); }
+void fork16(const Snapshot16 &snap, CPU16 &child) { fork(snap, child); }
+std::bitset<256> dirty16(const Snapshot16 &snap, const CPU16 &child) { return dirty(snap, child); }
+
+}